@@ -0,0 +1,408 @@
+// -*- mode: c++; c-basic-offset: 4 indent-tabs-mode: nil -*-
+//
+// Copyright 2016 Juho Snellman, released under a MIT license (see
+// LICENSE).
+//
+// Simple timer queues to compare TimerWheel against in the benchmark.
+// They implement just the parts of the TimerWheel interface that the
+// benchmark uses, with the straightforward data structure for each:
+//
+// - HeapTimerQueue: a binary heap, with each event knowing its index
+//   in the heap so that it can be canceled in O(log n).
+// - MapTimerQueue: a std::multimap (i.e. a red-black tree) from
+//   deadline to event.
+// - SingleLevelTimerWheel: a non-hierarchical timer wheel, where an
+//   event is put in the slot for its deadline modulo the number of
+//   slots, and is skipped over on each rotation until its deadline
+//   comes up.
+//
+// Each queue has its own event base class with a cancel() method,
+// and a MemberEvent template like MemberTimerEvent.
+
+#ifndef RATAS_BASELINE_TIMER_QUEUES_H
+#define RATAS_BASELINE_TIMER_QUEUES_H
+
+#include <limits>
+#include <map>
+#include <vector>
+
+#include "../timer-wheel.h"
+
+// An event that executes a member function on an instance of T, like
+// MemberTimerEvent, for the queue with the given event base class.
+template<typename Base, typename T, void(T::*MFun)()>
+class BaselineMemberEvent : public Base {
+public:
+    explicit BaselineMemberEvent(T* obj)
+        : Base(&BaselineMemberEvent::execute_callback),
+          obj_(obj) {
+    }
+
+private:
+    static void execute_callback(Base* event) {
+        auto self = static_cast<BaselineMemberEvent*>(event);
+        (self->obj_->*MFun)();
+    }
+
+    T* obj_;
+};
+
+class HeapTimerQueue {
+public:
+    class Event {
+    public:
+        typedef void (*ExecuteFn)(Event* event);
+
+        void cancel() {
+            if (queue_) {
+                queue_->remove(this);
+            }
+        }
+        bool active() const { return queue_ != NULL; }
+
+    protected:
+        explicit Event(ExecuteFn execute) : execute_(execute) {
+        }
+        ~Event() {
+            cancel();
+        }
+
+    private:
+        Event(const Event& other) = delete;
+        Event& operator=(const Event& other) = delete;
+        friend HeapTimerQueue;
+
+        ExecuteFn execute_;
+        Tick scheduled_at_ = 0;
+        // The queue the event is in, or NULL.
+        HeapTimerQueue* queue_ = NULL;
+        size_t index_ = 0;
+    };
+
+    template<typename T, void(T::*MFun)()>
+    using MemberEvent = BaselineMemberEvent<Event, T, MFun>;
+
+    bool advance(Tick delta) {
+        Tick end = now_ + delta;
+        while (!heap_.empty() && heap_[0]->scheduled_at_ <= end) {
+            Event* event = heap_[0];
+            now_ = event->scheduled_at_;
+            remove(event);
+            event->execute_(event);
+        }
+        now_ = end;
+        return true;
+    }
+
+    void schedule(Event* event, Tick delta) {
+        if (event->queue_) {
+            remove(event);
+        }
+        event->scheduled_at_ = now_ + delta;
+        event->queue_ = this;
+        event->index_ = heap_.size();
+        heap_.push_back(event);
+        sift_up(event->index_);
+    }
+
+    void schedule_in_range(Event* event, Tick start, Tick end) {
+        if (event->queue_ &&
+            event->scheduled_at_ >= now_ + start &&
+            event->scheduled_at_ <= now_ + end) {
+            return;
+        }
+        schedule(event, end);
+    }
+
+    void cancel(Event* event) {
+        event->cancel();
+    }
+
+    Tick now() const { return now_; }
+
+    Tick ticks_to_next_event(Tick max = std::numeric_limits<Tick>::max()) {
+        if (heap_.empty()) {
+            return max;
+        }
+        return std::min(max, heap_[0]->scheduled_at_ - now_);
+    }
+
+private:
+    void remove(Event* event) {
+        size_t index = event->index_;
+        Event* last = heap_.back();
+        heap_.pop_back();
+        event->queue_ = NULL;
+        if (last != event) {
+            place(last, index);
+            sift_up(index);
+            sift_down(last->index_);
+        }
+    }
+
+    void place(Event* event, size_t index) {
+        heap_[index] = event;
+        event->index_ = index;
+    }
+
+    void sift_up(size_t index) {
+        Event* event = heap_[index];
+        while (index > 0) {
+            size_t parent = (index - 1) / 2;
+            if (heap_[parent]->scheduled_at_ <= event->scheduled_at_) {
+                break;
+            }
+            place(heap_[parent], index);
+            index = parent;
+        }
+        place(event, index);
+    }
+
+    void sift_down(size_t index) {
+        Event* event = heap_[index];
+        for (;;) {
+            size_t child = index * 2 + 1;
+            if (child >= heap_.size()) {
+                break;
+            }
+            if (child + 1 < heap_.size() &&
+                heap_[child + 1]->scheduled_at_ < heap_[child]->scheduled_at_) {
+                ++child;
+            }
+            if (event->scheduled_at_ <= heap_[child]->scheduled_at_) {
+                break;
+            }
+            place(heap_[child], index);
+            index = child;
+        }
+        place(event, index);
+    }
+
+    Tick now_ = 0;
+    std::vector<Event*> heap_;
+};
+
+class MapTimerQueue {
+public:
+    class Event;
+    typedef std::multimap<Tick, Event*> Map;
+
+    class Event {
+    public:
+        typedef void (*ExecuteFn)(Event* event);
+
+        void cancel() {
+            if (queue_) {
+                queue_->events_.erase(position_);
+                queue_ = NULL;
+            }
+        }
+        bool active() const { return queue_ != NULL; }
+
+    protected:
+        explicit Event(ExecuteFn execute) : execute_(execute) {
+        }
+        ~Event() {
+            cancel();
+        }
+
+    private:
+        Event(const Event& other) = delete;
+        Event& operator=(const Event& other) = delete;
+        friend MapTimerQueue;
+
+        ExecuteFn execute_;
+        // The queue the event is in, or NULL.
+        MapTimerQueue* queue_ = NULL;
+        Map::iterator position_;
+    };
+
+    template<typename T, void(T::*MFun)()>
+    using MemberEvent = BaselineMemberEvent<Event, T, MFun>;
+
+    bool advance(Tick delta) {
+        Tick end = now_ + delta;
+        while (!events_.empty() && events_.begin()->first <= end) {
+            Event* event = events_.begin()->second;
+            now_ = events_.begin()->first;
+            event->cancel();
+            event->execute_(event);
+        }
+        now_ = end;
+        return true;
+    }
+
+    void schedule(Event* event, Tick delta) {
+        event->cancel();
+        event->queue_ = this;
+        event->position_ = events_.insert(std::make_pair(now_ + delta, event));
+    }
+
+    void schedule_in_range(Event* event, Tick start, Tick end) {
+        if (event->queue_ &&
+            event->position_->first >= now_ + start &&
+            event->position_->first <= now_ + end) {
+            return;
+        }
+        schedule(event, end);
+    }
+
+    void cancel(Event* event) {
+        event->cancel();
+    }
+
+    Tick now() const { return now_; }
+
+    Tick ticks_to_next_event(Tick max = std::numeric_limits<Tick>::max()) {
+        if (events_.empty()) {
+            return max;
+        }
+        return std::min(max, events_.begin()->first - now_);
+    }
+
+private:
+    Tick now_ = 0;
+    Map events_;
+};
+
+template<int WidthBits = 12>
+class SingleLevelTimerWheelT {
+public:
+    class Event {
+    public:
+        typedef void (*ExecuteFn)(Event* event);
+
+        void cancel() {
+            if (!head_) {
+                return;
+            }
+            if (next_) {
+                next_->prev_ = prev_;
+            }
+            if (prev_) {
+                prev_->next_ = next_;
+            } else {
+                *head_ = next_;
+            }
+            head_ = NULL;
+            next_ = prev_ = NULL;
+        }
+        bool active() const { return head_ != NULL; }
+
+    protected:
+        explicit Event(ExecuteFn execute) : execute_(execute) {
+        }
+        ~Event() {
+            cancel();
+        }
+
+    private:
+        Event(const Event& other) = delete;
+        Event& operator=(const Event& other) = delete;
+        friend SingleLevelTimerWheelT;
+
+        void link(Event** head) {
+            head_ = head;
+            next_ = *head;
+            prev_ = NULL;
+            if (next_) {
+                next_->prev_ = this;
+            }
+            *head = this;
+        }
+
+        ExecuteFn execute_;
+        Tick scheduled_at_ = 0;
+        // The head of the list the event is in, or NULL.
+        Event** head_ = NULL;
+        Event* next_ = NULL;
+        Event* prev_ = NULL;
+    };
+
+    template<typename T, void(T::*MFun)()>
+    using MemberEvent = BaselineMemberEvent<Event, T, MFun>;
+
+    SingleLevelTimerWheelT() : slots_(NUM_SLOTS) {
+    }
+
+    bool advance(Tick delta) {
+        while (delta--) {
+            ++now_;
+            // Move the events that are due to a separate list before
+            // executing any, since the callbacks can change the slot.
+            Event* due = NULL;
+            Event* event = slots_[now_ & MASK];
+            while (event) {
+                Event* next = event->next_;
+                if (event->scheduled_at_ == now_) {
+                    event->cancel();
+                    event->link(&due);
+                }
+                event = next;
+            }
+            while (due) {
+                event = due;
+                event->cancel();
+                event->execute_(event);
+            }
+        }
+        return true;
+    }
+
+    void schedule(Event* event, Tick delta) {
+        event->cancel();
+        event->scheduled_at_ = now_ + delta;
+        event->link(&slots_[event->scheduled_at_ & MASK]);
+    }
+
+    void schedule_in_range(Event* event, Tick start, Tick end) {
+        if (event->head_ &&
+            event->scheduled_at_ >= now_ + start &&
+            event->scheduled_at_ <= now_ + end) {
+            return;
+        }
+        schedule(event, end);
+    }
+
+    void cancel(Event* event) {
+        event->cancel();
+    }
+
+    Tick now() const { return now_; }
+
+    // Look for an event in the slots for the next rotation. If there
+    // aren't any, every event needs to be looked at.
+    Tick ticks_to_next_event(Tick max = std::numeric_limits<Tick>::max()) {
+        Tick limit = std::min<Tick>(max, NUM_SLOTS);
+        for (Tick ticks = 1; ticks <= limit; ++ticks) {
+            Tick at = now_ + ticks;
+            for (Event* event = slots_[at & MASK]; event;
+                 event = event->next_) {
+                if (event->scheduled_at_ == at) {
+                    return ticks;
+                }
+            }
+        }
+        if (limit == max) {
+            return max;
+        }
+        Tick min = max;
+        for (Event* head : slots_) {
+            for (Event* event = head; event; event = event->next_) {
+                min = std::min(min, event->scheduled_at_ - now_);
+            }
+        }
+        return min;
+    }
+
+private:
+    static const int NUM_SLOTS = 1 << WidthBits;
+    static const int MASK = NUM_SLOTS - 1;
+
+    Tick now_ = 0;
+    std::vector<Event*> slots_;
+};
+
+typedef SingleLevelTimerWheelT<> SingleLevelTimerWheel;
+
+#endif //  RATAS_BASELINE_TIMER_QUEUES_H
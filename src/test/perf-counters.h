@@ -0,0 +1,208 @@
+// -*- mode: c++; c-basic-offset: 4 indent-tabs-mode: nil -*-
+//
+// Copyright 2016 Juho Snellman, released under a MIT license (see
+// LICENSE).
+//
+// Hardware performance counters for the benchmarks, using Linux's
+// perf_event_open(). User time alone hides most of what the data
+// structure changes are about (cache misses, branch mispredicts), so
+// the benchmarks can count those around the interesting phases:
+//
+//      PerfCounters counters;
+//      counters.start();
+//      ...
+//      counters.stop();
+//      printf("%lf", counters.per(PerfCounters::CYCLES, ops));
+//
+// Each counter is opened separately, so that one the CPU (or VM)
+// doesn't support doesn't prevent counting the others. A counter that
+// couldn't be opened reads as unavailable. If the kernel had to
+// multiplex the counters, the values are scaled up to the full time
+// the counters were running.
+
+#ifndef RATAS_PERF_COUNTERS_H
+#define RATAS_PERF_COUNTERS_H
+
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#endif
+
+class PerfCounters {
+public:
+    enum Counter {
+        CYCLES,
+        INSTRUCTIONS,
+        L1D_MISSES,
+        LLC_MISSES,
+        BRANCH_MISSES,
+        NUM_COUNTERS
+    };
+
+    PerfCounters() {
+        for (int i = 0; i < NUM_COUNTERS; ++i) {
+            fds_[i] = open_counter(Counter(i));
+            values_[i] = 0;
+        }
+    }
+
+    ~PerfCounters() {
+        for (int i = 0; i < NUM_COUNTERS; ++i) {
+            if (fds_[i] >= 0) {
+                close(fds_[i]);
+            }
+        }
+    }
+
+    // Start counting. The counts of consecutive start() / stop() pairs
+    // add up.
+    void start() {
+#ifdef __linux__
+        for (int i = 0; i < NUM_COUNTERS; ++i) {
+            if (fds_[i] >= 0) {
+                read_counter(i, &start_[i]);
+                ioctl(fds_[i], PERF_EVENT_IOC_ENABLE, 0);
+            }
+        }
+#endif
+    }
+
+    // Stop counting, and add the counts since start() to the totals.
+    void stop() {
+#ifdef __linux__
+        // Disable first, so that reading the first counters doesn't
+        // get counted in the later ones.
+        for (int i = 0; i < NUM_COUNTERS; ++i) {
+            if (fds_[i] >= 0) {
+                ioctl(fds_[i], PERF_EVENT_IOC_DISABLE, 0);
+            }
+        }
+        for (int i = 0; i < NUM_COUNTERS; ++i) {
+            Reading end;
+            if (fds_[i] >= 0 && read_counter(i, &end)) {
+                uint64_t count = end.value - start_[i].value;
+                uint64_t enabled = end.enabled - start_[i].enabled;
+                uint64_t running = end.running - start_[i].running;
+                if (running && running < enabled) {
+                    count = uint64_t(double(count) * enabled / running);
+                }
+                values_[i] += count;
+            }
+        }
+#endif
+    }
+
+    // Return true if the counter could be opened.
+    bool available(Counter counter) const {
+        return fds_[counter] >= 0;
+    }
+
+    // Return true if no counter at all could be opened.
+    bool none_available() const {
+        for (int i = 0; i < NUM_COUNTERS; ++i) {
+            if (available(Counter(i))) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    // Return the total count of the counter.
+    uint64_t value(Counter counter) const {
+        return values_[counter];
+    }
+
+    // Return the total count of the counter divided by n, e.g. the
+    // number of operations done. Returns -1 if the counter isn't
+    // available or n is 0.
+    double per(Counter counter, uint64_t n) const {
+        if (!available(counter) || !n) {
+            return -1;
+        }
+        return double(values_[counter]) / n;
+    }
+
+    // Return a short name for the counter, for output.
+    static const char* name(Counter counter) {
+        static const char* names[NUM_COUNTERS] = {
+            "cycles", "instructions", "l1d_misses", "llc_misses",
+            "branch_misses",
+        };
+        return names[counter];
+    }
+
+private:
+    PerfCounters(const PerfCounters& other) = delete;
+    PerfCounters& operator=(const PerfCounters& other) = delete;
+
+    struct Reading {
+        uint64_t value = 0;
+        uint64_t enabled = 0;
+        uint64_t running = 0;
+    };
+
+    static int open_counter(Counter counter) {
+#ifdef __linux__
+        struct perf_event_attr attr;
+        memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.disabled = 1;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED |
+            PERF_FORMAT_TOTAL_TIME_RUNNING;
+        switch (counter) {
+        case CYCLES:
+            attr.type = PERF_TYPE_HARDWARE;
+            attr.config = PERF_COUNT_HW_CPU_CYCLES;
+            break;
+        case INSTRUCTIONS:
+            attr.type = PERF_TYPE_HARDWARE;
+            attr.config = PERF_COUNT_HW_INSTRUCTIONS;
+            break;
+        case L1D_MISSES:
+            attr.type = PERF_TYPE_HW_CACHE;
+            attr.config = PERF_COUNT_HW_CACHE_L1D |
+                (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+            break;
+        case LLC_MISSES:
+            // On most CPUs this is the last level cache.
+            attr.type = PERF_TYPE_HARDWARE;
+            attr.config = PERF_COUNT_HW_CACHE_MISSES;
+            break;
+        case BRANCH_MISSES:
+            attr.type = PERF_TYPE_HARDWARE;
+            attr.config = PERF_COUNT_HW_BRANCH_MISSES;
+            break;
+        default:
+            return -1;
+        }
+        return syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+#else
+        return -1;
+#endif
+    }
+
+    bool read_counter(int i, Reading* reading) {
+        uint64_t buf[3];
+        if (read(fds_[i], buf, sizeof(buf)) != sizeof(buf)) {
+            return false;
+        }
+        reading->value = buf[0];
+        reading->enabled = buf[1];
+        reading->running = buf[2];
+        return true;
+    }
+
+    int fds_[NUM_COUNTERS];
+    uint64_t values_[NUM_COUNTERS];
+    Reading start_[NUM_COUNTERS];
+};
+
+#endif //  RATAS_PERF_COUNTERS_H
@@ -4,10 +4,25 @@
 // LICENSE).
 
 #include <algorithm>
+#include <atomic>
+#include <chrono>
 #include <functional>
+#include <thread>
 #include <vector>
 
 #include "../timer-wheel.h"
+#include "../timer-wheel-compact.h"
+#include "../timer-wheel-parallel.h"
+#include "../timer-wheel-sharded.h"
+#include "../timer-wheel-tiered.h"
+#include "../timer-wheel-tracing.h"
+
+#ifdef __linux__
+#include <poll.h>
+
+#include "../timer-wheel-clock.h"
+#include "../timer-wheel-recorder.h"
+#endif
 
 #define TEST(fun) \
     do {                                              \
@@ -214,6 +229,182 @@ bool test_ticks_to_next_event() {
     return true;
 }
 
+bool test_ticks_to_next_event_canceled() {
+    typedef std::function<void()> Callback;
+    TimerWheel timers;
+    TimerEvent<Callback> timer([] () { });
+    TimerEvent<Callback> timer2([] () { });
+
+    // Canceled timers should not be visible, on any level, even if
+    // the slot they were in was never processed.
+    for (int i = 0; i < 10; ++i) {
+        timers.schedule(&timer, 1 + i * 37);
+        timers.schedule(&timer2, 300 + i * 1000);
+        EXPECT_INTEQ(timers.ticks_to_next_event(), 1 + i * 37);
+        timer.cancel();
+        EXPECT_INTEQ(timers.ticks_to_next_event(), 300 + i * 1000);
+        timer2.cancel();
+        EXPECT_INTEQ(timers.ticks_to_next_event(),
+                     std::numeric_limits<Tick>::max());
+        timers.advance(100);
+    }
+
+    // Same, but with the canceled slot being revisited after a full
+    // rotation of the core wheel.
+    timers.schedule(&timer, 10);
+    timer.cancel();
+    timers.advance(256);
+    timers.schedule(&timer, 20);
+    EXPECT_INTEQ(timers.ticks_to_next_event(), 20);
+
+    return true;
+}
+
+bool test_ticks_to_next_event_cached() {
+    typedef std::function<void()> Callback;
+    TimerWheel timers;
+    std::vector<std::unique_ptr<TimerEvent<Callback>>> events;
+    for (int i = 0; i < 100; ++i) {
+        events.emplace_back(new TimerEvent<Callback>([] () { }));
+    }
+
+    // Mix queries with changes that can either keep the cached
+    // result valid, lower it, or invalidate it, and compare against
+    // the closest deadline of the active events.
+    for (int i = 0; i < 20000; ++i) {
+        auto& event = events[rand() % events.size()];
+        switch (rand() % 8) {
+        case 0:
+            event->cancel();
+            break;
+        case 1:
+            // The destructor cancels the event, and the new one might
+            // get the same address.
+            event.reset();
+            event.reset(new TimerEvent<Callback>([] () { }));
+            break;
+        case 2:
+            timers.advance(1 + rand() % 300);
+            break;
+        default:
+            timers.schedule(event.get(), 1 + (rand() % 3 ? rand() % 1000 :
+                                              rand() % 1000000));
+            break;
+        }
+        Tick expected = std::numeric_limits<Tick>::max();
+        for (auto& event : events) {
+            if (event->active()) {
+                expected = std::min(expected,
+                                    event->scheduled_at() - timers.now());
+            }
+        }
+        Tick max = rand() % 2 ? rand() % 2000 :
+            std::numeric_limits<Tick>::max();
+        EXPECT_INTEQ(timers.ticks_to_next_event(max),
+                     std::min(expected, max));
+        // Asking again gives the same answer.
+        EXPECT_INTEQ(timers.ticks_to_next_event(max),
+                     std::min(expected, max));
+    }
+
+    return true;
+}
+
+bool test_count_due_within() {
+    typedef std::function<void()> Callback;
+    TimerWheel timers;
+    std::vector<std::unique_ptr<TimerEvent<Callback>>> events;
+    std::vector<Tick> deltas;
+    for (int i = 0; i < 2000; ++i) {
+        events.emplace_back(new TimerEvent<Callback>([] () { }));
+        deltas.push_back(1 + rand() % 200000);
+        timers.schedule(events.back().get(), deltas.back());
+    }
+    // Some events are pushed back lazily, which leaves them in their
+    // old slot.
+    for (int i = 0; i < 2000; i += 5) {
+        deltas[i] += rand() % 100000;
+        timers.schedule_lazy(events[i].get(), deltas[i]);
+    }
+    for (int i = 1; i < 2000; i += 7) {
+        events[i]->cancel();
+    }
+
+    Tick windows[] = { 0, 1, 100, 255, 256, 1000, 65535, 65536, 100000,
+                       300000 };
+    for (int round = 0; round < 3; ++round) {
+        for (Tick window : windows) {
+            size_t expected = 0;
+            for (int i = 0; i < 2000; ++i) {
+                if (events[i]->active() &&
+                    events[i]->scheduled_at() - timers.now() <= window) {
+                    ++expected;
+                }
+            }
+            EXPECT_INTEQ(timers.count_due_within(window), expected);
+        }
+        timers.advance(12345);
+    }
+
+    // The histogram has every event in the slot of its level.
+    size_t total = 0;
+    for (int level = 0; level < 8; ++level) {
+        std::vector<size_t> histogram = timers.slot_histogram(level);
+        EXPECT_INTEQ(histogram.size(), 256);
+        size_t on_level = 0;
+        for (size_t count : histogram) {
+            on_level += count;
+        }
+        EXPECT_INTEQ(on_level, timers.events_on_level(level));
+        total += on_level;
+    }
+    EXPECT_INTEQ(total, timers.count_due_within(1000000));
+
+    // Events left over from a partial advance count as due.
+    TimerWheel partial;
+    TimerEvent<Callback> a([] () { }), b([] () { }), c([] () { });
+    partial.schedule(&a, 10);
+    partial.schedule(&b, 10);
+    partial.schedule(&c, 20);
+    EXPECT_INTEQ(partial.count_due_within(9), 0);
+    EXPECT_INTEQ(partial.count_due_within(10), 2);
+    EXPECT(!partial.advance(15, 1));
+    EXPECT_INTEQ(partial.count_due_within(0), 1);
+    EXPECT_INTEQ(partial.count_due_within(10), 2);
+    std::vector<size_t> histogram = partial.slot_histogram(0);
+    EXPECT_INTEQ(histogram[0], 1);
+    EXPECT_INTEQ(histogram[10], 1);
+
+    return true;
+}
+
+// Schedule an event in random ranges of up to 2^range_bits ticks,
+// and check that it always ends up within the range.
+template<typename Wheel>
+bool check_schedule_in_range(Wheel* timers, int range_bits) {
+    typedef typename Wheel::Tick Tick;
+    typedef std::function<void()> Callback;
+    TimerEvent<Callback> timer([] () { });
+
+    for (int i = 0; i < 10000; ++i) {
+        Tick start = 1 + rand() % ((1 << range_bits) - 1);
+        Tick end = start + 1 + rand() % 200;
+        if (end >= (1 << range_bits)) {
+            continue;
+        }
+        timers->schedule_in_range(&timer, start, end);
+        Tick at = Tick(timer.scheduled_at() - timers->now());
+        EXPECT(at >= start);
+        EXPECT(at <= end);
+        timer.cancel();
+        if (i % 100 == 0) {
+            timers->advance(1 + rand() % 1000);
+        }
+    }
+
+    return true;
+}
+
 bool test_schedule_in_range() {
     typedef std::function<void()> Callback;
     TimerWheel timers;
@@ -259,6 +450,96 @@ bool test_schedule_in_range() {
         EXPECT(timers.ticks_to_next_event() <= r2);
     }
 
+    // Ticks narrower than 64 bits.
+    {
+        TimerWheelT<8, 3, uint32_t> timers(0xffffffff - 1000);
+        TimerEvent<Callback> timer([] () { });
+        timers.schedule_in_range(&timer, 25082065, 25082650);
+        EXPECT_INTEQ(uint32_t(timer.scheduled_at() - timers.now()),
+                     25082624);
+        timer.cancel();
+        EXPECT(check_schedule_in_range(&timers, 24));
+    }
+    {
+        TimerWheelT<4, 4, uint16_t> timers(60000);
+        TimerEvent<Callback> timer([] () { });
+        timers.schedule_in_range(&timer, 5000, 5100);
+        EXPECT_INTEQ(uint16_t(timer.scheduled_at() - timers.now()), 5088);
+        timer.cancel();
+        EXPECT(check_schedule_in_range(&timers, 14));
+    }
+
+    return true;
+}
+
+bool test_schedule_lazy() {
+    typedef std::function<void()> Callback;
+    TimerWheel timers;
+    int count = 0;
+    int count2 = 0;
+    Tick executed_at = 0;
+    TimerEvent<Callback> timer([&] () { ++count; executed_at = timers.now(); });
+    TimerEvent<Callback> timer2([&count2] () { ++count2; });
+
+    // Not yet scheduled, so works just like schedule().
+    timers.schedule_lazy(&timer, 10);
+    EXPECT_INTEQ(timers.ticks_to_next_event(), 10);
+
+    // Keep pushing the deadline back, past the next wheel.
+    for (int i = 0; i < 10; ++i) {
+        timers.advance(5);
+        timers.schedule_lazy(&timer, 100);
+        EXPECT_INTEQ(timer.scheduled_at(), timers.now() + 100);
+    }
+    EXPECT_INTEQ(count, 0);
+    timers.schedule_lazy(&timer, 1000);
+    Tick at = timers.now() + 1000;
+
+    // Another event in the same slot as the original deadline of
+    // "timer" still executes on time.
+    timers.schedule(&timer2, 1);
+    timers.advance(1);
+    EXPECT_INTEQ(count2, 1);
+
+    // The wheel might wake up early, but never late.
+    while (!count) {
+        Tick t = timers.ticks_to_next_event();
+        EXPECT(timers.now() + t <= at);
+        timers.advance(t);
+    }
+    EXPECT_INTEQ(executed_at, at);
+
+    // Moving the deadline earlier works as normal.
+    timers.schedule_lazy(&timer, 1000);
+    timers.schedule_lazy(&timer, 10);
+    EXPECT_INTEQ(timers.ticks_to_next_event(), 10);
+    timers.advance(10);
+    EXPECT_INTEQ(count, 2);
+
+    // Random mix of lazy and normal rescheduling.
+    for (int i = 0; i < 1000; ++i) {
+        int len = rand() % 16;
+        Tick r = 4 + rand() % (1 << len);
+        timers.schedule(&timer, r);
+        timers.schedule(&timer2, 1 + rand() % r);
+        for (int j = 0; j < 3; ++j) {
+            r += rand() % (1 << len);
+            timers.schedule_lazy(&timer, r);
+            timers.advance(1);
+            --r;
+        }
+        at = timers.now() + r;
+        while (r > 1) {
+            Tick t = std::min(r - 1, Tick(1 + rand() % (1 << len)));
+            timers.advance(t);
+            r -= t;
+        }
+        EXPECT_INTEQ(count, 2 + i);
+        timers.advance(1);
+        EXPECT_INTEQ(count, 3 + i);
+        EXPECT_INTEQ(executed_at, at);
+    }
+
     return true;
 }
 
@@ -285,6 +566,221 @@ bool test_reschedule_from_timer() {
     return true;
 }
 
+bool test_periodic() {
+    typedef std::function<void()> Callback;
+    typedef PeriodicTimerEvent<Callback, TimerWheelT<8, 8, uint64_t, true>>
+        Periodic;
+    TimerWheelT<8, 8, uint64_t, true> timers;
+    std::vector<Tick> runs;
+    Periodic timer([&] () { runs.push_back(timers.now()); });
+
+    // Each execution is one period after the previous deadline.
+    timer.start(&timers, 5, 10);
+    timers.advance(100);
+    EXPECT_INTEQ(runs.size(), 10);
+    for (size_t i = 0; i < runs.size(); ++i) {
+        EXPECT_INTEQ(runs[i], 5 + 10 * i);
+    }
+    EXPECT_INTEQ(timer.scheduled_at(), 105);
+    EXPECT_INTEQ(timers.stats().rearms, 10);
+    EXPECT_INTEQ(timers.stats().schedules, 1);
+
+    // Periods on the outer wheels.
+    runs.clear();
+    timer.start(&timers, 1000, 1000);
+    timers.advance(10000);
+    EXPECT_INTEQ(runs.size(), 10);
+    EXPECT_INTEQ(runs.back(), 10100);
+
+    // The callback can stop the timer.
+    int count = 0;
+    Periodic stopping([&] () {
+            if (++count == 3) {
+                stopping.cancel();
+            }
+        });
+    stopping.start(&timers, 1, 1);
+    timers.advance(10);
+    EXPECT_INTEQ(count, 3);
+    EXPECT(!stopping.active());
+    timer.cancel();
+
+    // Skipping only executes the timer once per advance, and keeps
+    // the phase.
+    runs.clear();
+    Periodic skipping([&] () { runs.push_back(timers.now()); },
+                      Periodic::SKIP_MISSED);
+    skipping.start(&timers, 5, 10);
+    timers.advance(100);
+    EXPECT_INTEQ(runs.size(), 1);
+    EXPECT_INTEQ(skipping.scheduled_at() - timers.now(), 5);
+    timers.advance(5);
+    EXPECT_INTEQ(runs.size(), 2);
+    timers.advance(10);
+    EXPECT_INTEQ(runs.size(), 3);
+    // A period that ends exactly where the advance does is executed.
+    timers.advance(30);
+    EXPECT_INTEQ(runs.size(), 4);
+    EXPECT_INTEQ(skipping.scheduled_at() - timers.now(), 10);
+    // Including when resuming a partial advance.
+    runs.clear();
+    count = 0;
+    TimerEvent<Callback> other([&] () { ++count; });
+    timers.schedule(&other, 5);
+    EXPECT(!timers.advance(100, 1));
+    EXPECT(timers.advance(0));
+    EXPECT_INTEQ(runs.size(), 1);
+    EXPECT_INTEQ(count, 1);
+    EXPECT_INTEQ(skipping.scheduled_at() - timers.now(), 10);
+
+    return true;
+}
+
+bool test_schedule_with_slack() {
+    typedef std::function<void()> Callback;
+    TimerWheelT<8, 8, uint64_t, true> timers;
+    int count = 0;
+    std::vector<std::unique_ptr<TimerEvent<Callback>>> events;
+    for (int i = 0; i < 10; ++i) {
+        events.emplace_back(new TimerEvent<Callback>([&count] () {
+                    ++count;
+                }));
+    }
+
+    // Events within the slack of a tick that's already in use get
+    // moved to it.
+    timers.schedule(events[0].get(), 20);
+    timers.schedule_with_slack(events[1].get(), 15, 5);
+    EXPECT_INTEQ(events[1]->scheduled_at(), 20);
+    timers.schedule_with_slack(events[2].get(), 10, 20);
+    EXPECT_INTEQ(events[2]->scheduled_at(), 20);
+    EXPECT_INTEQ(timers.stats().coalesced, 2);
+    // Out of range of the slack.
+    timers.schedule_with_slack(events[3].get(), 10, 5);
+    EXPECT(events[3]->scheduled_at() >= 10);
+    EXPECT(events[3]->scheduled_at() <= 15);
+    // No slack.
+    timers.schedule_with_slack(events[4].get(), 19, 0);
+    EXPECT_INTEQ(events[4]->scheduled_at(), 19);
+    // Once it's somewhere in the range, the event stays put.
+    timers.schedule_with_slack(events[1].get(), 18, 10);
+    EXPECT_INTEQ(events[1]->scheduled_at(), 20);
+    EXPECT_INTEQ(timers.stats().in_range_kept, 1);
+    // A closer tick in the range is preferred.
+    timers.schedule_with_slack(events[1].get(), 17, 2);
+    EXPECT_INTEQ(events[1]->scheduled_at(), 19);
+
+    EXPECT_INTEQ(timers.ticks_to_next_event(),
+                 events[3]->scheduled_at());
+    timers.advance(20);
+    EXPECT_INTEQ(count, 5);
+
+    // Many events with random deltas and slack end up on far fewer
+    // ticks, and all of them still get executed within their range.
+    TimerWheel timers2;
+    std::vector<std::unique_ptr<TimerEvent<Callback>>> random_events;
+    std::vector<Tick> start, end;
+    for (int i = 0; i < 1000; ++i) {
+        int index = i;
+        Tick delta = 1 + rand() % 200;
+        Tick slack = rand() % 50;
+        start.push_back(delta);
+        end.push_back(delta + slack);
+        random_events.emplace_back(new TimerEvent<Callback>(
+            [&, index] () {
+                if (timers2.now() < start[index] ||
+                    timers2.now() > end[index]) {
+                    count = -1000000;
+                }
+                ++count;
+            }));
+        timers2.schedule_with_slack(random_events.back().get(), delta, slack);
+    }
+    count = 0;
+    int wakeups = 0;
+    while (count < 1000) {
+        Tick ticks = timers2.ticks_to_next_event(1000);
+        EXPECT(ticks < 1000);
+        timers2.advance(ticks);
+        ++wakeups;
+    }
+    EXPECT_INTEQ(count, 1000);
+    // Without the slack, nearly all of the 200 ticks would be used.
+    EXPECT(wakeups < 100);
+
+    // Ticks narrower than 64 bits.
+    {
+        TimerWheelT<4, 4, uint16_t> timers3(60000);
+        TimerEvent<Callback> timer([] () { });
+        timers3.schedule_with_slack(&timer, 5000, 50);
+        EXPECT_INTEQ(uint16_t(timer.scheduled_at() - timers3.now()), 5040);
+        for (int i = 0; i < 10000; ++i) {
+            uint16_t delta = 1 + rand() % 10000;
+            uint16_t slack = rand() % 200;
+            timers3.schedule_with_slack(&timer, delta, slack);
+            uint16_t at = timer.scheduled_at() - timers3.now();
+            EXPECT(at >= delta);
+            EXPECT(at <= delta + slack);
+            timer.cancel();
+            if (i % 100 == 0) {
+                timers3.advance(1 + rand() % 1000);
+            }
+        }
+    }
+
+    return true;
+}
+
+bool test_schedule_bulk() {
+    typedef std::function<void()> Callback;
+    typedef std::pair<TimerEventInterface*, Tick> Entry;
+    std::vector<std::unique_ptr<TimerEvent<Callback>>> events;
+    std::vector<Entry> batch;
+    TimerWheelT<8, 8, uint64_t, true>* wheel = NULL;
+    int count = 0;
+    for (int i = 0; i < 1000; ++i) {
+        Tick delta = 1 + rand() % 100000;
+        events.emplace_back(new TimerEvent<Callback>([&, i] () {
+                    if (wheel->now() != 100 + batch[i].second) {
+                        count = -1000000;
+                    }
+                    ++count;
+                }));
+        batch.push_back(Entry(events.back().get(), delta));
+    }
+
+    // Built directly by the constructor.
+    TimerWheelT<8, 8, uint64_t, true> timers(100, batch.begin(), batch.end());
+    wheel = &timers;
+    EXPECT_INTEQ(timers.stats().schedules, 1000);
+    for (size_t i = 0; i < batch.size(); ++i) {
+        EXPECT(events[i]->active());
+        EXPECT_INTEQ(events[i]->scheduled_at(), 100 + batch[i].second);
+    }
+    Tick first = std::min_element(batch.begin(), batch.end(),
+                                  [] (const Entry& a, const Entry& b) {
+                                      return a.second < b.second;
+                                  })->second;
+    EXPECT_INTEQ(timers.ticks_to_next_event(), first);
+
+    // Events that are already scheduled get moved.
+    std::vector<Entry> again;
+    for (size_t i = 0; i < batch.size(); i += 2) {
+        again.push_back(Entry(events[i].get(), batch[i].second + 5));
+        batch[i].second += 5;
+    }
+    timers.schedule_bulk(again.begin(), again.end());
+    for (size_t i = 0; i < batch.size(); ++i) {
+        EXPECT_INTEQ(events[i]->scheduled_at(), 100 + batch[i].second);
+    }
+
+    // And everything gets executed on time.
+    timers.advance(100005);
+    EXPECT_INTEQ(count, 1000);
+
+    return true;
+}
+
 bool test_single_timer_random() {
     typedef std::function<void()> Callback;
     TimerWheel timers;
@@ -306,6 +802,289 @@ bool test_single_timer_random() {
     return true;
 }
 
+bool test_advance_large_delta() {
+    typedef std::function<void()> Callback;
+    TimerWheel timers;
+    std::vector<Tick> expected;
+    std::vector<Tick> actual;
+    std::vector<TimerEvent<Callback>*> events;
+
+    // A sparse set of events spread over several levels. Each should
+    // execute exactly on its scheduled tick, no matter how large the
+    // steps the time is advanced in are.
+    for (int i = 0; i < 200; ++i) {
+        int len = rand() % 24;
+        Tick delta = 1 + rand() % (1 << len);
+        auto event = new TimerEvent<Callback>([&timers, &actual] () {
+                actual.push_back(timers.now());
+            });
+        events.push_back(event);
+        timers.schedule(event, delta);
+        expected.push_back(delta);
+    }
+    std::sort(expected.begin(), expected.end());
+
+    while (actual.size() < expected.size()) {
+        int len = rand() % 20;
+        timers.advance(1 + rand() % (1 << len));
+    }
+    EXPECT(actual == expected);
+    EXPECT_INTEQ(timers.ticks_to_next_event(100), 100);
+
+    // Time keeps flowing correctly after an idle period.
+    Tick now = timers.now();
+    timers.advance(1000000);
+    EXPECT_INTEQ(timers.now(), now + 1000000);
+    actual.clear();
+    timers.schedule(events[0], 300);
+    timers.schedule(events[1], 3);
+    timers.advance(299);
+    EXPECT_INTEQ(actual.size(), 1);
+    EXPECT_INTEQ(actual[0], now + 1000003);
+    timers.advance(1);
+    EXPECT_INTEQ(actual.size(), 2);
+    EXPECT_INTEQ(actual[1], now + 1000300);
+
+    for (auto event : events) {
+        delete event;
+    }
+
+    return true;
+}
+
+template<typename Wheel>
+bool check_random_timers(Wheel* timers, int max_len, int range_bits) {
+    typedef std::function<void()> Callback;
+    typedef typename Wheel::Tick Tick;
+    int count = 0;
+    Tick executed_at = 0;
+    TimerEvent<Callback> timer([&] () {
+            ++count;
+            executed_at = timers->now();
+        });
+    TimerEvent<Callback> timer2([] () { });
+
+    for (int i = 0; i < 2000; ++i) {
+        int len = rand() % max_len;
+        Tick r = 1 + rand() % (1 << len);
+        Tick at = timers->now() + r;
+
+        timers->schedule(&timer, r);
+        // Another timer that's always later, to make sure
+        // ticks_to_next_event() doesn't get confused by it.
+        timers->schedule(&timer2, r + 1 + rand() % (1 << len));
+        if (i % 2) {
+            // Events that don't fit in the wheel might need to be
+            // rescheduled before they execute, so the wheel might
+            // want to wake up early.
+            while (count == i) {
+                Tick remaining = at - timers->now();
+                Tick t = timers->ticks_to_next_event();
+                EXPECT(t > 0 && t <= remaining);
+                if (remaining < (Tick(1) << (range_bits - 1))) {
+                    EXPECT_INTEQ(t, remaining);
+                }
+                timers->advance(t);
+            }
+        } else {
+            if (r > 1)
+                timers->advance(r - 1);
+            EXPECT_INTEQ(count, i);
+            timers->advance(1);
+        }
+        EXPECT_INTEQ(count, i + 1);
+        EXPECT(executed_at == at);
+        timer2.cancel();
+    }
+
+    return true;
+}
+
+bool test_custom_geometry() {
+    {
+        // Range of 2^24 ticks, but random deltas of up to 2^26 ticks.
+        // Start close to the wraparound point.
+        TimerWheelT<8, 3, uint32_t> timers(0xffffffff - 1000);
+        EXPECT(check_random_timers(&timers, 26, 24));
+        EXPECT(timers.now() < 0xffffffff - 1000);
+    }
+    {
+        // Levels much narrower than a bitmap word.
+        TimerWheelT<4> timers;
+        EXPECT(check_random_timers(&timers, 24, 64));
+    }
+    {
+        TimerWheelT<10> timers;
+        EXPECT(check_random_timers(&timers, 24, 64));
+    }
+    {
+        TimerWheelT<4, 4, uint16_t> timers(60000);
+        EXPECT(check_random_timers(&timers, 14, 16));
+    }
+
+    return true;
+}
+
+bool test_outer_heap() {
+    typedef std::function<void()> Callback;
+    {
+        TimerWheel timers;
+        timers.set_outer_mode(TimerWheel::OUTER_HEAP);
+        EXPECT(timers.outer_heap_active());
+        std::vector<Tick> fired;
+        TimerEvent<Callback> a([&] () { fired.push_back(timers.now()); });
+        TimerEvent<Callback> b([&] () { fired.push_back(timers.now()); });
+        TimerEvent<Callback> c([&] () { fired.push_back(timers.now()); });
+        TimerEvent<Callback> d([&] () { fired.push_back(timers.now()); });
+        timers.schedule(&a, 100);
+        timers.schedule(&b, 70000);
+        timers.schedule(&c, Tick(1) << 40);
+        timers.schedule(&d, 1000000);
+        EXPECT_INTEQ(timers.events_on_level(0), 1);
+        EXPECT_INTEQ(timers.events_on_level(2), 3);
+        EXPECT_INTEQ(timers.ticks_to_next_event(), 100);
+        EXPECT_INTEQ(timers.count_due_within(1000000), 3);
+        timers.advance(100);
+        EXPECT_INTEQ(timers.ticks_to_next_event(), 69900);
+        d.cancel();
+        // Like on the wheel, an event pushed back lazily is reported
+        // at the time its old bucket is reached.
+        timers.schedule_lazy(&b, 200000);
+        EXPECT_INTEQ(timers.ticks_to_next_event(), 65536 - 100);
+        timers.advance(300000);
+        EXPECT_INTEQ(fired.size(), 2);
+        EXPECT_INTEQ(fired[1], 200100);
+
+        // Switching back to the wheel levels keeps the events.
+        timers.set_outer_mode(TimerWheel::OUTER_WHEEL);
+        EXPECT(!timers.outer_heap_active());
+        EXPECT_INTEQ(timers.events_on_level(2), 0);
+        EXPECT_INTEQ(timers.ticks_to_next_event(),
+                     (Tick(1) << 40) - 300100);
+        timers.advance((Tick(1) << 40) - 300100);
+        EXPECT_INTEQ(fired.size(), 3);
+        EXPECT_INTEQ(fired[2], Tick(1) << 40);
+    }
+
+    {
+        // A heap bucket is reached just before the next event in the
+        // core wheel.
+        TimerWheel timers;
+        timers.set_outer_mode(TimerWheel::OUTER_HEAP);
+        TimerEvent<Callback> a([] () { });
+        TimerEvent<Callback> b([] () { });
+        timers.schedule(&a, 131072);
+        timers.advance(131061);
+        timers.schedule(&b, 16);
+        EXPECT_INTEQ(timers.ticks_to_next_event(), 11);
+    }
+
+    // Events firing at exactly the expected time, also when the time
+    // wraps around and with ranges that don't fit in the wheel.
+    {
+        TimerWheelT<8, 3, uint32_t> timers(0xffffffff - 1000);
+        timers.set_outer_mode(decltype(timers)::OUTER_HEAP);
+        EXPECT(check_random_timers(&timers, 26, 32));
+        EXPECT(timers.now() < 0xffffffff - 1000);
+    }
+    {
+        TimerWheelT<4> timers;
+        timers.set_outer_mode(decltype(timers)::OUTER_HEAP);
+        EXPECT(check_random_timers(&timers, 24, 64));
+    }
+    {
+        TimerWheelT<4, 4, uint16_t> timers(60000);
+        timers.set_outer_mode(decltype(timers)::OUTER_HEAP);
+        EXPECT(check_random_timers(&timers, 14, 16));
+    }
+
+    // Random operations while switching between the modes, checking
+    // the callbacks run on time and ticks_to_next_event() against the
+    // closest deadline.
+    TimerWheel timers;
+    std::vector<std::unique_ptr<TimerEvent<Callback>>> events;
+    int late = 0;
+    for (int i = 0; i < 300; ++i) {
+        TimerEvent<Callback>* event = new TimerEvent<Callback>(
+            [&, i] () {
+                if (events[i]->scheduled_at() != timers.now()) {
+                    ++late;
+                }
+            });
+        events.emplace_back(event);
+    }
+    TimerWheel::OuterMode modes[] = {
+        TimerWheel::OUTER_WHEEL, TimerWheel::OUTER_HEAP,
+        TimerWheel::OUTER_ADAPTIVE,
+    };
+    for (int i = 0; i < 20000; ++i) {
+        auto& event = events[rand() % events.size()];
+        Tick delta = 1 + (rand() % 3 ? rand() % 100000 :
+                          (Tick(rand()) << (rand() % 24)));
+        switch (rand() % 16) {
+        case 0:
+            event->cancel();
+            break;
+        case 1:
+            timers.advance(1 + rand() % 200000);
+            break;
+        case 2: {
+            bool done = timers.advance(1 + rand() % 200000, 2);
+            while (!done) {
+                // Deferred until the tick is done.
+                timers.set_outer_mode(modes[rand() % 3]);
+                done = timers.advance(0, 2);
+            }
+            break;
+        }
+        case 3:
+            timers.set_outer_mode(modes[rand() % 3]);
+            break;
+        default:
+            timers.schedule(event.get(), delta);
+            break;
+        }
+        Tick expected = std::numeric_limits<Tick>::max();
+        for (auto& event : events) {
+            if (event->active()) {
+                expected = std::min(expected,
+                                    event->scheduled_at() - timers.now());
+            }
+        }
+        Tick max = rand() % 2 ? rand() % 200000 :
+            std::numeric_limits<Tick>::max();
+        EXPECT_INTEQ(timers.ticks_to_next_event(max),
+                     std::min(expected, max));
+    }
+    EXPECT_INTEQ(late, 0);
+
+    // Adaptive mode uses the heap only while there are few outer
+    // events. The choice is made when level 1 wraps around with outer
+    // events to process.
+    TimerWheel adaptive;
+    adaptive.set_outer_mode(TimerWheel::OUTER_ADAPTIVE);
+    EXPECT(adaptive.outer_heap_active());
+    std::vector<std::unique_ptr<TimerEvent<Callback>>> many;
+    int count = 0;
+    for (int i = 0; i < 2000; ++i) {
+        many.emplace_back(new TimerEvent<Callback>([&count] () { ++count; }));
+        adaptive.schedule(many.back().get(), 2000000 + i);
+    }
+    EXPECT_INTEQ(adaptive.events_on_level(2), 2000);
+    // Reaches the bit 20 bucket.
+    adaptive.advance(1100000);
+    EXPECT(!adaptive.outer_heap_active());
+    EXPECT_INTEQ(adaptive.events_on_level(2), 2000);
+    many.resize(100);
+    adaptive.advance(900000);
+    EXPECT(adaptive.outer_heap_active());
+    EXPECT_INTEQ(count, 1);
+    adaptive.advance(1000);
+    EXPECT_INTEQ(count, 100);
+
+    return true;
+}
+
 bool test_maxexec() {
     typedef std::function<void()> Callback;
     TimerWheel timers;
@@ -378,6 +1157,90 @@ bool test_maxexec() {
     return true;
 }
 
+// A clock that only moves when told to, for testing deadlines.
+struct ManualClock {
+    typedef std::chrono::nanoseconds duration;
+    typedef duration::rep rep;
+    typedef duration::period period;
+    typedef std::chrono::time_point<ManualClock> time_point;
+    static const bool is_steady = true;
+
+    static time_point now() { return current; }
+    static time_point current;
+};
+
+ManualClock::time_point ManualClock::current;
+
+bool test_deadline() {
+    typedef std::function<void()> Callback;
+    TimerWheel timers;
+    int count = 0;
+    std::vector<std::unique_ptr<TimerEvent<Callback>>> events;
+    for (int i = 0; i < 100; ++i) {
+        events.emplace_back(new TimerEvent<Callback>([&count] () {
+                    ++count;
+                    ManualClock::current += std::chrono::microseconds(1);
+                }));
+    }
+    auto start = ManualClock::now();
+
+    // A deadline that has already passed still executes a batch
+    // of events on each call.
+    for (auto& event : events) {
+        timers.schedule(event.get(), 5);
+    }
+    EXPECT(!timers.advance(5, ManualClock::now(), 10));
+    EXPECT_INTEQ(count, 10);
+    EXPECT_INTEQ(timers.now(), 5);
+    EXPECT(!timers.advance(0, ManualClock::now(), 10));
+    EXPECT_INTEQ(count, 20);
+
+    // The rest fit in the budget.
+    EXPECT(timers.advance(0, ManualClock::now() +
+                          std::chrono::microseconds(100), 10));
+    EXPECT_INTEQ(count, 100);
+    EXPECT(ManualClock::now() - start == std::chrono::microseconds(100));
+
+    // The clock is only checked every check_interval events.
+    count = 0;
+    for (auto& event : events) {
+        timers.schedule(event.get(), 5);
+    }
+    EXPECT(!timers.advance(5, ManualClock::now() +
+                           std::chrono::microseconds(25), 10));
+    EXPECT_INTEQ(count, 30);
+    EXPECT(timers.advance(0, ManualClock::now() +
+                          std::chrono::microseconds(100), 10));
+    EXPECT_INTEQ(count, 100);
+
+    // Promotions count against the budget, even when no events get
+    // executed.
+    count = 0;
+    for (int i = 0; i < 100; ++i) {
+        timers.schedule(events[i].get(), 300 + i);
+    }
+    auto deadline = ManualClock::now();
+    EXPECT(!timers.advance(500, deadline, 50));
+    EXPECT_INTEQ(count, 0);
+    EXPECT_INTEQ(timers.events_on_level(0), 100);
+    // The promotion isn't counted again when resuming.
+    EXPECT(!timers.advance(0, deadline, 50));
+    EXPECT_INTEQ(count, 50);
+    EXPECT(timers.advance(0, deadline + std::chrono::seconds(1), 50));
+    EXPECT_INTEQ(count, 100);
+
+    // A real clock works too.
+    count = 0;
+    for (auto& event : events) {
+        timers.schedule(event.get(), 5);
+    }
+    EXPECT(timers.advance(5, std::chrono::steady_clock::now() +
+                          std::chrono::seconds(10)));
+    EXPECT_INTEQ(count, 100);
+
+    return true;
+}
+
 
 class Test {
 public:
@@ -420,16 +1283,1190 @@ bool test_timeout_method() {
     return true;
 }
 
+// An event type implemented directly on top of TimerEventInterface.
+class CountingEvent : public TimerEventInterface {
+public:
+    CountingEvent() : TimerEventInterface(&CountingEvent::execute_count) {
+    }
+
+    int count() const { return count_; }
+
+private:
+    static void execute_count(TimerEventInterface* event) {
+        static_cast<CountingEvent*>(event)->count_++;
+    }
+
+    int count_ = 0;
+};
+
+bool test_custom_event() {
+    TimerWheel timers;
+    CountingEvent event;
+
+    timers.schedule(&event, 1);
+    timers.advance(1);
+    EXPECT_INTEQ(event.count(), 1);
+    timers.schedule(&event, 300);
+    timers.advance(300);
+    EXPECT_INTEQ(event.count(), 2);
+
+    return true;
+}
+
+// An event that records the sizes of the batches it's executed in.
+class BatchEvent : public TimerEventInterface {
+public:
+    BatchEvent() : TimerEventInterface(&BatchEvent::execute_one) {
+    }
+
+    static void execute_one(TimerEventInterface* event) {
+        batch_sizes.push_back(1);
+    }
+
+    static void execute_batch(TimerEventInterface** events, size_t count) {
+        for (size_t i = 0; i < count; ++i) {
+            if (events[i]->active()) {
+                batch_had_active = true;
+            }
+        }
+        batch_sizes.push_back(count);
+    }
+
+    static std::vector<size_t> batch_sizes;
+    static bool batch_had_active;
+};
+
+std::vector<size_t> BatchEvent::batch_sizes;
+bool BatchEvent::batch_had_active = false;
+
+bool test_batch() {
+    TimerWheelT<8, 8, uint64_t, true> timers;
+    std::vector<BatchEvent> events(10);
+    CountingEvent other;
+    std::vector<size_t>& sizes = BatchEvent::batch_sizes;
+
+    // Without a batch handler, events execute one by one.
+    for (auto& event : events) {
+        timers.schedule(&event, 5);
+    }
+    timers.advance(5);
+    EXPECT_INTEQ(sizes.size(), 10);
+
+    sizes.clear();
+    timers.set_batch_handler(&BatchEvent::execute_one,
+                             &BatchEvent::execute_batch);
+    for (auto& event : events) {
+        timers.schedule(&event, 5);
+    }
+    timers.advance(5);
+    EXPECT_INTEQ(sizes.size(), 1);
+    EXPECT_INTEQ(sizes[0], 10);
+    EXPECT_INTEQ(timers.stats().batches, 1);
+    EXPECT_INTEQ(timers.stats().executions, 20);
+
+    // Only consecutive events of the same type are batched.
+    sizes.clear();
+    for (int i = 0; i < 5; ++i) {
+        timers.schedule(&events[i], 300);
+    }
+    timers.schedule(&other, 300);
+    for (int i = 5; i < 10; ++i) {
+        timers.schedule(&events[i], 300);
+    }
+    timers.advance(300);
+    EXPECT_INTEQ(sizes.size(), 2);
+    EXPECT_INTEQ(sizes[0], 5);
+    EXPECT_INTEQ(sizes[1], 5);
+    EXPECT_INTEQ(other.count(), 1);
+
+    // Batches respect max_execute.
+    sizes.clear();
+    for (auto& event : events) {
+        timers.schedule(&event, 5);
+    }
+    EXPECT(!timers.advance(5, 4));
+    EXPECT(!timers.advance(0, 4));
+    EXPECT(timers.advance(0, 4));
+    EXPECT_INTEQ(sizes.size(), 3);
+    EXPECT_INTEQ(sizes[0], 4);
+    EXPECT_INTEQ(sizes[1], 4);
+    EXPECT_INTEQ(sizes[2], 2);
+
+    // Removing the handler.
+    sizes.clear();
+    timers.set_batch_handler(&BatchEvent::execute_one, NULL);
+    for (auto& event : events) {
+        timers.schedule(&event, 5);
+    }
+    timers.advance(5);
+    EXPECT_INTEQ(sizes.size(), 10);
+    EXPECT(!BatchEvent::batch_had_active);
+
+    return true;
+}
+
+bool test_inline_callback() {
+    TimerWheel timers;
+    int count = 0;
+    // Captures which don't fit in std::function without allocating.
+    std::shared_ptr<int> shared(new int(10));
+    long a = 1, b = 2;
+    TimerEvent<InlineCallback<48>> timer([&count, shared, a, b] () {
+            count += *shared + a + b;
+        });
+    EXPECT_INTEQ(shared.use_count(), 2);
+
+    timers.schedule(&timer, 5);
+    timers.advance(5);
+    EXPECT_INTEQ(count, 13);
+
+    // Move-only, and the captured state moves with it.
+    InlineCallback<> callback([shared, &count] () { count += *shared; });
+    InlineCallback<> moved(std::move(callback));
+    EXPECT(!callback);
+    EXPECT(moved);
+    EXPECT_INTEQ(shared.use_count(), 3);
+    moved();
+    EXPECT_INTEQ(count, 23);
+    callback = std::move(moved);
+    callback();
+    EXPECT_INTEQ(count, 33);
+    callback.reset();
+    EXPECT_INTEQ(shared.use_count(), 2);
+
+    return true;
+}
+
+bool test_schedule_callback() {
+    TimerWheel timers;
+    int count = 0;
+
+    TimerHandle handle = timers.schedule([&count] () { ++count; }, 5);
+    EXPECT(handle.active());
+    timers.advance(5);
+    EXPECT_INTEQ(count, 1);
+    EXPECT(!handle.active());
+    // Canceling a handle that has already been executed is a no-op,
+    // even if the underlying event has been reused.
+    TimerHandle handle2 = timers.schedule([&count] () { count += 10; }, 5);
+    handle.cancel();
+    EXPECT(handle2.active());
+    timers.advance(5);
+    EXPECT_INTEQ(count, 11);
+
+    // Canceled callbacks don't run.
+    handle = timers.schedule([&count] () { ++count; }, 300);
+    handle.cancel();
+    EXPECT(!handle.active());
+    handle.cancel();
+    timers.advance(300);
+    EXPECT_INTEQ(count, 11);
+
+    // Callbacks can schedule more callbacks, and cancel themselves.
+    std::vector<TimerHandle> handles(1000);
+    for (int i = 0; i < 1000; ++i) {
+        handles[i] = timers.schedule([&, i] () {
+                handles[i].cancel();
+                timers.schedule([&count] () { ++count; }, 1 + i);
+            }, 1 + i % 10);
+    }
+    // Cancel every other callback.
+    for (int i = 0; i < 1000; i += 2) {
+        handles[i].cancel();
+    }
+    timers.advance(10);
+    timers.advance(1000);
+    EXPECT_INTEQ(count, 11 + 500);
+
+    // Callbacks that are still scheduled when the wheel is destroyed
+    // are freed without being executed.
+    {
+        TimerWheel timers2;
+        for (int i = 0; i < 1000; ++i) {
+            timers2.schedule([&count] () { ++count; }, 1 + i);
+        }
+        timers2.advance(100);
+    }
+    EXPECT_INTEQ(count, 511 + 100);
+
+    return true;
+}
+
+bool test_next_deadline() {
+    typedef std::function<void()> Callback;
+    TimerWheelT<8, 8, uint64_t, false, true> timers;
+    TimerEvent<Callback> timer([] () { });
+    TimerEvent<Callback> timer2([] () { });
+    TimerEvent<Callback> timer3([&] () {
+            timers.schedule(&timer, 3);
+        });
+    const Tick kNone = std::numeric_limits<Tick>::max();
+
+    EXPECT_INTEQ(timers.next_deadline(), kNone);
+    timers.schedule(&timer, 1000);
+    EXPECT_INTEQ(timers.next_deadline(), 1000);
+    timers.schedule(&timer2, 10);
+    EXPECT_INTEQ(timers.next_deadline(), 10);
+    // Later events don't change it.
+    timers.schedule(&timer3, 20);
+    EXPECT_INTEQ(timers.next_deadline(), 10);
+
+    // Not recomputed until the deadline is reached.
+    timers.advance(5);
+    EXPECT_INTEQ(timers.next_deadline(), 10);
+    timers.advance(5);
+    EXPECT_INTEQ(timers.next_deadline(), 20);
+
+    // Canceling leaves it early, until the next advance() past it.
+    timer3.cancel();
+    EXPECT_INTEQ(timers.next_deadline(), 20);
+    timers.advance(10);
+    EXPECT_INTEQ(timers.next_deadline(), 1000);
+
+    // Events scheduled from callbacks count too.
+    timers.schedule(&timer3, 5);
+    timers.advance(5);
+    EXPECT_INTEQ(timers.next_deadline(), 28);
+    timers.advance(3);
+    EXPECT_INTEQ(timers.next_deadline(), kNone);
+
+    // A partially processed tick keeps the deadline in the past.
+    timers.schedule(&timer, 5);
+    timers.schedule(&timer2, 5);
+    EXPECT(!timers.advance(5, 1));
+    EXPECT_INTEQ(timers.next_deadline(), 33);
+    EXPECT(!timers.advance(0, 1));
+    EXPECT_INTEQ(timers.next_deadline(), 33);
+    EXPECT(timers.advance(0, 1));
+    EXPECT_INTEQ(timers.next_deadline(), kNone);
+
+    return true;
+}
+
+bool test_mailbox() {
+    typedef std::function<void()> Callback;
+    TimerWheel timers;
+    TimerWheelMailbox mailbox;
+    // Called from the other threads too.
+    std::atomic<int> wakeups(0);
+    mailbox.set_wakeup([&wakeups] () { ++wakeups; });
+    timers.set_mailbox(&mailbox);
+    int count = 0;
+    TimerEvent<Callback> timer([&count] () { ++count; });
+    TimerEvent<Callback> timer2([&count] () { count += 10; });
+
+    // Requests are only processed by the wheel's thread.
+    mailbox.schedule(&timer, 5);
+    EXPECT(!timer.active());
+    EXPECT_INTEQ(wakeups, 1);
+    EXPECT_INTEQ(timers.ticks_to_next_event(100), 5);
+    EXPECT(timer.active());
+    EXPECT(mailbox.empty());
+
+    // Only requests earlier than the next event cause a wakeup, and
+    // only the first one of those.
+    mailbox.schedule(&timer2, 10);
+    EXPECT_INTEQ(wakeups, 1);
+    mailbox.schedule(&timer2, 3);
+    EXPECT_INTEQ(wakeups, 2);
+    mailbox.schedule(&timer2, 2);
+    EXPECT_INTEQ(wakeups, 2);
+    // Requests are processed in order.
+    EXPECT_INTEQ(timers.ticks_to_next_event(100), 2);
+    timers.advance(2);
+    EXPECT_INTEQ(count, 10);
+
+    // Nothing scheduled, so anything wakes the owner up.
+    mailbox.cancel(&timer);
+    EXPECT_INTEQ(timers.ticks_to_next_event(100), 100);
+    EXPECT(!timer.active());
+    mailbox.schedule(&timer, 99);
+    EXPECT_INTEQ(wakeups, 3);
+    // advance() processes the requests too.
+    timers.advance(99);
+    EXPECT_INTEQ(count, 11);
+
+    // Requests from multiple threads.
+    const int kThreads = 4;
+    const int kEvents = 1000;
+    std::vector<std::unique_ptr<TimerEvent<Callback>>> events;
+    for (int i = 0; i < kThreads * kEvents; ++i) {
+        events.emplace_back(new TimerEvent<Callback>([&count] () {
+                    ++count;
+                }));
+    }
+    count = 0;
+    std::atomic<int> done(0);
+    std::vector<std::thread> threads;
+    for (int t = 0; t < kThreads; ++t) {
+        threads.emplace_back([&, t] () {
+                for (int i = 0; i < kEvents; ++i) {
+                    auto event = events[t * kEvents + i].get();
+                    mailbox.schedule(event, 1 + i % 500);
+                    // Cancel every tenth event.
+                    if (i % 10 == 0) {
+                        mailbox.cancel(event);
+                    }
+                }
+                ++done;
+            });
+    }
+    // Keep processing requests while they're being made. (But don't
+    // advance the time, or the cancels could arrive too late).
+    while (done < kThreads) {
+        timers.ticks_to_next_event();
+    }
+    for (auto& thread : threads) {
+        thread.join();
+    }
+    timers.advance(1000);
+    EXPECT_INTEQ(count, kThreads * kEvents * 9 / 10);
+
+    timers.set_mailbox(NULL);
+    mailbox.schedule(&timer, 1);
+    timers.advance(10);
+    EXPECT_INTEQ(count, kThreads * kEvents * 9 / 10);
+    EXPECT(!mailbox.empty());
+
+    return true;
+}
+
+bool test_sharded() {
+    typedef std::function<void()> Callback;
+    const int kShards = 4;
+    const int kEvents = 1000;
+    ShardedTimerWheel timers(kShards);
+    EXPECT_INTEQ(timers.current_shard(), kShards);
+
+    std::atomic<int> count(0);
+    std::atomic<int> stealable(0);
+    // Every shard schedules events for all the shards, keyed by the
+    // event index. Events with the same key need to be executed in
+    // order.
+    std::vector<std::unique_ptr<TimerEvent<Callback>>> events;
+    std::vector<int> last_run(kEvents, -1);
+    for (int i = 0; i < kShards * kEvents; ++i) {
+        int key = i % kEvents;
+        int seq = i / kEvents;
+        events.emplace_back(new TimerEvent<Callback>([&, key, seq] () {
+                    if (last_run[key] == seq - 1) {
+                        last_run[key] = seq;
+                    }
+                    ++count;
+                }));
+    }
+
+    std::atomic<int> started(0);
+    std::atomic<int> finished(0);
+    std::vector<std::thread> threads;
+    for (int t = 0; t < kShards; ++t) {
+        threads.emplace_back([&, t] () {
+                timers.bind_thread(t);
+                for (int i = 0; i < kEvents; ++i) {
+                    auto event = events[t * kEvents + i].get();
+                    // Later sequence numbers for a key get later
+                    // deadlines, but are scheduled from a different
+                    // thread.
+                    timers.schedule(timers.shard_for_key(i), event,
+                                    1 + t * 10 + i % 100);
+                }
+                // Shard 0 is the busy one.
+                if (t == 0) {
+                    for (int i = 0; i < kEvents; ++i) {
+                        timers.schedule_stealable([&] () {
+                                ++stealable;
+                            }, 5 + i % 50);
+                    }
+                }
+                ++started;
+                while (finished < kShards) {
+                    timers.advance(10);
+                    if (t != 0 && timers.ready_count() == 0) {
+                        timers.steal(16);
+                    }
+                    if (count == kShards * kEvents && stealable == kEvents &&
+                        timers.ticks_to_next_event(1000) == 1000) {
+                        ++finished;
+                        while (finished < kShards) {
+                            timers.advance();
+                        }
+                    }
+                }
+            });
+    }
+    // Can't start the clock before all the events have been scheduled,
+    // or the order of the keyed events isn't guaranteed.
+    while (started < kShards) {
+        std::this_thread::yield();
+    }
+    for (int now = 1; finished < kShards; ++now) {
+        timers.set_now(std::min(now, 10000));
+        std::this_thread::yield();
+    }
+    for (auto& thread : threads) {
+        thread.join();
+    }
+    EXPECT_INTEQ(count, kShards * kEvents);
+    EXPECT_INTEQ(stealable, kEvents);
+    for (int key = 0; key < kEvents; ++key) {
+        EXPECT_INTEQ(last_run[key], kShards - 1);
+    }
+
+    // A thread can own a shard in each of several groups.
+    ShardedTimerWheel a(2);
+    ShardedTimerWheel b(2);
+    a.bind_thread(1);
+    b.bind_thread(0);
+    EXPECT_INTEQ(a.current_shard(), 1);
+    EXPECT_INTEQ(b.current_shard(), 0);
+    EXPECT_INTEQ(timers.current_shard(), kShards);
+    int fired = 0;
+    a.schedule_stealable([&fired] () { ++fired; }, 1);
+    b.schedule_stealable([&fired] () { fired += 10; }, 2);
+    EXPECT_INTEQ(a.wheel(1).ticks_to_next_event(), 1);
+    EXPECT_INTEQ(b.wheel(0).ticks_to_next_event(), 2);
+    a.set_now(2);
+    b.set_now(2);
+    EXPECT(a.advance());
+    EXPECT_INTEQ(fired, 1);
+    EXPECT(b.advance());
+    EXPECT_INTEQ(fired, 11);
+    a.bind_thread(0);
+    EXPECT_INTEQ(a.current_shard(), 0);
+    EXPECT_INTEQ(b.current_shard(), 0);
+
+    return true;
+}
+
+bool test_sharded_max_execute() {
+    typedef std::function<void()> Callback;
+    ShardedTimerWheel timers(1);
+    timers.bind_thread(0);
+    int count = 0;
+    std::vector<std::unique_ptr<TimerEvent<Callback>>> events;
+    for (int i = 0; i < 20; ++i) {
+        events.emplace_back(new TimerEvent<Callback>([&count] () {
+                    ++count;
+                }));
+        // The limit also applies across slots.
+        timers.schedule(events.back().get(), 1 + i % 4);
+        timers.schedule_stealable([&count] () { ++count; }, 1 + i % 3);
+    }
+    timers.set_now(10);
+    int calls = 0;
+    int last = 0;
+    while (!timers.advance(7)) {
+        EXPECT(count - last <= 7);
+        last = count;
+        ++calls;
+    }
+    EXPECT(count - last <= 7);
+    EXPECT_INTEQ(count, 40);
+    // Moving the stealable callbacks to the ready queue counts too.
+    EXPECT(calls >= 60 / 7);
+
+    // The same limit on a plain wheel.
+    TimerWheel wheel;
+    count = 0;
+    for (auto& event : events) {
+        wheel.schedule(event.get(), 1 + count++ % 10);
+    }
+    count = 0;
+    size_t remaining = 5;
+    EXPECT(!wheel.advance_with_limit(100, &remaining));
+    EXPECT_INTEQ(count, 5);
+    EXPECT_INTEQ(remaining, 0);
+    remaining = 100;
+    EXPECT(wheel.advance_with_limit(0, &remaining));
+    EXPECT_INTEQ(count, 20);
+    EXPECT_INTEQ(remaining, 85);
+
+    return true;
+}
+
+#ifdef __linux__
+// Advance the wheel through the clock with max_execute reached on the
+// way, and check that the resumed advance ends up at the right tick.
+template<typename Wheel>
+bool check_clock_pending(Wheel* timers) {
+    typedef typename Wheel::Tick Tick;
+    typedef std::function<void()> Callback;
+    const uint64_t kMs = 1000000;
+    TimerWheelClockT<Wheel> clock(timers, kMs);
+    Tick base = timers->now();
+    uint64_t start = clock.tick_start_ns();
+    int count = 0;
+    std::vector<std::unique_ptr<TimerEvent<Callback>>> events;
+    for (int i = 0; i < 5; ++i) {
+        events.emplace_back(new TimerEvent<Callback>([&count] () {
+                    ++count;
+                }));
+        timers->schedule(events.back().get(), 5);
+    }
+
+    EXPECT(!clock.advance_to_ns(start + 10 * kMs, 3));
+    EXPECT(clock.next_wakeup_ns() == 0);
+    EXPECT(clock.advance_to_ns(start + 10 * kMs));
+    EXPECT_INTEQ(count, 5);
+    EXPECT_INTEQ(Tick(timers->now() - base), 10);
+    EXPECT(clock.tick_start_ns() == start + 10 * kMs);
+
+    // Resuming with a later time covers both.
+    for (auto& event : events) {
+        timers->schedule(event.get(), 5);
+    }
+    EXPECT(!clock.advance_to_ns(start + 16 * kMs, 3));
+    EXPECT(clock.advance_to_ns(start + 20 * kMs));
+    EXPECT_INTEQ(count, 10);
+    EXPECT_INTEQ(Tick(timers->now() - base), 20);
+    EXPECT(clock.advance_to_ns(start + 30 * kMs));
+    EXPECT_INTEQ(Tick(timers->now() - base), 30);
+
+    return true;
+}
+
+bool test_clock() {
+    typedef std::function<void()> Callback;
+    const uint64_t kMs = 1000000;
+    TimerWheel timers;
+    TimerWheelClock clock(&timers, kMs);
+    int count = 0;
+    TimerEvent<Callback> timer([&count] () { ++count; });
+
+    // Nanoseconds get rounded down to ticks.
+    uint64_t start = clock.tick_start_ns();
+    EXPECT(clock.advance_to_ns(start + 5 * kMs + kMs / 2));
+    EXPECT_INTEQ(timers.now(), 5);
+    EXPECT(clock.tick_start_ns() == start + 5 * kMs);
+    // Time doesn't move backwards.
+    EXPECT(clock.advance_to_ns(start + 2 * kMs));
+    EXPECT_INTEQ(timers.now(), 5);
+
+    EXPECT(clock.next_wakeup_ns() == std::numeric_limits<uint64_t>::max());
+    EXPECT_INTEQ(clock.poll_timeout_ms(), -1);
+    timers.schedule(&timer, 5);
+    EXPECT(clock.next_wakeup_ns() == start + 10 * kMs);
+    EXPECT(clock.next_wakeup_ns(2) == start + 7 * kMs);
+
+    // With slack, wakeups get rounded up to a multiple of it.
+    TimerWheel timers2;
+    TimerWheelClock clock2(&timers2, kMs, CLOCK_MONOTONIC, 8);
+    uint64_t start2 = clock2.tick_start_ns();
+    TimerEvent<Callback> timer2([&count] () { ++count; });
+    timers2.schedule(&timer2, 10);
+    EXPECT(clock2.next_wakeup_ns() == start2 + 16 * kMs);
+    EXPECT(clock2.advance_to_ns(start2 + 16 * kMs));
+    EXPECT_INTEQ(count, 1);
+
+    // A real timerfd, with a coarse clock.
+    TimerWheel timers3;
+    TimerWheelClock clock3(&timers3, kMs, CLOCK_MONOTONIC_COARSE);
+    TimerEvent<Callback> timer3([&count] () { ++count; });
+    EXPECT(clock3.timerfd() >= 0);
+    timers3.schedule(&timer3, 2);
+    EXPECT(clock3.arm());
+    struct pollfd fd = { clock3.timerfd(), POLLIN, 0 };
+    EXPECT_INTEQ(poll(&fd, 1, 1000), 1);
+    EXPECT(clock3.handle_timerfd());
+    EXPECT_INTEQ(count, 2);
+    // Nothing scheduled, so the timerfd gets disarmed.
+    EXPECT_INTEQ(poll(&fd, 1, 10), 0);
+
+    {
+        TimerWheel timers4(1000);
+        EXPECT(check_clock_pending(&timers4));
+    }
+    {
+        // Wraps around during the test.
+        TimerWheelT<8, 4, uint32_t> timers4(0xffffffff - 15);
+        EXPECT(check_clock_pending(&timers4));
+    }
+
+    return true;
+}
+
+bool test_record() {
+    typedef std::function<void()> Callback;
+    TimerWheel timers(1000);
+    FILE* file = tmpfile();
+    EXPECT(file);
+    std::unique_ptr<TimerWheelRecorder> recorder(
+        new TimerWheelRecorder(&timers, fileno(file)));
+    TimerEvent<Callback> b([] () { });
+    TimerEvent<Callback> a([&] () { recorder->schedule(&b, 3); });
+    std::vector<std::unique_ptr<TimerEvent<Callback>>> many;
+    for (int i = 0; i < 3; ++i) {
+        many.emplace_back(new TimerEvent<Callback>([] () { }));
+    }
+
+    recorder->schedule(&a, 5);
+    recorder->schedule_in_range(&b, 10, 20);
+    // The callback of a reschedules b on tick 1005.
+    EXPECT(recorder->advance(10));
+    EXPECT_INTEQ(b.scheduled_at(), 1008);
+    recorder->cancel(&b);
+    EXPECT(!b.active());
+    for (auto& event : many) {
+        recorder->schedule(event.get(), 100);
+    }
+    // Hits max_execute on tick 1110, and the next advance also covers
+    // the 50 ticks left over.
+    EXPECT(!recorder->advance(150, 1));
+    EXPECT_INTEQ(timers.now(), 1110);
+    EXPECT(recorder->advance(5));
+    EXPECT_INTEQ(timers.now(), 1165);
+    // Operations done on the wheel directly aren't recorded.
+    timers.schedule(&a, 1);
+    a.cancel();
+    EXPECT(recorder->flush());
+    recorder.reset();
+
+    std::vector<char> data(ftell(file));
+    rewind(file);
+    EXPECT_INTEQ(fread(&data[0], 1, data.size(), file), data.size());
+    fclose(file);
+
+    TimerTraceReader reader(&data[0], data.size());
+    EXPECT_INTEQ(reader.start_tick(), 1000);
+    std::vector<TimerTraceOp> ops;
+    TimerTraceOp op;
+    while (reader.next(&op)) {
+        ops.push_back(op);
+    }
+    EXPECT(!reader.error());
+    EXPECT_INTEQ(ops.size(), 10);
+
+    EXPECT_INTEQ(ops[0].type, TimerTraceOp::SCHEDULE);
+    EXPECT_INTEQ(ops[0].tick, 1000);
+    EXPECT_INTEQ(ops[0].a, 5);
+    EXPECT_INTEQ(ops[1].type, TimerTraceOp::SCHEDULE_IN_RANGE);
+    EXPECT_INTEQ(ops[1].a, 10);
+    EXPECT_INTEQ(ops[1].b, 20);
+    EXPECT(ops[1].event != ops[0].event);
+    EXPECT_INTEQ(ops[2].type, TimerTraceOp::ADVANCE);
+    EXPECT_INTEQ(ops[2].tick, 1000);
+    EXPECT_INTEQ(ops[2].a, 10);
+    EXPECT(ops[2].b == std::numeric_limits<size_t>::max());
+    EXPECT_INTEQ(ops[3].type, TimerTraceOp::SCHEDULE);
+    EXPECT_INTEQ(ops[3].tick, 1005);
+    EXPECT_INTEQ(ops[3].a, 3);
+    EXPECT(ops[3].event == ops[1].event);
+    EXPECT_INTEQ(ops[4].type, TimerTraceOp::CANCEL);
+    EXPECT_INTEQ(ops[4].tick, 1010);
+    EXPECT(ops[4].event == ops[1].event);
+    for (int i = 5; i < 8; ++i) {
+        EXPECT_INTEQ(ops[i].type, TimerTraceOp::SCHEDULE);
+        EXPECT_INTEQ(ops[i].a, 100);
+    }
+    EXPECT(ops[6].event != ops[5].event);
+    EXPECT_INTEQ(ops[8].type, TimerTraceOp::ADVANCE);
+    EXPECT_INTEQ(ops[8].a, 150);
+    EXPECT_INTEQ(ops[8].b, 1);
+    EXPECT_INTEQ(ops[9].type, TimerTraceOp::ADVANCE);
+    EXPECT_INTEQ(ops[9].tick, 1110);
+    EXPECT_INTEQ(ops[9].a, 55);
+
+    // A truncated trace is an error.
+    TimerTraceReader truncated(&data[0], data.size() - 1);
+    while (truncated.next(&op)) {
+    }
+    EXPECT(truncated.error());
+    EXPECT(TimerTraceReader("RATAS", 5).error());
+
+    return true;
+}
+#endif
+
+bool test_compact() {
+    typedef CompactTimerWheel<uint64_t> Wheel;
+    EXPECT_INTEQ(Wheel::bytes_per_timer(), 24);
+    // Start near a point where the 32-bit deadlines wrap around.
+    Tick start = (Tick(1) << 32) - 1000;
+    Wheel timers(start);
+    std::vector<Tick> fired;
+    auto handler = [&] (Wheel::Id id) {
+        if (timers.now() != timers.payload(id)) {
+            fired.push_back(0);
+        }
+        fired.push_back(timers.now());
+    };
+
+    auto a = timers.create(start + 10);
+    auto b = timers.create(start + 300);
+    auto c = timers.create(start + 100000);
+    timers.schedule(a, 10);
+    timers.schedule(b, 300);
+    timers.schedule(c, 100000);
+    EXPECT(timers.active(c));
+    EXPECT_INTEQ(timers.scheduled_at(c), start + 100000);
+    EXPECT_INTEQ(timers.ticks_to_next_event(), 10);
+    timers.advance(10, handler);
+    EXPECT_INTEQ(fired.size(), 1);
+    EXPECT(!timers.active(a));
+    EXPECT_INTEQ(timers.ticks_to_next_event(), 290);
+    timers.cancel(b);
+    EXPECT_INTEQ(timers.ticks_to_next_event(), 99990);
+    EXPECT_INTEQ(timers.ticks_to_next_event(1000), 1000);
+    timers.advance(100000, handler);
+    EXPECT_INTEQ(fired.size(), 2);
+    EXPECT_INTEQ(fired.back(), start + 100000);
+    EXPECT_INTEQ(timers.now(), start + 100010);
+
+    // Destroyed ids get reused.
+    EXPECT_INTEQ(timers.size(), 3);
+    timers.destroy(b);
+    EXPECT_INTEQ(timers.size(), 2);
+    EXPECT_INTEQ(timers.create(0), b);
+
+    // Many timers with random deltas, with some of them getting
+    // canceled and some rescheduled from the handler.
+    Wheel random_timers;
+    std::vector<Wheel::Id> ids;
+    int count = 0;
+    int rescheduled = 0;
+    auto random_handler = [&] (Wheel::Id id) {
+        if (random_timers.now() != random_timers.payload(id)) {
+            count = -1000000;
+        }
+        ++count;
+        if (id % 10 == 0 && id == ids[id]) {
+            Tick delta = 1 + rand() % 100000;
+            ids[id] = Wheel::Id(-1);
+            random_timers.payload(id) = random_timers.now() + delta;
+            random_timers.schedule(id, delta);
+            ++rescheduled;
+        }
+    };
+    for (int i = 0; i < 10000; ++i) {
+        Tick delta = 1 + rand() % 1000000;
+        ids.push_back(random_timers.create(delta));
+        random_timers.schedule(ids.back(), delta);
+    }
+    for (int i = 1; i < 10000; i += 7) {
+        random_timers.cancel(ids[i]);
+    }
+    int canceled = (10000 + 5) / 7;
+    // With a limit on the number executed per call.
+    bool done = random_timers.advance(50000, random_handler, 100);
+    EXPECT(!done);
+    while (!done) {
+        done = random_timers.advance(0, random_handler, 100);
+    }
+    while (random_timers.ticks_to_next_event(2000000) < 2000000) {
+        random_timers.advance(
+            random_timers.ticks_to_next_event(), random_handler);
+    }
+    EXPECT_INTEQ(count, 10000 - canceled + rescheduled);
+
+    return true;
+}
+
+bool test_stats() {
+    typedef std::function<void()> Callback;
+    typedef TimerWheelT<8, 8, uint64_t, true> StatsTimerWheel;
+    StatsTimerWheel timers;
+    TimerEvent<Callback> timer([] () { });
+    TimerEvent<Callback> timer2([] () { });
+
+    timers.schedule(&timer, 10);
+    timers.schedule(&timer, 11);
+    EXPECT_INTEQ(timers.stats().schedules, 2);
+    EXPECT_INTEQ(timers.stats().schedules_same_slot, 0);
+    // Same slot on the second wheel.
+    timers.schedule(&timer2, 1000);
+    timers.schedule(&timer2, 1001);
+    EXPECT_INTEQ(timers.stats().schedules, 4);
+    EXPECT_INTEQ(timers.stats().schedules_same_slot, 1);
+    EXPECT_INTEQ(timers.events_on_level(0), 1);
+    EXPECT_INTEQ(timers.events_on_level(1), 1);
+    EXPECT_INTEQ(timers.events_on_level(2), 0);
+
+    timers.schedule_in_range(&timer2, 900, 1100);
+    EXPECT_INTEQ(timers.stats().in_range_kept, 1);
+    timers.schedule_lazy(&timer, 20);
+    EXPECT_INTEQ(timers.stats().lazy_updates, 1);
+
+    timers.advance(2000);
+    EXPECT_INTEQ(timers.stats().advances, 1);
+    EXPECT_INTEQ(timers.stats().executions, 2);
+    EXPECT_INTEQ(timers.stats().promotions, 1);
+    EXPECT_INTEQ(timers.stats().refiles, 1);
+    // Only ticks 11 (lazy reschedule), 20, 768 (promotion) and 1001
+    // needed any processing.
+    EXPECT_INTEQ(timers.stats().ticks_skipped, 2000 - 4);
+    EXPECT_INTEQ(timers.events_on_level(0), 0);
+    EXPECT_INTEQ(timers.events_on_level(1), 0);
+
+    return true;
+}
+
+// Checks that the hooks get called in a sensible order.
+struct CountingTracer : public TimerWheelNoTracing {
+    void on_advance_start(uint64_t now, uint64_t delta) {
+        ok = ok && !in_advance;
+        in_advance = true;
+        ++advances;
+    }
+    void on_advance_end(uint64_t now, bool done) {
+        ok = ok && in_advance;
+        in_advance = false;
+        last_done = done;
+    }
+    void on_promote(int level, size_t count) {
+        ok = ok && in_advance && !executing;
+        if (level >= int(promoted.size())) {
+            promoted.resize(level + 1);
+        }
+        promoted[level] += count;
+    }
+    void on_execute_start(const TimerEventInterface* event) {
+        ok = ok && in_advance && !executing;
+        executing = event;
+    }
+    void on_execute_end(const TimerEventInterface* event) {
+        ok = ok && executing == event;
+        executing = NULL;
+        ++executions;
+    }
+
+    bool ok = true;
+    bool in_advance = false;
+    bool last_done = false;
+    const TimerEventInterface* executing = NULL;
+    int advances = 0;
+    int executions = 0;
+    std::vector<size_t> promoted;
+};
+
+// A policy with no state of its own.
+struct EmptyTracer : public TimerWheelNoTracing {
+};
+
+bool test_tracing() {
+    typedef std::function<void()> Callback;
+    // Policies without state take up no space in the wheel.
+    EXPECT_INTEQ(sizeof(TimerWheelT<8, 8, uint64_t, false, false,
+                                    EmptyTracer>),
+                 sizeof(TimerWheel));
+    EXPECT(sizeof(TimerWheelT<8, 8, uint64_t, false, false,
+                              CountingTracer>) > sizeof(TimerWheel));
+
+    TimerWheelT<8, 8, uint64_t, false, false, CountingTracer> timers;
+    std::vector<std::unique_ptr<TimerEvent<Callback>>> events;
+    for (int i = 0; i < 11; ++i) {
+        events.emplace_back(new TimerEvent<Callback>([] () { }));
+        timers.schedule(events.back().get(), i ? 300 : 5);
+    }
+    timers.schedule(events[0].get(), 5);
+    // Hits max_execute on the promoted events.
+    EXPECT(!timers.advance(400, 4));
+    EXPECT_INTEQ(timers.tracer().advances, 1);
+    EXPECT(!timers.tracer().last_done);
+    EXPECT(timers.advance(0));
+    EXPECT(timers.tracer().last_done);
+    EXPECT(timers.tracer().ok);
+    EXPECT_INTEQ(timers.tracer().advances, 2);
+    EXPECT_INTEQ(timers.tracer().executions, 11);
+    EXPECT_INTEQ(timers.tracer().promoted.size(), 2);
+    EXPECT_INTEQ(timers.tracer().promoted[1], 10);
+
+    // The histogram is accurate to a few percent.
+    LatencyHistogram histogram;
+    EXPECT_INTEQ(histogram.percentile(50), 0);
+    for (uint64_t i = 1; i <= 100000; ++i) {
+        histogram.record(i);
+    }
+    EXPECT_INTEQ(histogram.count(), 100000);
+    EXPECT_INTEQ(histogram.min(), 1);
+    EXPECT_INTEQ(histogram.max(), 100000);
+    EXPECT(histogram.mean() == 50000.5);
+    EXPECT(histogram.percentile(50) >= 50000);
+    EXPECT(histogram.percentile(50) <= 51500);
+    EXPECT(histogram.percentile(99.9) >= 99900);
+    EXPECT_INTEQ(histogram.percentile(100), 100000);
+    EXPECT_INTEQ(histogram.percentile(0), 1);
+    histogram.record(std::numeric_limits<uint64_t>::max());
+    EXPECT(histogram.percentile(100) == std::numeric_limits<uint64_t>::max());
+    histogram.reset();
+    EXPECT_INTEQ(histogram.count(), 0);
+
+    TimerWheelT<8, 8, uint64_t, false, false,
+                TimerWheelLatencyTracer> traced;
+    for (auto& event : events) {
+        traced.schedule(event.get(), 1000);
+    }
+    traced.advance(500);
+    traced.advance(500);
+    EXPECT_INTEQ(traced.tracer().advance_ns().count(), 2);
+    EXPECT_INTEQ(traced.tracer().execute_ns().count(), 11);
+    EXPECT_INTEQ(traced.tracer().promotions(1).count(), 1);
+    EXPECT_INTEQ(traced.tracer().promotions(1).max(), 11);
+    EXPECT_INTEQ(traced.tracer().promotions(5).count(), 0);
+
+    // These just need to work, whether or not there's anything
+    // listening.
+    TimerWheelT<8, 8, uint64_t, false, false, TimerWheelUsdtTracer> usdt;
+    TimerWheelT<8, 8, uint64_t, false, false, TimerWheelFtraceTracer> ftrace;
+    usdt.schedule(events[0].get(), 300);
+    usdt.advance(300);
+    ftrace.schedule(events[0].get(), 300);
+    ftrace.advance(300);
+    EXPECT(!events[0]->active());
+
+    return true;
+}
+
+bool test_parallel() {
+    typedef std::function<void()> Callback;
+    typedef DispatchedTimerEvent<Callback> Event;
+    TimerThreadPool pool(4);
+    TimerWheel timers;
+    TimerWheelDispatcher dispatcher(&timers, &pool, 8);
+    std::thread::id loop_thread = std::this_thread::get_id();
+    std::atomic<int> inline_count { 0 };
+    std::atomic<int> pool_count { 0 };
+
+    // The callbacks for each key run in the order the events expired.
+    static const int KEYS = 16;
+    static const int PER_KEY = 20;
+    std::vector<std::vector<Tick>> runs(KEYS);
+    std::vector<std::unique_ptr<Event>> events;
+    for (int key = 0; key < KEYS; ++key) {
+        for (int i = 0; i < PER_KEY; ++i) {
+            Tick at = 1 + (key * 7 + i * 13) % 300;
+            Event* event = new Event(&dispatcher, [&, key, at] () {
+                runs[key].push_back(at);
+                if (std::this_thread::get_id() == loop_thread) {
+                    ++inline_count;
+                } else {
+                    ++pool_count;
+                }
+            }, key);
+            events.emplace_back(event);
+            timers.schedule(event, at);
+        }
+    }
+    // Ordinary events still run inline.
+    int plain_count = 0;
+    TimerEvent<Callback> plain([&plain_count] () { ++plain_count; });
+    timers.schedule(&plain, 150);
+    EXPECT(dispatcher.advance(100));
+    EXPECT_INTEQ(plain_count, 0);
+    EXPECT(dispatcher.advance(1000));
+    EXPECT_INTEQ(plain_count, 1);
+    dispatcher.wait();
+    EXPECT_INTEQ(dispatcher.outstanding(), 0);
+    EXPECT_INTEQ(inline_count.load(), 0);
+    EXPECT_INTEQ(pool_count.load(), KEYS * PER_KEY);
+    for (int key = 0; key < KEYS; ++key) {
+        EXPECT_INTEQ(runs[key].size(), PER_KEY);
+        EXPECT(std::is_sorted(runs[key].begin(), runs[key].end()));
+    }
+    for (auto& event : events) {
+        EXPECT(!event->running());
+    }
+
+    // An event is running until its callback has returned.
+    std::atomic<bool> release { false };
+    Event blocked(&dispatcher, [&release] () {
+        while (!release.load()) {
+            std::this_thread::yield();
+        }
+    });
+    timers.schedule(&blocked, 1);
+    dispatcher.advance(1);
+    EXPECT(blocked.running());
+    EXPECT(!blocked.active());
+    EXPECT_INTEQ(dispatcher.outstanding(), 1);
+    release = true;
+    dispatcher.wait();
+    EXPECT(!blocked.running());
+
+    // With the tick barrier, nothing from a tick runs before
+    // everything from the earlier ticks is done.
+    dispatcher.set_tick_barrier(true);
+    std::atomic<int> finished[3] = { { 0 }, { 0 }, { 0 } };
+    std::atomic<bool> ordered { true };
+    events.clear();
+    for (int i = 0; i < 30; ++i) {
+        int tick = i % 3;
+        Event* event = new Event(&dispatcher, [&, tick] () {
+            for (int earlier = 0; earlier < tick; ++earlier) {
+                if (finished[earlier].load() != 10) {
+                    ordered = false;
+                }
+            }
+            std::this_thread::sleep_for(std::chrono::microseconds(100));
+            ++finished[tick];
+        });
+        events.emplace_back(event);
+        timers.schedule(event, tick + 1);
+    }
+    dispatcher.advance(3);
+    dispatcher.wait();
+    EXPECT(ordered.load());
+    EXPECT_INTEQ(finished[2].load(), 10);
+    events.clear();
+
+    // A dispatcher can be destroyed right after advance(), while its
+    // tasks are still running.
+    std::atomic<int> done { 0 };
+    for (int round = 0; round < 200; ++round) {
+        std::unique_ptr<TimerWheelDispatcher> short_lived(
+            new TimerWheelDispatcher(&timers, &pool, 4));
+        std::vector<std::unique_ptr<Event>> short_events;
+        for (int i = 0; i < 8; ++i) {
+            short_events.emplace_back(new Event(short_lived.get(), [&done] () {
+                ++done;
+            }, i));
+            timers.schedule(short_events.back().get(), 1);
+        }
+        short_lived->advance(1);
+        short_lived.reset();
+        EXPECT_INTEQ(done.load(), (round + 1) * 8);
+    }
+
+    return true;
+}
+
+// Schedule timers through a tiered wheel with the given store, and
+// check that every timer fires on time, only a fraction of them are
+// ever loaded at once, and canceling from the store works.
+template<typename Store>
+bool run_tiered(Store* store) {
+    typedef std::function<void()> Callback;
+    typedef TimerEvent<Callback> Event;
+    TimerWheel timers;
+    TieredTimerWheelT<Store> tiered(&timers, store, 1000, 8);
+    std::vector<std::unique_ptr<Event>> events(10000);
+    std::vector<Tick> deadlines(events.size());
+    size_t loaded = 0;
+    size_t max_loaded = 0;
+    int fired = 0;
+    int late = 0;
+    auto make_event = [&] (uint64_t id) {
+        events[id].reset(new Event([&, id] () {
+            if (timers.now() != deadlines[id]) {
+                ++late;
+            }
+            ++fired;
+            --loaded;
+        }));
+        ++loaded;
+        max_loaded = std::max(max_loaded, loaded);
+        return events[id].get();
+    };
+    auto load = [&] (uint64_t id, Tick delta) {
+        if (timers.now() + delta != deadlines[id]) {
+            ++late;
+        }
+        timers.schedule(make_event(id), delta);
+    };
+
+    int direct = 0;
+    for (uint64_t id = 0; id < events.size(); ++id) {
+        Tick delta = 1 + rand() % 1000000;
+        deadlines[id] = delta;
+        if (!tiered.schedule(id, delta)) {
+            EXPECT(delta < 1000 + 256);
+            timers.schedule(make_event(id), delta);
+            ++direct;
+        }
+    }
+    EXPECT_INTEQ(tiered.stored() + direct, events.size());
+    // Cancel a few of the stored timers.
+    int canceled = 0;
+    for (uint64_t id = 0; id < events.size(); id += 10) {
+        if (deadlines[id] > 2000) {
+            EXPECT(tiered.cancel(id, deadlines[id]));
+            EXPECT(!tiered.cancel(id, deadlines[id]));
+            ++canceled;
+        }
+    }
+    EXPECT_INTEQ(tiered.stored() + direct + canceled, events.size());
+
+    // Add some more timers from inside the loop, some of which land
+    // in buckets that have already been loaded.
+    while (tiered.stored() || timers.ticks_to_next_event(2000000) < 2000000) {
+        Tick step = tiered.ticks_to_next_event(500000);
+        EXPECT(step > 0);
+        EXPECT(tiered.advance(step, load));
+        if (timers.now() % 7 == 0 && timers.now() < 900000) {
+            uint64_t id = events.size();
+            Tick delta = 1 + rand() % 5000;
+            events.emplace_back();
+            deadlines.push_back(timers.now() + delta);
+            if (!tiered.schedule(id, delta)) {
+                timers.schedule(make_event(id), delta);
+            }
+        }
+    }
+    EXPECT_INTEQ(late, 0);
+    EXPECT_INTEQ(fired, events.size() - canceled);
+    EXPECT_INTEQ(loaded, 0);
+    // Only the timers within the horizon of the current time, plus a
+    // bucket, are ever loaded.
+    EXPECT(max_loaded < 100);
+
+    return true;
+}
+
+bool test_tiered() {
+    TimerSpillMemoryStore memory_store;
+    EXPECT(run_tiered(&memory_store));
+
+    FILE* file = tmpfile();
+    EXPECT(file != NULL);
+    TimerSpillFileStore file_store(fileno(file));
+    EXPECT(run_tiered(&file_store));
+    EXPECT(!file_store.error());
+    EXPECT(file_store.file_size() > 0);
+    // Made of whole pages, so that freed chunks can be dropped.
+    EXPECT_INTEQ(file_store.file_size() % sysconf(_SC_PAGESIZE), 0);
+    EXPECT_INTEQ(file_store.size(), 0);
+    fclose(file);
+
+    return true;
+}
+
 int main(void) {
     bool ok = true;
     TEST(test_single_timer_no_hierarchy);
     TEST(test_single_timer_hierarchy);
     TEST(test_ticks_to_next_event);
+    TEST(test_ticks_to_next_event_canceled);
+    TEST(test_ticks_to_next_event_cached);
+    TEST(test_count_due_within);
     TEST(test_schedule_in_range);
+    TEST(test_schedule_with_slack);
+    TEST(test_schedule_bulk);
     TEST(test_single_timer_random);
+    TEST(test_advance_large_delta);
+    TEST(test_custom_geometry);
+    TEST(test_outer_heap);
     TEST(test_maxexec);
+    TEST(test_deadline);
     TEST(test_reschedule_from_timer);
+    TEST(test_periodic);
+    TEST(test_schedule_lazy);
     TEST(test_timeout_method);
+    TEST(test_custom_event);
+    TEST(test_batch);
+    TEST(test_inline_callback);
+    TEST(test_schedule_callback);
+    TEST(test_next_deadline);
+    TEST(test_mailbox);
+    TEST(test_sharded);
+    TEST(test_sharded_max_execute);
+#ifdef __linux__
+    TEST(test_clock);
+    TEST(test_record);
+#endif
+    TEST(test_compact);
+    TEST(test_stats);
+    TEST(test_tracing);
+    TEST(test_parallel);
+    TEST(test_tiered);
     // Test canceling timer from within timer
     return ok ? 0 : 1;
 }
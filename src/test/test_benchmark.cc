@@ -4,12 +4,78 @@
 // LICENSE).
 
 #include <algorithm>
+#include <fcntl.h>
 #include <functional>
 #include <string>
 #include <sys/time.h>
 #include <sys/resource.h>
+#include <utility>
+#include <vector>
 
 #include "../timer-wheel.h"
+#include "../timer-wheel-recorder.h"
+#include "baseline-timer-queues.h"
+#include "perf-counters.h"
+
+// The wheel geometry to benchmark. Can be overridden at compile time,
+// e.g. -DBENCH_TIMER_WHEEL="TimerWheelT<6>".
+#ifndef BENCH_TIMER_WHEEL
+#define BENCH_TIMER_WHEEL TimerWheel
+#endif
+typedef BENCH_TIMER_WHEEL BenchTimerWheel;
+
+// The TimerWheel, with the MemberEvent template that the benchmark
+// expects the timer queues to have.
+class RatasTimerQueue : public BenchTimerWheel {
+public:
+    template<typename T, void(T::*MFun)()>
+    using MemberEvent = MemberTimerEvent<T, MFun>;
+
+    void cancel(TimerEventInterface* event) {
+        event->cancel();
+    }
+};
+
+// The TimerWheel, with all the operations recorded into a trace file
+// for test_replay.
+class RecordingTimerQueue {
+public:
+    template<typename T, void(T::*MFun)()>
+    using MemberEvent = MemberTimerEvent<T, MFun>;
+
+    RecordingTimerQueue()
+        : fd_(open_record_file()),
+          recorder_(&timers_, fd_) {
+    }
+    ~RecordingTimerQueue() {
+        if (!recorder_.flush()) {
+            fprintf(stderr, "Writing the trace failed\n");
+        }
+        close(fd_);
+    }
+
+    bool advance(Tick delta) { return recorder_.advance(delta); }
+    void schedule(TimerEventInterface* event, Tick delta) {
+        recorder_.schedule(event, delta);
+    }
+    void schedule_in_range(TimerEventInterface* event, Tick start, Tick end) {
+        recorder_.schedule_in_range(event, start, end);
+    }
+    void cancel(TimerEventInterface* event) {
+        recorder_.cancel(event);
+    }
+    Tick now() const { return recorder_.now(); }
+    Tick ticks_to_next_event(Tick max) {
+        return recorder_.ticks_to_next_event(max);
+    }
+
+private:
+    static int open_record_file();
+
+    int fd_;
+    BenchTimerWheel timers_;
+    TimerWheelRecorderT<BenchTimerWheel> recorder_;
+};
 
 static bool allow_schedule_in_range = true;
 // Set to true to print a trace, to confirm that different timer
@@ -20,15 +86,58 @@ static int pair_count = 5;
 // The total number of response messages received on all units.
 // Printed in the final output, useful as a poor man's output checksum.
 static long total_rx_count = 0;
+// The number of timer operations (schedules, cancels and executions)
+// done by the units. Used for normalizing the performance counters.
+static uint64_t timer_op_count = 0;
+// If set, the (unit id, rx count) of each unit gets added here when
+// the unit is deleted. Used for checking that the different timer
+// queues give the same results.
+static std::vector<std::pair<int, int>>* trace = NULL;
+// The seed for the random numbers used for the workload.
+static unsigned seed = 1;
+// The file the "record" queue writes the trace to.
+static const char* record_file = "benchmark.trace";
+
+int RecordingTimerQueue::open_record_file() {
+    int fd = open(record_file, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        perror(record_file);
+        exit(1);
+    }
+    return fd;
+}
+
+// Performance counters for one phase of the benchmark, along with the
+// number of timer operations done during the phase.
+struct PhaseCounters {
+    void start() {
+        ops -= timer_op_count;
+        counters.start();
+    }
+    void stop() {
+        counters.stop();
+        ops += timer_op_count;
+    }
+
+    PerfCounters counters;
+    uint64_t ops = 0;
+};
+// Whether to collect hardware performance counters.
+static bool perf_counters = false;
+// If set, the counters for the phase where the work units get created
+// and the phase where they just run.
+static PhaseCounters* fill_counters = NULL;
+static PhaseCounters* steady_counters = NULL;
 
 // Pretend we're using timer ticks of 20 microseconds. So 50000 ticks
 // is one second.
 static Tick time_ms = 50;
 static Tick time_s = 1000*time_ms;
 
+template<typename Queue>
 class Unit {
 public:
-    Unit(TimerWheel* timers, int request_interval=1*time_s)
+    Unit(Queue* timers, int request_interval=1*time_s)
         : timers_(timers),
           idle_timer_(this),
           close_timer_(this),
@@ -43,6 +152,9 @@ public:
         if (print_trace) {
             printf("delete %d, rx-count=%d\n", id_, rx_count_);
         }
+        if (trace) {
+            trace->push_back(std::make_pair(id_, rx_count_));
+        }
         total_rx_count += rx_count_;
     }
 
@@ -54,7 +166,7 @@ public:
     void start(bool server) {
         unidle();
         // Start shutdown of this work unit in 180s.
-        timers_->schedule(&close_timer_, 180*time_s);
+        schedule(&close_timer_, 180*time_s);
         if (!server) {
             // Fire off the first server from the client.
             on_request();
@@ -75,7 +187,7 @@ public:
         tx_count_ -= amount;
         other_->receive(amount);
         if (!pace_quota_) {
-            timers_->schedule(&pace_timer_, pace_interval_ticks_);
+            schedule(&pace_timer_, pace_interval_ticks_);
         }
     }
     // Receive some number of response messages.
@@ -85,16 +197,16 @@ public:
         // deadline timer back in time (since this connection is now
         // clearly active).
         if (waiting_for_response_) {
-            timers_->schedule(&request_deadline_timer_,
-                              pace_interval_ticks_ * RESPONSE_SIZE * 2);
+            schedule(&request_deadline_timer_,
+                     pace_interval_ticks_ * RESPONSE_SIZE * 2);
             waiting_for_response_ = false;
         }
         rx_count_++;
         // We've received the full response. Stop the deadline timer,
         // and start another timer that'll trigger the next request.
         if (rx_count_ % RESPONSE_SIZE == 0) {
-            request_deadline_timer_.cancel();
-            timers_->schedule(&request_timer_, request_interval_ticks_);
+            cancel(&request_deadline_timer_);
+            schedule(&request_timer_, request_interval_ticks_);
         }
     }
 
@@ -108,7 +220,7 @@ public:
             delete this;
         } else {
             closing_ = true;
-            timers_->schedule(&close_timer_, 10*time_s);
+            schedule(&close_timer_, 10*time_s);
         }
     }
     // Refresh transmit quota.
@@ -126,8 +238,8 @@ public:
     void on_request() {
         if (!closing_) {
             // Expect a response within this time.
-            timers_->schedule(&request_deadline_timer_,
-                              pace_interval_ticks_ * RESPONSE_SIZE * 4);
+            schedule(&request_deadline_timer_,
+                     pace_interval_ticks_ * RESPONSE_SIZE * 4);
             waiting_for_response_ = true;
             other_->transmit(RESPONSE_SIZE);
         }
@@ -135,42 +247,71 @@ public:
     // We've done some work. Move the idle timer further into the future.
     void unidle() {
         if (allow_schedule_in_range) {
-            timers_->schedule_in_range(&idle_timer_, 60*time_s,
-                                       61*time_s);
+            schedule_in_range(&idle_timer_, 60*time_s, 61*time_s);
         } else {
-            timers_->schedule(&idle_timer_, 60*time_s);
+            schedule(&idle_timer_, 60*time_s);
         }
     }
     // Something has gone wrong. Forcibly close down both sides.
     void on_request_deadline() {
         fprintf(stderr, "Request did not finish by deadline\n");
+        Unit<Queue>* other = other_;
         delete this;
-        delete other_;
+        delete other;
     }
 
+    // Reset by bench(), so that each run gets the same ids.
+    static int id_counter_;
+
 private:
-    TimerWheel* timers_;
+    // Count the executed timers as timer operations.
+    template<void(Unit::*MFun)()>
+    void execute() {
+        ++timer_op_count;
+        (this->*MFun)();
+    }
+
+    template<void(Unit::*MFun)()>
+    using Event =
+        typename Queue::template MemberEvent<Unit, &Unit::execute<MFun>>;
+
+    template<typename E>
+    void schedule(E* event, Tick delta) {
+        ++timer_op_count;
+        timers_->schedule(event, delta);
+    }
+    template<typename E>
+    void schedule_in_range(E* event, Tick start, Tick end) {
+        ++timer_op_count;
+        timers_->schedule_in_range(event, start, end);
+    }
+    template<typename E>
+    void cancel(E* event) {
+        ++timer_op_count;
+        timers_->cancel(event);
+    }
+
+    Queue* timers_;
     // This timer gets rescheduled far into the future at very frequent
     // intervals.
-    MemberTimerEvent<Unit, &Unit::on_idle> idle_timer_;
+    Event<&Unit::on_idle> idle_timer_;
     // This timers gets scheduled twice, and executed twice.
-    MemberTimerEvent<Unit, &Unit::on_close> close_timer_;
+    Event<&Unit::on_close> close_timer_;
     // This gets scheduled very soon at frequent intervals, and is always
     // executed.
-    MemberTimerEvent<Unit, &Unit::on_pace> pace_timer_;
+    Event<&Unit::on_pace> pace_timer_;
     // This gets scheduled about 150-200 times during the benchmark a
     // medium duration from now, and is always executed
-    MemberTimerEvent<Unit, &Unit::on_request> request_timer_;
+    Event<&Unit::on_request> request_timer_;
     // This gets scheduled at a medium duration 150-200 times during a
     // benchmark, but always gets canceled (not rescheduled).
-    MemberTimerEvent<Unit, &Unit::on_request_deadline> request_deadline_timer_;
+    Event<&Unit::on_request_deadline> request_deadline_timer_;
 
-    static int id_counter_;
     const static int RESPONSE_SIZE = 128;
     int id_;
     int tx_count_ = 0;
     int rx_count_ = 0;
-    Unit* other_ = NULL;
+    Unit<Queue>* other_ = NULL;
     int pace_quota_ = 1;
     int pace_interval_ticks_ = 10;
     int request_interval_ticks_;
@@ -178,11 +319,13 @@ private:
     bool waiting_for_response_ = false;
 };
 
-int Unit::id_counter_ = 0;
+template<typename Queue>
+int Unit<Queue>::id_counter_ = 0;
 
-static void make_unit_pair(TimerWheel* timers, int request_interval) {
-    Unit* server = new Unit(timers);
-    Unit* client = new Unit(timers, request_interval);
+template<typename Queue>
+static void make_unit_pair(Queue* timers, int request_interval) {
+    Unit<Queue>* server = new Unit<Queue>(timers);
+    Unit<Queue>* client = new Unit<Queue>(timers, request_interval);
     server->pair_with(client);
     client->pair_with(server);
 
@@ -190,14 +333,21 @@ static void make_unit_pair(TimerWheel* timers, int request_interval) {
     client->start(false);
 }
 
+template<typename Queue>
 bool bench() {
-    TimerWheel timers;
+    Queue timers;
+    // Every queue gets the same workload.
+    srand(seed);
+    Unit<Queue>::id_counter_ = 0;
     // Create the events evenly spread during this time range.
     int create_period = 1*time_s;
     double create_progress_per_iter = (double) pair_count / create_period * 2;
     double current_progress = 0;
     long int count = 0;
 
+    if (fill_counters) {
+        fill_counters->start();
+    }
     while (timers.now() < create_period) {
         current_progress += (rand() * create_progress_per_iter) / RAND_MAX;
         while (current_progress > 1) {
@@ -207,15 +357,90 @@ bool bench() {
         }
         timers.advance(1);
     }
+    if (fill_counters) {
+        fill_counters->stop();
+    }
 
     fprintf(stderr, "%ld work units (%ld timers)\n",
             count, count * 10);
 
+    if (steady_counters) {
+        steady_counters->start();
+    }
     while (timers.now() < 300*time_s) {
         Tick t = timers.ticks_to_next_event(100*time_ms);
         timers.advance(t);
     }
+    if (steady_counters) {
+        steady_counters->stop();
+    }
+
+    return true;
+}
+
+// Print the per-operation value of each counter as CSV fields,
+// leaving the field empty for counters that aren't available.
+static void print_counters(const PhaseCounters& phase) {
+    printf(",%lu", (unsigned long) phase.ops);
+    for (int i = 0; i < PerfCounters::NUM_COUNTERS; ++i) {
+        PerfCounters::Counter counter = PerfCounters::Counter(i);
+        if (phase.counters.available(counter)) {
+            printf(",%.3lf", phase.counters.per(counter, phase.ops));
+        } else {
+            printf(",");
+        }
+    }
+}
 
+// Run the benchmark with the named timer queue, and print the results.
+// Returns false if there's no such queue.
+static bool run(const char* argv0, const std::string& queue) {
+    struct rusage start;
+    struct rusage end;
+    PhaseCounters total, fill, steady;
+    total_rx_count = 0;
+    if (perf_counters) {
+        fill_counters = &fill;
+        steady_counters = &steady;
+        total.start();
+    }
+    getrusage(RUSAGE_SELF, &start);
+    bool found = true;
+    if (queue == "ratas") {
+        bench<RatasTimerQueue>();
+    } else if (queue == "heap") {
+        bench<HeapTimerQueue>();
+    } else if (queue == "map") {
+        bench<MapTimerQueue>();
+    } else if (queue == "wheel") {
+        bench<SingleLevelTimerWheel>();
+    } else if (queue == "record") {
+        bench<RecordingTimerQueue>();
+    } else {
+        found = false;
+    }
+    getrusage(RUSAGE_SELF, &end);
+    if (perf_counters) {
+        total.stop();
+        fill_counters = NULL;
+        steady_counters = NULL;
+    }
+    if (!found) {
+        return false;
+    }
+
+    printf("%s,%d,%s,%lf,%ld,%s", argv0, pair_count,
+           (allow_schedule_in_range ? "yes" : "no"),
+           (end.ru_utime.tv_sec + end.ru_utime.tv_usec / 1000000.0) -
+           (start.ru_utime.tv_sec + start.ru_utime.tv_usec / 1000000.0),
+           total_rx_count, queue.c_str());
+    if (perf_counters) {
+        print_counters(total);
+        print_counters(fill);
+        print_counters(steady);
+    }
+    printf("\n");
+    fflush(stdout);
     return true;
 }
 
@@ -249,17 +474,88 @@ int main(int argc, char** argv) {
             return 1;
         }
     }
+    if (char* s = getenv("BENCH_SEED")) {
+        char dummy;
+        if (sscanf(s, "%u%c", &seed, &dummy) != 1) {
+            fprintf(stderr, "BENCH_SEED should an integer");
+            return 1;
+        }
+    }
 
-    struct rusage start;
-    struct rusage end;
-    getrusage(RUSAGE_SELF, &start);
-    bench();
-    getrusage(RUSAGE_SELF, &end);
+    if (char* s = getenv("BENCH_PERF_COUNTERS")) {
+        std::string value = s;
+        if (value == "yes") {
+            perf_counters = true;
+        } else if (value == "no") {
+            perf_counters = false;
+        } else {
+            fprintf(stderr, "BENCH_PERF_COUNTERS should be yes, no or not set");
+            return 1;
+        }
+    }
+    if (perf_counters) {
+        PerfCounters probe;
+        if (probe.none_available()) {
+            fprintf(stderr, "No performance counters available, "
+                    "the counter fields will be empty\n");
+        }
+        // Describe the extra fields, since the CSV has no header.
+        std::string fields;
+        for (const char* phase : { "total", "fill", "steady" }) {
+            fields += std::string(",") + phase + "_ops";
+            for (int i = 0; i < PerfCounters::NUM_COUNTERS; ++i) {
+                fields += std::string(",") + phase + "_" +
+                    PerfCounters::name(PerfCounters::Counter(i)) + "_per_op";
+            }
+        }
+        fprintf(stderr, "Performance counter fields after the queue name: "
+                "%s\n", fields.c_str() + 1);
+    }
 
-    printf("%s,%d,%s,%lf,%ld\n", argv[0], pair_count,
-           (allow_schedule_in_range ? "yes" : "no"),
-           (end.ru_utime.tv_sec + end.ru_utime.tv_usec / 1000000.0) -
-           (start.ru_utime.tv_sec + start.ru_utime.tv_usec / 1000000.0),
-           total_rx_count);
+    if (char* s = getenv("BENCH_RECORD_FILE")) {
+        record_file = s;
+    }
+
+    std::string queue = "ratas";
+    if (char* s = getenv("BENCH_QUEUE")) {
+        queue = s;
+    }
+
+    if (queue == "all") {
+        // Run every queue over the same workload, and check that they
+        // all give the same results. schedule_in_range() leaves the
+        // exact time up to the queue, so it can change the results,
+        // and is only used if explicitly asked for.
+        if (!getenv("BENCH_ALLOW_SCHEDULE_IN_RANGE")) {
+            allow_schedule_in_range = false;
+        }
+        if (allow_schedule_in_range) {
+            fprintf(stderr, "Not checking the traces, since "
+                    "BENCH_ALLOW_SCHEDULE_IN_RANGE is not \"no\"\n");
+        }
+        std::vector<std::pair<int, int>> expected;
+        bool ok = true;
+        for (const char* name : { "ratas", "heap", "map", "wheel" }) {
+            std::vector<std::pair<int, int>> result;
+            trace = &result;
+            run(argv[0], name);
+            trace = NULL;
+            // Units deleted on the same tick can be deleted in any
+            // order.
+            std::sort(result.begin(), result.end());
+            if (expected.empty()) {
+                expected = result;
+            } else if (!allow_schedule_in_range && result != expected) {
+                fprintf(stderr, "Trace for %s doesn't match ratas\n", name);
+                ok = false;
+            }
+        }
+        return ok ? 0 : 1;
+    }
+
+    if (!run(argv[0], queue)) {
+        fprintf(stderr, "BENCH_QUEUE should be ratas, heap, map, wheel, record or all\n");
+        return 1;
+    }
     return 0;
 }
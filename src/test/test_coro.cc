@@ -0,0 +1,320 @@
+// -*- mode: c++; c-basic-offset: 4 indent-tabs-mode: nil -*-
+//
+// Copyright 2016 Juho Snellman, released under a MIT license (see
+// LICENSE).
+//
+// Tests for timer-wheel-coro.h. Built separately from test_basic,
+// since this needs C++20.
+
+#include <cstdlib>
+#include <new>
+#include <stdexcept>
+#include <vector>
+
+#include "../timer-wheel-coro.h"
+
+#define TEST(fun) \
+    do {                                              \
+        if (fun()) {                                  \
+            printf("[OK] %s\n", #fun);                \
+        } else {                                      \
+            ok = false;                               \
+            printf("[FAILED] %s\n", #fun);            \
+        }                                             \
+    } while (0)
+
+#define EXPECT(expr)                                    \
+    do {                                                \
+        if (!(expr))  {                                 \
+            printf("%s:%d: Expect failed: %s\n",        \
+                   __FILE__, __LINE__, #expr);          \
+            return false;                               \
+        }                                               \
+    } while (0)
+
+#define EXPECT_INTEQ(actual, expect)                    \
+    do {                                                \
+        if (expect != actual)  {                        \
+            printf("%s:%d: Expect failed, wanted %ld"   \
+                   " got %ld\n",                        \
+                   __FILE__, __LINE__,                  \
+                   (long) expect, (long) actual);       \
+            return false;                               \
+        }                                               \
+    } while (0)
+
+// Count the allocations, to check that waiting doesn't allocate.
+static long allocations = 0;
+
+void* operator new(size_t size) {
+    ++allocations;
+    if (void* ptr = malloc(size ? size : 1)) {
+        return ptr;
+    }
+    throw std::bad_alloc();
+}
+
+void operator delete(void* ptr) noexcept {
+    free(ptr);
+}
+
+void operator delete(void* ptr, size_t size) noexcept {
+    free(ptr);
+}
+
+// A coroutine that starts running right away, and whose frame is
+// destroyed along with the Task (even if it's still suspended).
+class Task {
+public:
+    struct promise_type {
+        Task get_return_object() {
+            return Task(std::coroutine_handle<promise_type>::from_promise(*this));
+        }
+        std::suspend_never initial_suspend() noexcept { return {}; }
+        std::suspend_always final_suspend() noexcept { return {}; }
+        void return_void() { }
+        void unhandled_exception() { abort(); }
+    };
+
+    explicit Task(std::coroutine_handle<promise_type> handle)
+        : handle_(handle) {
+    }
+    Task(Task&& other) : handle_(other.handle_) {
+        other.handle_ = nullptr;
+    }
+    ~Task() {
+        if (handle_) {
+            handle_.destroy();
+        }
+    }
+
+    bool done() const { return handle_.done(); }
+
+private:
+    std::coroutine_handle<promise_type> handle_;
+};
+
+// A value that some coroutine can wait for. The awaiter unregisters
+// itself when destroyed, so it can be used with with_timeout().
+struct Mailbox {
+    struct Awaiter {
+        Mailbox* mailbox;
+
+        ~Awaiter() {
+            if (mailbox->waiter == this) {
+                mailbox->waiter = NULL;
+            }
+        }
+        bool await_ready() { return mailbox->full; }
+        void await_suspend(std::coroutine_handle<> handle) {
+            mailbox->waiter = this;
+            this->handle = handle;
+        }
+        int await_resume() {
+            mailbox->full = false;
+            if (mailbox->value < 0) {
+                throw std::runtime_error("negative");
+            }
+            return mailbox->value;
+        }
+
+        std::coroutine_handle<> handle;
+    };
+
+    Awaiter receive() { return Awaiter { this }; }
+
+    void send(int v) {
+        value = v;
+        full = true;
+        if (waiter) {
+            Awaiter* w = waiter;
+            waiter = NULL;
+            w->handle.resume();
+        }
+    }
+
+    int value = 0;
+    bool full = false;
+    Awaiter* waiter = NULL;
+};
+
+// The coroutines are plain functions rather than lambdas, since the
+// closure object of a lambda would be gone by the time the coroutine
+// resumes.
+static Task sleeper(TimerWheel* timers, std::vector<Tick>* log) {
+    co_await sleep_for(timers, 5);
+    log->push_back(timers->now());
+    // On an outer level.
+    co_await sleep_for(timers, 1000);
+    log->push_back(timers->now());
+    co_await sleep_until(timers, 1100);
+    log->push_back(timers->now());
+    // Neither of these suspend.
+    co_await sleep_for(timers, 0);
+    co_await sleep_until(timers, 50);
+    log->push_back(timers->now());
+}
+
+static Task sleep_once(TimerWheel* timers, std::vector<Tick>* log) {
+    co_await sleep_for(timers, 10);
+    log->push_back(0);
+}
+
+bool test_sleep() {
+    TimerWheel timers(10);
+    std::vector<Tick> log;
+    Task task = sleeper(&timers, &log);
+
+    EXPECT_INTEQ(timers.ticks_to_next_event(), 5);
+    timers.advance(4);
+    EXPECT_INTEQ(log.size(), 0);
+    timers.advance(1);
+    EXPECT_INTEQ(log.size(), 1);
+    EXPECT_INTEQ(log[0], 15);
+    timers.advance(2000);
+    EXPECT(task.done());
+    EXPECT_INTEQ(log.size(), 4);
+    EXPECT_INTEQ(log[1], 1015);
+    EXPECT_INTEQ(log[2], 1100);
+    EXPECT_INTEQ(log[3], 1100);
+
+    // Destroying a suspended coroutine cancels the timer.
+    {
+        Task task = sleep_once(&timers, &log);
+        EXPECT_INTEQ(timers.ticks_to_next_event(), 10);
+    }
+    EXPECT(timers.ticks_to_next_event() == std::numeric_limits<Tick>::max());
+    timers.advance(100);
+    EXPECT_INTEQ(log.size(), 4);
+
+    return true;
+}
+
+static Task waiter(TimerWheel* timers, Mailbox* mailbox,
+                   std::vector<long>* log) {
+    // The sleep finishes first.
+    bool done = co_await with_timeout(timers, sleep_for(timers, 5), 10);
+    log->push_back(done);
+    log->push_back(timers->now());
+    // The timeout comes first.
+    done = co_await with_timeout(timers, sleep_for(timers, 50), 10);
+    log->push_back(done);
+    log->push_back(timers->now());
+    // A value arrives in time.
+    std::optional<int> value =
+        co_await with_timeout(timers, mailbox->receive(), 10);
+    log->push_back(*value);
+    log->push_back(timers->now());
+    // No value.
+    value = co_await with_timeout(timers, mailbox->receive(), 10);
+    log->push_back(value.has_value());
+    log->push_back(timers->now());
+    // A value that's already there.
+    mailbox->send(7);
+    value = co_await with_timeout(timers, mailbox->receive(), 10);
+    log->push_back(*value);
+    // Exceptions get passed through.
+    try {
+        co_await with_timeout(timers, mailbox->receive(), 10);
+    } catch (const std::runtime_error& e) {
+        log->push_back(-1);
+    }
+}
+
+static Task sleep_with_timeout(TimerWheel* timers, std::vector<long>* log) {
+    co_await with_timeout(timers, sleep_for(timers, 20), 30);
+    log->push_back(0);
+}
+
+static Task receive_with_timeout(TimerWheel* timers, Mailbox* mailbox) {
+    co_await with_timeout(timers, mailbox->receive(), 30);
+}
+
+bool test_with_timeout() {
+    TimerWheel timers;
+    Mailbox mailbox;
+    std::vector<long> log;
+    Task task = waiter(&timers, &mailbox, &log);
+
+    timers.advance(5);
+    EXPECT_INTEQ(log.size(), 2);
+    EXPECT_INTEQ(log[0], 1);
+    EXPECT_INTEQ(log[1], 5);
+    // Only the second with_timeout's timers are left.
+    EXPECT_INTEQ(timers.ticks_to_next_event(), 10);
+    timers.advance(10);
+    EXPECT_INTEQ(log.size(), 4);
+    EXPECT_INTEQ(log[2], 0);
+    EXPECT_INTEQ(log[3], 15);
+    // The sleep was canceled along with the helper coroutine.
+    EXPECT_INTEQ(timers.ticks_to_next_event(), 10);
+    timers.advance(3);
+    mailbox.send(42);
+    EXPECT_INTEQ(log.size(), 6);
+    EXPECT_INTEQ(log[4], 42);
+    EXPECT_INTEQ(log[5], 18);
+    timers.advance(10);
+    EXPECT_INTEQ(log.size(), 9);
+    EXPECT_INTEQ(log[6], 0);
+    EXPECT_INTEQ(log[7], 28);
+    EXPECT_INTEQ(log[8], 7);
+    // Waiting in the last receive.
+    EXPECT(mailbox.waiter != NULL);
+    mailbox.send(-5);
+    EXPECT_INTEQ(log.size(), 10);
+    EXPECT_INTEQ(log[9], -1);
+    EXPECT(task.done());
+    EXPECT(timers.ticks_to_next_event() == std::numeric_limits<Tick>::max());
+
+    // Destroying the coroutine cancels both the timeout and the
+    // awaitable.
+    {
+        Task task = sleep_with_timeout(&timers, &log);
+        EXPECT_INTEQ(timers.ticks_to_next_event(), 20);
+    }
+    EXPECT(timers.ticks_to_next_event() == std::numeric_limits<Tick>::max());
+    {
+        Task task = receive_with_timeout(&timers, &mailbox);
+        EXPECT(mailbox.waiter != NULL);
+    }
+    EXPECT(mailbox.waiter == NULL);
+    timers.advance(100);
+    EXPECT_INTEQ(log.size(), 10);
+
+    return true;
+}
+
+static Task sleep_loop(TimerWheel* timers, long* before, long* after) {
+    for (int i = 0; i < 100; ++i) {
+        if (i == 2) {
+            // Let the frame pool warm up first.
+            *before = allocations;
+        }
+        co_await sleep_for(timers, 1 + i % 7);
+        co_await with_timeout(timers, sleep_for(timers, 300), 1 + i);
+        co_await with_timeout(timers, sleep_for(timers, 2), 100);
+    }
+    *after = allocations;
+}
+
+bool test_no_allocations() {
+    TimerWheel timers;
+    long before = 0;
+    long after = 0;
+    Task task = sleep_loop(&timers, &before, &after);
+    while (!task.done()) {
+        timers.advance(1);
+    }
+    EXPECT(before > 0);
+    EXPECT_INTEQ(after - before, 0);
+
+    return true;
+}
+
+int main(void) {
+    bool ok = true;
+    TEST(test_sleep);
+    TEST(test_with_timeout);
+    TEST(test_no_allocations);
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,415 @@
+// -*- mode: c++; c-basic-offset: 4 indent-tabs-mode: nil -*-
+//
+// Copyright 2016 Juho Snellman, released under a MIT license (see
+// LICENSE).
+//
+// Microbenchmarks for the individual TimerWheel operations, at
+// different numbers of events already on the wheel. Unlike
+// test_benchmark, which runs a single end-to-end scenario, this shows
+// which operations a change made faster or slower.
+//
+// Each benchmark is run as a number of samples, each consisting of
+// many operations. The output is one CSV line per benchmark and
+// occupancy, with the mean and percentiles of the per-sample ns/op.
+
+#include <algorithm>
+#include <chrono>
+#include <memory>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "../timer-wheel.h"
+
+#ifndef BENCH_TIMER_WHEEL
+#define BENCH_TIMER_WHEEL TimerWheel
+#endif
+typedef BENCH_TIMER_WHEEL BenchTimerWheel;
+
+// The largest number of events on the wheel to benchmark with. The
+// occupancies go up by powers of 10 from 100.
+static size_t max_occupancy = 10000000;
+// The number of samples per benchmark, and operations per sample.
+static int sample_count = 50;
+static size_t ops_per_sample = 1000;
+// Only run the benchmarks whose name contains this.
+static std::string filter;
+
+// Deltas are taken from a precomputed table, so that generating them
+// doesn't show up in the timings.
+static const size_t DELTA_TABLE_SIZE = 1 << 16;
+static std::mt19937_64 rng(1);
+
+class DeltaTable {
+public:
+    // Deltas uniformly distributed in [min, max].
+    DeltaTable(Tick min, Tick max) {
+        for (size_t i = 0; i < DELTA_TABLE_SIZE; ++i) {
+            deltas_.push_back(min + rng() % (max - min + 1));
+        }
+    }
+
+    Tick next() {
+        return deltas_[index_++ % DELTA_TABLE_SIZE];
+    }
+
+private:
+    std::vector<Tick> deltas_;
+    size_t index_ = 0;
+};
+
+// An event that just counts its executions. If rearm_wheel is set, it
+// also reschedules itself with a delta from rearm_deltas.
+class BenchEvent : public TimerEventInterface {
+public:
+    BenchEvent() : TimerEventInterface(&BenchEvent::execute) {
+    }
+
+    static size_t executed;
+    static BenchTimerWheel* rearm_wheel;
+    static DeltaTable* rearm_deltas;
+
+private:
+    static void execute(TimerEventInterface* event) {
+        ++executed;
+        if (rearm_wheel) {
+            rearm_wheel->schedule(event, rearm_deltas->next());
+        }
+    }
+};
+
+size_t BenchEvent::executed = 0;
+BenchTimerWheel* BenchEvent::rearm_wheel = NULL;
+DeltaTable* BenchEvent::rearm_deltas = NULL;
+
+// The wheel and the events for one benchmark run. The benchmarked
+// operations are done on randomly picked events, so that at high
+// occupancies the events aren't in the cache, just like in real use.
+struct Fixture {
+    Fixture(size_t occupancy, Tick min_delta, Tick max_delta)
+        : deltas(min_delta, max_delta),
+          events(occupancy) {
+        for (auto& event : events) {
+            timers.schedule(&event, deltas.next());
+        }
+    }
+
+    ~Fixture() {
+        BenchEvent::rearm_wheel = NULL;
+        BenchEvent::rearm_deltas = NULL;
+    }
+
+    // Pick ops_per_sample distinct random events (or all of them, if
+    // there aren't enough).
+    const std::vector<BenchEvent*>& pick() {
+        picked.clear();
+        if (events.size() <= ops_per_sample) {
+            for (auto& event : events) {
+                picked.push_back(&event);
+            }
+        } else {
+            while (picked.size() < ops_per_sample) {
+                picked.push_back(&events[rng() % events.size()]);
+            }
+            std::sort(picked.begin(), picked.end());
+            picked.erase(std::unique(picked.begin(), picked.end()),
+                         picked.end());
+            std::shuffle(picked.begin(), picked.end(), rng);
+        }
+        return picked;
+    }
+
+    BenchTimerWheel timers;
+    DeltaTable deltas;
+    std::vector<BenchEvent> events;
+    std::vector<BenchEvent*> picked;
+};
+
+typedef std::chrono::steady_clock Clock;
+
+static double elapsed_ns(Clock::time_point start, Clock::time_point end) {
+    return std::chrono::duration<double, std::nano>(end - start).count();
+}
+
+// Print the statistics for the per-sample ns/op figures.
+static void report(const char* name, size_t occupancy,
+                   std::vector<double> samples) {
+    std::sort(samples.begin(), samples.end());
+    double sum = 0;
+    for (double sample : samples) {
+        sum += sample;
+    }
+    auto percentile = [&samples] (double p) {
+        size_t index = std::min(samples.size() - 1,
+                                size_t(p * samples.size()));
+        return samples[index];
+    };
+    printf("%s,%zu,%zu,%.2lf,%.2lf,%.2lf,%.2lf\n", name, occupancy,
+           samples.size(), sum / samples.size(), percentile(0.5),
+           percentile(0.9), percentile(0.99));
+    fflush(stdout);
+}
+
+// Run the benchmark for the given number of samples (sample_count by
+// default). The sample function runs one sample, and returns the time
+// taken and the number of operations done.
+template<typename SampleFn>
+static void run(const char* name, size_t occupancy, SampleFn sample,
+                int count = sample_count) {
+    std::vector<double> samples;
+    for (int i = 0; i < count; ++i) {
+        size_t ops = 0;
+        double ns = sample(&ops);
+        if (ops) {
+            samples.push_back(ns / ops);
+        }
+    }
+    if (!samples.empty()) {
+        report(name, occupancy, samples);
+    }
+}
+
+// Schedule events that aren't on the wheel.
+static void bench_schedule(size_t occupancy) {
+    Fixture f(occupancy, 1, 1 << 20);
+    run("schedule", occupancy, [&] (size_t* ops) {
+            const auto& events = f.pick();
+            for (auto event : events) {
+                event->cancel();
+            }
+            auto start = Clock::now();
+            for (auto event : events) {
+                f.timers.schedule(event, f.deltas.next());
+            }
+            auto end = Clock::now();
+            *ops = events.size();
+            return elapsed_ns(start, end);
+        });
+}
+
+// Reschedule events for the same tick they're already on, so that
+// they stay in the same slot.
+static void bench_reschedule_same_slot(size_t occupancy) {
+    Fixture f(occupancy, 1, 1 << 20);
+    std::vector<Tick> deltas;
+    run("reschedule_same_slot", occupancy, [&] (size_t* ops) {
+            const auto& events = f.pick();
+            deltas.clear();
+            for (auto event : events) {
+                deltas.push_back(event->scheduled_at() - f.timers.now());
+            }
+            auto start = Clock::now();
+            for (size_t i = 0; i < events.size(); ++i) {
+                f.timers.schedule(events[i], deltas[i]);
+            }
+            auto end = Clock::now();
+            *ops = events.size();
+            return elapsed_ns(start, end);
+        });
+}
+
+// Reschedule events to another slot on the same level.
+static void bench_reschedule_other_slot(size_t occupancy) {
+    Fixture f(occupancy, 1, 255);
+    run("reschedule_other_slot", occupancy, [&] (size_t* ops) {
+            const auto& events = f.pick();
+            auto start = Clock::now();
+            for (auto event : events) {
+                f.timers.schedule(event, f.deltas.next());
+            }
+            auto end = Clock::now();
+            *ops = events.size();
+            return elapsed_ns(start, end);
+        });
+}
+
+// Reschedule events between the core wheel and an outer one.
+static void bench_reschedule_other_level(size_t occupancy) {
+    Fixture f(occupancy, 1, 255);
+    DeltaTable far(1 << 16, 1 << 20);
+    bool outer = false;
+    run("reschedule_other_level", occupancy, [&] (size_t* ops) {
+            // Alternate between moving events out and moving them
+            // back in.
+            outer = !outer;
+            const auto& events = f.pick();
+            auto start = Clock::now();
+            for (auto event : events) {
+                f.timers.schedule(event, (outer ? far : f.deltas).next());
+            }
+            auto end = Clock::now();
+            *ops = events.size();
+            return elapsed_ns(start, end);
+        });
+}
+
+static void bench_cancel(size_t occupancy) {
+    Fixture f(occupancy, 1, 1 << 20);
+    run("cancel", occupancy, [&] (size_t* ops) {
+            const auto& events = f.pick();
+            auto start = Clock::now();
+            for (auto event : events) {
+                event->cancel();
+            }
+            auto end = Clock::now();
+            for (auto event : events) {
+                f.timers.schedule(event, f.deltas.next());
+            }
+            *ops = events.size();
+            return elapsed_ns(start, end);
+        });
+}
+
+// Move events that are outside the range into it, like an idle
+// timeout being pushed back.
+static void bench_schedule_in_range(size_t occupancy) {
+    Fixture f(occupancy, 1, 50000);
+    run("schedule_in_range", occupancy, [&] (size_t* ops) {
+            const auto& events = f.pick();
+            auto start = Clock::now();
+            for (auto event : events) {
+                f.timers.schedule_in_range(event, 60000, 61000);
+            }
+            auto end = Clock::now();
+            for (auto event : events) {
+                f.timers.schedule(event, f.deltas.next());
+            }
+            *ops = events.size();
+            return elapsed_ns(start, end);
+        });
+}
+
+// Advance a wheel where every tick has events to execute. Each event
+// reschedules itself, so the occupancy stays the same. Measured per
+// event executed.
+static void bench_advance_dense(size_t occupancy) {
+    Fixture f(occupancy, 1, 4096);
+    BenchEvent::rearm_wheel = &f.timers;
+    BenchEvent::rearm_deltas = &f.deltas;
+    run("advance_dense", occupancy, [&] (size_t* ops) {
+            size_t before = BenchEvent::executed;
+            auto start = Clock::now();
+            while (BenchEvent::executed - before < ops_per_sample) {
+                f.timers.advance(1);
+            }
+            auto end = Clock::now();
+            *ops = BenchEvent::executed - before;
+            return elapsed_ns(start, end);
+        });
+}
+
+// Advance a wheel where most ticks have nothing to do, by 1000 ticks
+// at a time. Measured per call to advance().
+static void bench_advance_sparse(size_t occupancy) {
+    Fixture f(occupancy, 1, Tick(1) << 40);
+    BenchEvent::rearm_wheel = &f.timers;
+    BenchEvent::rearm_deltas = &f.deltas;
+    run("advance_sparse", occupancy, [&] (size_t* ops) {
+            auto start = Clock::now();
+            for (size_t i = 0; i < ops_per_sample; ++i) {
+                f.timers.advance(1000);
+            }
+            auto end = Clock::now();
+            *ops = ops_per_sample;
+            return elapsed_ns(start, end);
+        });
+}
+
+// Events scheduled far enough ahead to need promoting through two
+// outer wheels before executing. Measured per event, including the
+// promotions and the execution. Each sample handles all the events,
+// so there are fewer samples at high occupancies.
+static void bench_promotion_cascade(size_t occupancy) {
+    Fixture f(0, 1 << 16, 1 << 24);
+    std::vector<BenchEvent> events(occupancy);
+    int count = std::max<size_t>(
+        5, std::min<size_t>(sample_count,
+                            sample_count * ops_per_sample / occupancy));
+    run("promotion_cascade", occupancy, [&] (size_t* ops) {
+            for (auto& event : events) {
+                f.timers.schedule(&event, f.deltas.next());
+            }
+            size_t before = BenchEvent::executed;
+            auto start = Clock::now();
+            f.timers.advance(1 << 24);
+            auto end = Clock::now();
+            *ops = BenchEvent::executed - before;
+            return elapsed_ns(start, end);
+        }, count);
+}
+
+// ticks_to_next_event() on a wheel where the next event is some
+// distance away, after advancing by a random amount.
+static void bench_ticks_to_next_event(size_t occupancy) {
+    Fixture f(occupancy, 1, Tick(1) << 32);
+    BenchEvent::rearm_wheel = &f.timers;
+    BenchEvent::rearm_deltas = &f.deltas;
+    volatile Tick sink = 0;
+    run("ticks_to_next_event", occupancy, [&] (size_t* ops) {
+            f.timers.advance(1 + rng() % 1000);
+            auto start = Clock::now();
+            for (size_t i = 0; i < ops_per_sample; ++i) {
+                sink = f.timers.ticks_to_next_event();
+            }
+            auto end = Clock::now();
+            *ops = ops_per_sample;
+            return elapsed_ns(start, end);
+        });
+    (void) sink;
+}
+
+struct Benchmark {
+    const char* name;
+    void (*fn)(size_t occupancy);
+};
+
+static const Benchmark benchmarks[] = {
+    { "schedule", bench_schedule },
+    { "reschedule_same_slot", bench_reschedule_same_slot },
+    { "reschedule_other_slot", bench_reschedule_other_slot },
+    { "reschedule_other_level", bench_reschedule_other_level },
+    { "cancel", bench_cancel },
+    { "schedule_in_range", bench_schedule_in_range },
+    { "advance_dense", bench_advance_dense },
+    { "advance_sparse", bench_advance_sparse },
+    { "promotion_cascade", bench_promotion_cascade },
+    { "ticks_to_next_event", bench_ticks_to_next_event },
+};
+
+static bool parse_size(const char* name, size_t* out) {
+    if (char* s = getenv(name)) {
+        char dummy;
+        unsigned long long value;
+        if (sscanf(s, "%llu%c", &value, &dummy) != 1) {
+            fprintf(stderr, "%s should be an integer\n", name);
+            return false;
+        }
+        *out = value;
+    }
+    return true;
+}
+
+int main(int argc, char** argv) {
+    size_t samples = sample_count;
+    if (!parse_size("BENCH_MAX_OCCUPANCY", &max_occupancy) ||
+        !parse_size("BENCH_SAMPLES", &samples) ||
+        !parse_size("BENCH_OPS_PER_SAMPLE", &ops_per_sample)) {
+        return 1;
+    }
+    sample_count = samples;
+    if (char* s = getenv("BENCH_FILTER")) {
+        filter = s;
+    }
+
+    printf("benchmark,occupancy,samples,mean_ns,p50_ns,p90_ns,p99_ns\n");
+    for (const auto& benchmark : benchmarks) {
+        if (std::string(benchmark.name).find(filter) == std::string::npos) {
+            continue;
+        }
+        for (size_t occupancy = 100; occupancy <= max_occupancy;
+             occupancy *= 10) {
+            benchmark.fn(occupancy);
+        }
+    }
+    return 0;
+}
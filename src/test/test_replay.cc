@@ -0,0 +1,270 @@
+// -*- mode: c++; c-basic-offset: 4 indent-tabs-mode: nil -*-
+//
+// Copyright 2016 Juho Snellman, released under a MIT license (see
+// LICENSE).
+//
+// Replay a trace recorded with TimerWheelRecorder against a chosen
+// wheel configuration, and time it:
+//
+//      test_replay.testbin timers.trace
+//
+// The replay events don't do anything when executed, any operations
+// that the real callbacks did are in the trace. They're applied once
+// the replay has advanced to the tick they were recorded on. The
+// configuration is picked with environment variables:
+//
+// - REPLAY_WIDTH_BITS: the WidthBits of the wheel (4, 6, 8, 10 or 12,
+//   default 8).
+// - REPLAY_MODE: how the recorded schedule() calls are replayed.
+//   "exact" (the default) uses schedule(), "lazy" schedule_lazy(), and
+//   "slack" schedule_with_slack() with REPLAY_SLACK ticks of slack.
+//
+// The output is a CSV line of: trace, width bits, mode, slack, number
+// of operations, number of events executed, the number of seconds
+// spent just decoding the trace, and the number of seconds for the
+// full replay (including the decoding).
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <unistd.h>
+#include <unordered_map>
+#include <vector>
+
+#include "../timer-wheel.h"
+#include "../timer-wheel-recorder.h"
+
+enum ReplayMode {
+    EXACT,
+    LAZY,
+    SLACK,
+};
+
+static ReplayMode mode = EXACT;
+static uint64_t slack = 0;
+static long executed_count = 0;
+
+class ReplayEvent : public TimerEventInterface {
+public:
+    ReplayEvent() : TimerEventInterface(&ReplayEvent::execute_callback) {
+    }
+
+private:
+    static void execute_callback(TimerEventInterface* event) {
+        ++executed_count;
+    }
+};
+
+// The trace, and the dense index of the event of each operation that
+// has one, so that the ids don't need to be looked up in a hash table
+// during the timed replay.
+struct Trace {
+    const void* data = NULL;
+    size_t size = 0;
+    uint64_t start_tick = 0;
+    std::vector<uint32_t> event_index;
+    size_t event_count = 0;
+    size_t op_count = 0;
+};
+
+static double user_time() {
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_utime.tv_sec + usage.ru_utime.tv_usec / 1000000.0;
+}
+
+static bool index_events(Trace* trace) {
+    std::unordered_map<uint64_t, uint32_t> ids;
+    TimerTraceReader reader(trace->data, trace->size);
+    TimerTraceOp op;
+    while (reader.next(&op)) {
+        ++trace->op_count;
+        if (op.type != TimerTraceOp::ADVANCE) {
+            auto it = ids.insert(std::make_pair(op.event, ids.size()));
+            trace->event_index.push_back(it.first->second);
+        }
+    }
+    trace->event_count = ids.size();
+    return !reader.error();
+}
+
+// Just decode the trace, to see how much of the replay time is spent
+// on that.
+static double decode(const Trace& trace) {
+    double start = user_time();
+    TimerTraceReader reader(trace.data, trace.size);
+    TimerTraceOp op;
+    uint64_t sum = 0;
+    while (reader.next(&op)) {
+        sum += op.a;
+    }
+    // Make sure the loop doesn't get optimized away.
+    if (sum == 1) {
+        fprintf(stderr, "\n");
+    }
+    return user_time() - start;
+}
+
+template<typename Wheel>
+class Replay {
+public:
+    explicit Replay(const Trace& trace)
+        : trace_(trace),
+          timers_(trace.start_tick),
+          events_(trace.event_count) {
+    }
+
+    double run() {
+        double start = user_time();
+        TimerTraceReader reader(trace_.data, trace_.size);
+        TimerTraceOp op;
+        size_t event_op = 0;
+        uint64_t end = reader.start_tick();
+        size_t max_execute = std::numeric_limits<size_t>::max();
+        while (reader.next(&op)) {
+            advance_to(op.tick, max_execute);
+            if (op.type == TimerTraceOp::ADVANCE) {
+                // Only advance as far as the next operation, since
+                // the callbacks of the executed events might have
+                // done some.
+                end = op.tick + op.a;
+                max_execute = op.b;
+                continue;
+            }
+            ReplayEvent* event = &events_[trace_.event_index[event_op++]];
+            switch (op.type) {
+            case TimerTraceOp::SCHEDULE:
+                schedule(event, op.a);
+                break;
+            case TimerTraceOp::SCHEDULE_IN_RANGE:
+                timers_.schedule_in_range(event, op.a, op.b);
+                break;
+            case TimerTraceOp::CANCEL:
+                event->cancel();
+                break;
+            default:
+                break;
+            }
+        }
+        advance_to(end, max_execute);
+        return user_time() - start;
+    }
+
+private:
+    void advance_to(uint64_t tick, size_t max_execute) {
+        while (pending_ || timers_.now() < tick) {
+            pending_ = !timers_.advance(pending_ ? 0 : tick - timers_.now(),
+                                        max_execute);
+        }
+    }
+
+    void schedule(ReplayEvent* event, uint64_t delta) {
+        switch (mode) {
+        case EXACT:
+            timers_.schedule(event, delta);
+            break;
+        case LAZY:
+            timers_.schedule_lazy(event, delta);
+            break;
+        case SLACK:
+            timers_.schedule_with_slack(event, delta, slack);
+            break;
+        }
+    }
+
+    const Trace& trace_;
+    Wheel timers_;
+    std::vector<ReplayEvent> events_;
+    bool pending_ = false;
+};
+
+template<typename Wheel>
+static double replay(const Trace& trace) {
+    Replay<Wheel> replay(trace);
+    return replay.run();
+}
+
+int main(int argc, char** argv) {
+    if (argc != 2) {
+        fprintf(stderr, "Usage: %s trace-file\n", argv[0]);
+        return 1;
+    }
+
+    int width_bits = 8;
+    if (char* s = getenv("REPLAY_WIDTH_BITS")) {
+        char dummy;
+        if (sscanf(s, "%d%c", &width_bits, &dummy) != 1) {
+            fprintf(stderr, "REPLAY_WIDTH_BITS should an integer\n");
+            return 1;
+        }
+    }
+    std::string mode_name = "exact";
+    if (char* s = getenv("REPLAY_MODE")) {
+        mode_name = s;
+        if (mode_name == "exact") {
+            mode = EXACT;
+        } else if (mode_name == "lazy") {
+            mode = LAZY;
+        } else if (mode_name == "slack") {
+            mode = SLACK;
+        } else {
+            fprintf(stderr, "REPLAY_MODE should be exact, lazy, slack or not set\n");
+            return 1;
+        }
+    }
+    if (char* s = getenv("REPLAY_SLACK")) {
+        char dummy;
+        unsigned long value;
+        if (sscanf(s, "%lu%c", &value, &dummy) != 1) {
+            fprintf(stderr, "REPLAY_SLACK should an integer\n");
+            return 1;
+        }
+        slack = value;
+    }
+
+    int fd = open(argv[1], O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) < 0) {
+        perror(argv[1]);
+        return 1;
+    }
+    Trace trace;
+    trace.size = st.st_size;
+    trace.data = mmap(NULL, trace.size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (trace.data == MAP_FAILED) {
+        perror("mmap");
+        return 1;
+    }
+    madvise(const_cast<void*>(trace.data), trace.size, MADV_SEQUENTIAL);
+    if (!index_events(&trace)) {
+        fprintf(stderr, "%s: invalid or truncated trace\n", argv[1]);
+        return 1;
+    }
+    trace.start_tick = TimerTraceReader(trace.data, trace.size).start_tick();
+
+    double decode_time = decode(trace);
+    double replay_time;
+    switch (width_bits) {
+    case 4: replay_time = replay<TimerWheelT<4>>(trace); break;
+    case 6: replay_time = replay<TimerWheelT<6>>(trace); break;
+    case 8: replay_time = replay<TimerWheelT<8>>(trace); break;
+    case 10: replay_time = replay<TimerWheelT<10>>(trace); break;
+    case 12: replay_time = replay<TimerWheelT<12>>(trace); break;
+    default:
+        fprintf(stderr, "REPLAY_WIDTH_BITS should be 4, 6, 8, 10 or 12\n");
+        return 1;
+    }
+
+    printf("%s,%d,%s,%lu,%lu,%ld,%lf,%lf\n", argv[1], width_bits,
+           mode_name.c_str(), (unsigned long) slack,
+           (unsigned long) trace.op_count, executed_count, decode_time,
+           replay_time);
+    munmap(const_cast<void*>(trace.data), trace.size);
+    close(fd);
+    return 0;
+}
@@ -0,0 +1,280 @@
+// -*- mode: c++; c-basic-offset: 4 indent-tabs-mode: nil -*- */
+//
+// Copyright 2016 Juho Snellman, released under a MIT license (see
+// LICENSE).
+//
+// SPDX-License-Identifier: MIT
+//
+// Glue for driving a TimerWheel from the system clock on Linux.
+//
+// A TimerWheelClock maps a POSIX clock onto the ticks of a wheel,
+// advances the wheel to the current time, and computes when the next
+// wakeup is needed. The wakeup can either be used as a poll timeout
+// (with poll_timeout_ms()), or be armed on a timerfd that's registered
+// with epoll just like any other file descriptor:
+//
+//      TimerWheel timers;
+//      // 1ms ticks, allow events to run up to 4ms late.
+//      TimerWheelClock clock(&timers, 1000000, CLOCK_MONOTONIC_COARSE, 4);
+//      epoll_ctl(epfd, EPOLL_CTL_ADD, clock.timerfd(), &event);
+//      clock.arm();
+//      ...
+//      // Once epoll says clock.timerfd() is readable:
+//      clock.handle_timerfd();
+//
+// Ticks are always computed from the time elapsed since the clock was
+// created, not by accumulating deltas, so rounding errors don't add
+// up to drift.
+
+#ifndef RATAS_TIMER_WHEEL_CLOCK_H
+#define RATAS_TIMER_WHEEL_CLOCK_H
+
+#include <sys/timerfd.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "timer-wheel.h"
+
+template<typename Wheel = TimerWheel>
+class TimerWheelClockT {
+public:
+    typedef typename Wheel::Tick Tick;
+
+    // Drive the wheel using the given clock, with each tick being
+    // ns_per_tick nanoseconds. The current time of the clock will
+    // correspond to the current time of the wheel.
+    //
+    // The wheel is allowed to wake up for an event up to slack_ticks
+    // late. The wakeups are rounded up to multiples of slack_ticks, so
+    // that nearby events get executed by a single wakeup.
+    //
+    // CLOCK_MONOTONIC_COARSE is much cheaper to read than
+    // CLOCK_MONOTONIC, but only has a resolution of a few milliseconds.
+    // It's a good choice when the slack is at least that large.
+    TimerWheelClockT(Wheel* wheel, uint64_t ns_per_tick,
+                     clockid_t clock = CLOCK_MONOTONIC,
+                     Tick slack_ticks = 0)
+        : wheel_(wheel),
+          ns_per_tick_(ns_per_tick),
+          clock_(clock),
+          slack_ticks_(slack_ticks),
+          base_ns_(read_clock(clock)),
+          base_tick_(wheel->now()) {
+        assert(ns_per_tick > 0);
+        struct timespec res;
+        if (clock_getres(clock, &res) == 0) {
+            resolution_ns_ = uint64_t(res.tv_sec) * 1000000000 + res.tv_nsec;
+        }
+    }
+
+    ~TimerWheelClockT() {
+        if (timerfd_ >= 0) {
+            close(timerfd_);
+        }
+    }
+
+    // Return the current time of the clock, in nanoseconds.
+    uint64_t now_ns() const {
+        return read_clock(clock_);
+    }
+
+    // Return the time (in nanoseconds of the clock) at which the tick
+    // delta ticks after the wheel's current time starts.
+    uint64_t tick_start_ns(Tick delta = 0) const {
+        return base_ns_ + (ticks_now() + delta) * ns_per_tick_;
+    }
+
+    // Advance the wheel to the current time of the clock. Returns
+    // false if max_execute was reached, see TimerWheel::advance().
+    bool advance(size_t max_execute = std::numeric_limits<size_t>::max()) {
+        return advance_to_ns(now_ns(), max_execute);
+    }
+
+    // Advance the wheel to the given time (in nanoseconds of the
+    // clock).
+    bool advance_to_ns(uint64_t ns,
+                       size_t max_execute = std::numeric_limits<size_t>::max()) {
+        uint64_t target = ns > base_ns_ ? (ns - base_ns_) / ns_per_tick_ : 0;
+        uint64_t current = ticks_now();
+        // A coarse clock might lag behind the time the wheel has
+        // already been advanced to. Never move backwards.
+        Tick delta = target > current ? Tick(target - current) : 0;
+        if (!delta && !pending_) {
+            return true;
+        }
+        elapsed_ = current + delta;
+        pending_ = !wheel_->advance(delta, max_execute);
+        return !pending_;
+    }
+
+    // Return the time (in nanoseconds of the clock) at which the wheel
+    // next needs to be advanced, with the slack applied. Returns 0 if
+    // the wheel needs to be advanced right away. If nothing is
+    // scheduled, returns the maximum uint64_t value. If max_ticks is
+    // passed, the wakeup will be at most that many ticks from now.
+    uint64_t next_wakeup_ns(Tick max_ticks = std::numeric_limits<Tick>::max()) {
+        if (pending_) {
+            return 0;
+        }
+        Tick ticks = wheel_->ticks_to_next_event(max_ticks);
+        if (ticks == std::numeric_limits<Tick>::max()) {
+            return std::numeric_limits<uint64_t>::max();
+        }
+        uint64_t wake = ticks_now() + ticks;
+        if (slack_ticks_ > 1 && ticks < max_ticks) {
+            // Round up to the next multiple of the slack, counting
+            // from the creation of the clock, so that all the events
+            // within one multiple share a wakeup.
+            uint64_t offset = wake % slack_ticks_;
+            if (offset) {
+                wake += slack_ticks_ - offset;
+            }
+        }
+        return base_ns_ + wake * ns_per_tick_;
+    }
+
+    // Return the timeout to use for poll() or epoll_wait() for the
+    // next wakeup, rounded up to whole milliseconds, or -1 if nothing
+    // is scheduled.
+    int poll_timeout_ms(Tick max_ticks = std::numeric_limits<Tick>::max()) {
+        uint64_t wake = next_wakeup_ns(max_ticks);
+        if (wake == std::numeric_limits<uint64_t>::max()) {
+            return -1;
+        }
+        // Once the timeout expires, a coarse clock might not have
+        // reached the wakeup time yet. Wait long enough for it to
+        // catch up, rather than waking up repeatedly.
+        wake += resolution_ns_;
+        uint64_t now = now_ns();
+        if (wake <= now) {
+            return 0;
+        }
+        uint64_t ms = (wake - now + 999999) / 1000000;
+        return ms > uint64_t(std::numeric_limits<int>::max()) ?
+            std::numeric_limits<int>::max() : int(ms);
+    }
+
+    // Return a timerfd that becomes readable when the wheel next needs
+    // to be advanced, once arm() has been called. The timerfd is
+    // created on the first call. Returns -1 if creating it failed.
+    int timerfd() {
+        if (timerfd_ < 0) {
+            // timerfds don't support the coarse clocks, but they use
+            // the same time base as the precise version.
+            clockid_t clock = clock_;
+#ifdef CLOCK_MONOTONIC_COARSE
+            if (clock == CLOCK_MONOTONIC_COARSE) {
+                clock = CLOCK_MONOTONIC;
+            }
+#endif
+#ifdef CLOCK_REALTIME_COARSE
+            if (clock == CLOCK_REALTIME_COARSE) {
+                clock = CLOCK_REALTIME;
+            }
+#endif
+            timerfd_ = timerfd_create(clock, TFD_NONBLOCK | TFD_CLOEXEC);
+        }
+        return timerfd_;
+    }
+
+    // Arm the timerfd for the next wakeup, or disarm it if nothing is
+    // scheduled. The system call is only made if the wakeup time has
+    // changed since the previous call. Returns false if arming the
+    // timerfd failed.
+    bool arm() {
+        if (timerfd() < 0) {
+            return false;
+        }
+        uint64_t wake = next_wakeup_ns();
+        if (wake == std::numeric_limits<uint64_t>::max()) {
+            // Disarm.
+            wake = 0;
+        } else if (wake == 0) {
+            // A zero would disarm the timer, use the earliest possible
+            // time instead.
+            wake = 1;
+        }
+        if (wake == armed_ns_) {
+            return true;
+        }
+        struct itimerspec spec = {};
+        spec.it_value.tv_sec = wake / 1000000000;
+        spec.it_value.tv_nsec = wake % 1000000000;
+        if (timerfd_settime(timerfd_, TFD_TIMER_ABSTIME, &spec, NULL) < 0) {
+            armed_ns_ = 0;
+            return false;
+        }
+        armed_ns_ = wake;
+        return true;
+    }
+
+    // Handle the timerfd becoming readable: advance the wheel, and
+    // arm the timerfd for the next wakeup. Returns false if
+    // max_execute was reached, in which case the timerfd is armed to
+    // fire immediately.
+    bool handle_timerfd(size_t max_execute = std::numeric_limits<size_t>::max()) {
+        uint64_t now = now_ns();
+        // Rearming the timerfd resets the expiration count, so a
+        // successful read means the time it's currently armed for has
+        // passed, even if a coarse clock doesn't show it yet. Without
+        // this we'd keep waking up until the coarse clock caught up.
+        uint64_t expirations;
+        if (read(timerfd_, &expirations, sizeof(expirations)) ==
+            sizeof(expirations)) {
+            now = std::max(now, armed_ns_);
+        }
+        bool done = advance_to_ns(now, max_execute);
+        arm();
+        return done;
+    }
+
+    // Return the number of nanoseconds per tick.
+    uint64_t ns_per_tick() const { return ns_per_tick_; }
+
+private:
+    TimerWheelClockT(const TimerWheelClockT& other) = delete;
+    TimerWheelClockT& operator=(const TimerWheelClockT& other) = delete;
+
+    // The number of ticks from the creation of the clock to the
+    // current time of the wheel. Tracked separately, since with a
+    // narrow Tick type the wheel's time wraps around. While an advance
+    // is pending, the wheel is still behind the time it's being
+    // advanced to, and that target is what counts.
+    uint64_t ticks_now() const {
+        typedef typename std::make_signed<Tick>::type Diff;
+        if (pending_) {
+            return elapsed_;
+        }
+        // The wheel might also have been advanced directly.
+        Diff since = Diff(Tick(wheel_->now() - Tick(base_tick_ + elapsed_)));
+        return since > 0 ? elapsed_ + since : elapsed_;
+    }
+
+    static uint64_t read_clock(clockid_t clock) {
+        struct timespec ts;
+        clock_gettime(clock, &ts);
+        return uint64_t(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+    }
+
+    Wheel* wheel_;
+    uint64_t ns_per_tick_;
+    clockid_t clock_;
+    Tick slack_ticks_;
+    // The clock time and wheel tick that correspond to each other.
+    uint64_t base_ns_;
+    Tick base_tick_;
+    // The number of ticks from the creation of the clock to the last
+    // time the clock advanced the wheel to.
+    uint64_t elapsed_ = 0;
+    uint64_t resolution_ns_ = 0;
+    // True if the last advance of the wheel returned false.
+    bool pending_ = false;
+    int timerfd_ = -1;
+    // The absolute time the timerfd is currently armed for, or 0 if
+    // it's disarmed.
+    uint64_t armed_ns_ = 0;
+};
+
+typedef TimerWheelClockT<> TimerWheelClock;
+
+#endif //  RATAS_TIMER_WHEEL_CLOCK_H
@@ -0,0 +1,387 @@
+// -*- mode: c++; c-basic-offset: 4 indent-tabs-mode: nil -*- */
+//
+// Copyright 2016 Juho Snellman, released under a MIT license (see
+// LICENSE).
+//
+// SPDX-License-Identifier: MIT
+//
+// A hierarchical timer wheel for very large numbers of timers, where
+// the per-timer memory use matters more than flexibility.
+//
+// Rather than the user embedding TimerEvents in their own objects,
+// the wheel owns all the timers in a single arena. A timer is
+// referred to by its 32-bit index in the arena, and carries a small
+// Payload (e.g. a connection id) which is passed back when the timer
+// expires. All the timers are executed by the same handler, passed to
+// advance(). The links between timers in a slot are 32-bit indices,
+// the slot is a 16-bit id, and the deadline is stored as a 32-bit
+// offset that's interpreted relative to the current time of the
+// wheel. So the overhead per timer is 14 bytes (padded to the
+// alignment of the Payload) instead of the 40 bytes of a
+// TimerEventInterface, and walking the timers in a slot stays inside
+// one dense array.
+//
+// The cost is that a timer can't be scheduled more than 2^31-1 ticks
+// into the future, and that the handler can't differ between timers.
+//
+//      CompactTimerWheel<uint64_t> timers;
+//      auto id = timers.create(connection_id);
+//      timers.schedule(id, 1000);
+//      ...
+//      timers.advance(ticks, [&] (CompactTimerWheel<uint64_t>::Id id) {
+//          close_connection(timers.payload(id));
+//      });
+
+#ifndef RATAS_TIMER_WHEEL_COMPACT_H
+#define RATAS_TIMER_WHEEL_COMPACT_H
+
+#include "timer-wheel.h"
+
+template<typename Payload, int WidthBits = 8>
+class CompactTimerWheel {
+public:
+    // The index of a timer in the arena.
+    typedef uint32_t Id;
+
+    static constexpr Tick MAX_DELTA = (Tick(1) << 31) - 1;
+
+    CompactTimerWheel(Tick now = 0)
+        : now_(now) {
+        for (int i = 0; i < NUM_LEVELS; ++i) {
+            for (int j = 0; j < NUM_SLOTS; ++j) {
+                heads_[i][j] = NONE;
+            }
+            for (int j = 0; j < OCCUPANCY_WORDS; ++j) {
+                occupied_[i][j] = 0;
+            }
+        }
+    }
+
+    // Create a new timer with the given payload. The timer is not
+    // scheduled. The ids of destroyed timers are reused.
+    Id create(Payload payload) {
+        Id id;
+        if (free_ != NONE) {
+            id = free_;
+            free_ = entries_[id].next;
+            --free_count_;
+        } else {
+            id = entries_.size();
+            assert(id != NONE);
+            entries_.emplace_back();
+        }
+        Entry& entry = entries_[id];
+        entry.next = entry.prev = NONE;
+        entry.slot = INACTIVE;
+        entry.payload = std::move(payload);
+        return id;
+    }
+
+    // Cancel the timer, and return its id to the arena.
+    void destroy(Id id) {
+        cancel(id);
+        Entry& entry = entries_[id];
+        entry.slot = FREE;
+        entry.next = free_;
+        free_ = id;
+        ++free_count_;
+    }
+
+    // Schedule the timer to expire delta ticks from the current time.
+    // The delta must be non-0 and at most MAX_DELTA.
+    void schedule(Id id, Tick delta) {
+        assert(delta > 0 && delta <= MAX_DELTA);
+        unlink(id);
+        Tick at = now_ + delta;
+        entries_[id].deadline = uint32_t(at);
+        insert(id, at);
+    }
+
+    // Unschedule the timer. It's safe to cancel a timer that is
+    // inactive.
+    void cancel(Id id) {
+        unlink(id);
+    }
+
+    // Return true iff the timer is currently scheduled.
+    bool active(Id id) const {
+        assert(entries_[id].slot != FREE);
+        return entries_[id].slot != INACTIVE;
+    }
+
+    // Return the absolute tick the timer is scheduled to expire on.
+    // Only valid while the timer is active.
+    Tick scheduled_at(Id id) const {
+        return deadline(entries_[id]);
+    }
+
+    // Return the payload of the timer. The reference is invalidated
+    // by create().
+    Payload& payload(Id id) {
+        return entries_[id].payload;
+    }
+
+    // Return the current tick value.
+    Tick now() const { return now_; }
+
+    // Return the number of timers in the arena, including the
+    // inactive ones but not the destroyed ones.
+    size_t size() const { return entries_.size() - free_count_; }
+
+    // Advance the wheel by delta ticks, calling handler(id) for each
+    // timer that expires. The timer is no longer active when the
+    // handler is called, and the handler may schedule, create or
+    // destroy timers. Returns false if max_execute timers were
+    // expired before all the work was done, in which case the rest
+    // will be handled by the next call. Like with TimerWheel::advance(),
+    // delta may only be 0 after such a call, and during the execution
+    // of the handler now() will return the tick the timer was
+    // scheduled on.
+    template<typename Handler>
+    bool advance(Tick delta, Handler&& handler,
+                 size_t max_execute = std::numeric_limits<size_t>::max()) {
+        if (pending_) {
+            end_ += delta;
+            if (!process_current_slot(handler, &max_execute)) {
+                return false;
+            }
+            pending_ = false;
+        } else {
+            assert(delta > 0);
+            end_ = now_ + delta;
+        }
+        while (now_ != end_) {
+            Tick ticks = ticks_to_busy_tick();
+            if (!ticks || ticks > Tick(end_ - now_)) {
+                now_ = end_;
+                break;
+            }
+            now_ += ticks;
+            promote();
+            if (!process_current_slot(handler, &max_execute)) {
+                pending_ = true;
+                return false;
+            }
+        }
+        return true;
+    }
+
+    // Return the number of ticks until the next timer expires, or max
+    // if that's further away (or nothing is scheduled). Will return 0
+    // if the last call to advance() returned false.
+    Tick ticks_to_next_event(Tick max = std::numeric_limits<Tick>::max()) {
+        if (pending_) {
+            return 0;
+        }
+        Tick min = max;
+        for (int level = 0; level < NUM_LEVELS; ++level) {
+            int shift = WIDTH_BITS * level;
+            size_t current = (now_ >> shift) & MASK;
+            int found = next_occupied_slot(level, (current + 1) & MASK);
+            if (found == NUM_SLOTS) {
+                continue;
+            }
+            // The slots of a level cover consecutive time ranges, so
+            // the earliest timer on the level is in the first
+            // non-empty slot. On the core wheel that's the exact time.
+            size_t slot_index = (current + 1 + found) & MASK;
+            if (level == 0) {
+                min = std::min(min, Tick(found + 1));
+                continue;
+            }
+            for (Id id = heads_[level][slot_index]; id != NONE;
+                 id = entries_[id].next) {
+                min = std::min(min, Tick(deadline(entries_[id]) - now_));
+            }
+        }
+        return min;
+    }
+
+    // Return the number of bytes each timer takes up in the arena.
+    static constexpr size_t bytes_per_timer() { return sizeof(Entry); }
+
+private:
+    CompactTimerWheel(const CompactTimerWheel& other) = delete;
+    CompactTimerWheel& operator=(const CompactTimerWheel& other) = delete;
+
+    static constexpr int WIDTH_BITS = WidthBits;
+    // Enough levels to cover MAX_DELTA.
+    static constexpr int NUM_LEVELS = (32 + WIDTH_BITS - 1) / WIDTH_BITS;
+    static constexpr int NUM_SLOTS = 1 << WIDTH_BITS;
+    static constexpr int MASK = NUM_SLOTS - 1;
+    static constexpr int OCCUPANCY_WORDS = (NUM_SLOTS + 63) / 64;
+    static constexpr Id NONE = ~Id(0);
+    // Values of Entry::slot that don't refer to a slot.
+    static constexpr uint16_t INACTIVE = 0xffff;
+    static constexpr uint16_t FREE = 0xfffe;
+
+    static_assert(WidthBits > 0 && WidthBits < 16, "WidthBits out of range");
+    static_assert(NUM_LEVELS * NUM_SLOTS < FREE,
+                  "Too many slots for a 16-bit slot id");
+
+    struct Entry {
+        // The neighbors in the slot's list, or NONE. For destroyed
+        // timers, next links the free list.
+        Id next;
+        Id prev;
+        // The low 32 bits of the absolute deadline.
+        uint32_t deadline;
+        // level * NUM_SLOTS + slot index, or INACTIVE or FREE.
+        uint16_t slot;
+        Payload payload;
+    };
+
+    // Reconstruct the full deadline from its low bits. A timer is
+    // never more than MAX_DELTA ticks in the future, nor in the past.
+    Tick deadline(const Entry& entry) const {
+        return now_ + int32_t(entry.deadline - uint32_t(now_));
+    }
+
+    // The timer goes on the lowest level on which the deadline and
+    // the current time fall in the same slot of the next level up.
+    // That slot of each level is the one being processed right now,
+    // so the timer will get promoted as soon as the current time
+    // reaches the start of its slot. The outermost level wraps around
+    // instead, which is fine since it covers more than MAX_DELTA.
+    void insert(Id id, Tick at) {
+        int level = 0;
+        while (level < NUM_LEVELS - 1 &&
+               (at >> (WIDTH_BITS * (level + 1))) !=
+               (now_ >> (WIDTH_BITS * (level + 1)))) {
+            ++level;
+        }
+        size_t slot_index = (at >> (WIDTH_BITS * level)) & MASK;
+        Id& head = heads_[level][slot_index];
+        Entry& entry = entries_[id];
+        entry.slot = level * NUM_SLOTS + slot_index;
+        entry.prev = NONE;
+        entry.next = head;
+        if (head != NONE) {
+            entries_[head].prev = id;
+        }
+        head = id;
+        occupied_[level][slot_index / 64] |= uint64_t(1) << (slot_index % 64);
+    }
+
+    void unlink(Id id) {
+        Entry& entry = entries_[id];
+        assert(entry.slot != FREE);
+        if (entry.slot == INACTIVE) {
+            return;
+        }
+        if (entry.next != NONE) {
+            entries_[entry.next].prev = entry.prev;
+        }
+        if (entry.prev != NONE) {
+            entries_[entry.prev].next = entry.next;
+        } else {
+            heads_[entry.slot / NUM_SLOTS][entry.slot % NUM_SLOTS] =
+                entry.next;
+        }
+        entry.next = entry.prev = NONE;
+        entry.slot = INACTIVE;
+    }
+
+    // Return the number of ticks until the first tick on which some
+    // slot needs to be promoted or executed, or 0 if there's none.
+    Tick ticks_to_busy_tick() {
+        Tick best = 0;
+        for (int level = 0; level < NUM_LEVELS; ++level) {
+            int shift = WIDTH_BITS * level;
+            size_t current = (now_ >> shift) & MASK;
+            int found = next_occupied_slot(level, (current + 1) & MASK);
+            if (found == NUM_SLOTS) {
+                continue;
+            }
+            Tick ticks = (((now_ >> shift) + found + 1) << shift) - now_;
+            if (!best || ticks < best) {
+                best = ticks;
+            }
+        }
+        return best;
+    }
+
+    // Move the timers from the current slot of each outer level whose
+    // slot just started to the levels below it, outermost first.
+    void promote() {
+        int top = 0;
+        while (top < NUM_LEVELS - 1 &&
+               (now_ & ((Tick(1) << (WIDTH_BITS * (top + 1))) - 1)) == 0) {
+            ++top;
+        }
+        for (int level = top; level > 0; --level) {
+            size_t slot_index = (now_ >> (WIDTH_BITS * level)) & MASK;
+            Id id = heads_[level][slot_index];
+            heads_[level][slot_index] = NONE;
+            clear_occupied(level, slot_index);
+            while (id != NONE) {
+                Id next = entries_[id].next;
+                insert(id, deadline(entries_[id]));
+                id = next;
+            }
+        }
+    }
+
+    template<typename Handler>
+    bool process_current_slot(Handler& handler, size_t* max_execute) {
+        size_t slot_index = now_ & MASK;
+        Id& head = heads_[0][slot_index];
+        while (head != NONE) {
+            if (!*max_execute) {
+                return false;
+            }
+            Id id = head;
+            unlink(id);
+            --*max_execute;
+            handler(id);
+        }
+        clear_occupied(0, slot_index);
+        return true;
+    }
+
+    void clear_occupied(int level, size_t slot_index) {
+        occupied_[level][slot_index / 64] &= ~(uint64_t(1) << (slot_index % 64));
+    }
+
+    // Return the distance from slot "start" to the first non-empty
+    // slot on the level (wrapping around, and including "start"
+    // itself), or NUM_SLOTS if the whole level is empty.
+    int next_occupied_slot(int level, size_t start) {
+        for (int i = 0; i < NUM_SLOTS; ++i) {
+            size_t slot_index = (start + i) & MASK;
+            uint64_t bits = occupied_[level][slot_index / 64] >>
+                (slot_index % 64);
+            if (!bits) {
+                // Skip to the start of the next word.
+                i += 63 - slot_index % 64;
+                continue;
+            }
+            if (!(bits & 1)) {
+                i += timer_wheel_ctz(bits) - 1;
+                continue;
+            }
+            if (heads_[level][slot_index] != NONE) {
+                return i;
+            }
+            // Everything in the slot was canceled, fix up the bitmap.
+            clear_occupied(level, slot_index);
+        }
+        return NUM_SLOTS;
+    }
+
+    Tick now_;
+    // The tick the current call to advance() is moving to.
+    Tick end_ = 0;
+    // True if the last advance() returned false.
+    bool pending_ = false;
+    std::vector<Entry> entries_;
+    // The first destroyed timer, or NONE.
+    Id free_ = NONE;
+    size_t free_count_ = 0;
+    Id heads_[NUM_LEVELS][NUM_SLOTS];
+    // One bit per slot, set when a timer goes into the slot and
+    // cleared once the slot is seen to be empty.
+    uint64_t occupied_[NUM_LEVELS][OCCUPANCY_WORDS];
+};
+
+#endif //  RATAS_TIMER_WHEEL_COMPACT_H
@@ -0,0 +1,332 @@
+// -*- mode: c++; c-basic-offset: 4 indent-tabs-mode: nil -*- */
+//
+// Copyright 2016 Juho Snellman, released under a MIT license (see
+// LICENSE).
+//
+// SPDX-License-Identifier: MIT
+//
+// C++20 coroutine support for TimerWheel. Unlike the rest of the
+// library, this header requires C++20.
+//
+//      co_await sleep_for(&timers, 100);
+//      co_await sleep_until(&timers, deadline);
+//      std::optional<Message> message =
+//          co_await with_timeout(&timers, connection.read(), 1000);
+//
+// The awaitable returned by sleep_for() and sleep_until() is itself
+// the timer event. While the coroutine is suspended, the awaitable
+// lives in the coroutine frame, so waiting doesn't allocate any
+// memory. When the timer expires, advance() resumes the coroutine
+// directly through its handle. If the coroutine frame is destroyed
+// while it's suspended, the event gets destroyed with it, which
+// cancels the timer.
+
+#ifndef RATAS_TIMER_WHEEL_CORO_H
+#define RATAS_TIMER_WHEEL_CORO_H
+
+#if !defined(__cpp_impl_coroutine)
+#error "timer-wheel-coro.h requires C++20 coroutines"
+#endif
+
+#include <coroutine>
+#include <exception>
+#include <optional>
+#include <type_traits>
+#include <utility>
+
+#include "timer-wheel.h"
+
+// An awaitable that suspends the coroutine for some number of ticks.
+// Created by sleep_for() and sleep_until().
+template<typename Wheel = TimerWheel>
+class TimerWheelSleep : public TimerEventInterface {
+public:
+    typedef typename Wheel::Tick Tick;
+
+    // Sleep for delta ticks. A delta of 0 doesn't suspend at all.
+    TimerWheelSleep(Wheel* wheel, Tick delta)
+        : TimerEventInterface(&TimerWheelSleep::execute_callback),
+          wheel_(wheel),
+          delta_(delta) {
+    }
+
+    // Only an awaitable that isn't being awaited can be moved, e.g.
+    // into with_timeout().
+    TimerWheelSleep(TimerWheelSleep&& other)
+        : TimerWheelSleep(other.wheel_, other.delta_) {
+        assert(!other.active());
+    }
+
+    bool await_ready() const noexcept {
+        return delta_ == 0;
+    }
+
+    void await_suspend(std::coroutine_handle<> handle) {
+        handle_ = handle;
+        wheel_->schedule(this, delta_);
+    }
+
+    void await_resume() const noexcept {
+    }
+
+private:
+    static void execute_callback(TimerEventInterface* event) {
+        // This might destroy the frame the event is in, so it must be
+        // the last thing done.
+        static_cast<TimerWheelSleep*>(event)->handle_.resume();
+    }
+
+    Wheel* wheel_;
+    Tick delta_;
+    std::coroutine_handle<> handle_;
+};
+
+// Suspend the coroutine for delta ticks.
+template<typename Wheel>
+TimerWheelSleep<Wheel> sleep_for(Wheel* wheel, typename Wheel::Tick delta) {
+    return TimerWheelSleep<Wheel>(wheel, delta);
+}
+
+// Suspend the coroutine until the wheel's time reaches the tick. If
+// it already has, the coroutine isn't suspended.
+template<typename Wheel>
+TimerWheelSleep<Wheel> sleep_until(Wheel* wheel, typename Wheel::Tick at) {
+    typedef typename Wheel::Tick Tick;
+    typedef typename std::make_signed<Tick>::type Diff;
+    Tick delta = at - wheel->now();
+    return TimerWheelSleep<Wheel>(wheel, Diff(delta) > 0 ? delta : 0);
+}
+
+// Purely an implementation detail. Memory for short-lived coroutine
+// frames, kept on per-thread free lists by size class so that
+// with_timeout() doesn't need to go to the allocator every time.
+// Frames larger than the largest size class are allocated normally.
+class TimerCoroutineFramePool {
+public:
+    static void* allocate(size_t size) {
+        int size_class = get_size_class(size);
+        if (size_class < 0) {
+            return ::operator new(size);
+        }
+        Block*& head = free_lists().heads[size_class];
+        if (Block* block = head) {
+            head = block->next;
+            return block;
+        }
+        return ::operator new(MIN_SIZE << size_class);
+    }
+
+    // The size must be the one passed to allocate().
+    static void deallocate(void* ptr, size_t size) {
+        int size_class = get_size_class(size);
+        if (size_class < 0) {
+            ::operator delete(ptr);
+            return;
+        }
+        Block*& head = free_lists().heads[size_class];
+        Block* block = static_cast<Block*>(ptr);
+        block->next = head;
+        head = block;
+    }
+
+private:
+    static const size_t MIN_SIZE = 64;
+    static const int NUM_SIZE_CLASSES = 7;
+
+    struct Block {
+        Block* next;
+    };
+
+    struct FreeLists {
+        ~FreeLists() {
+            for (Block* head : heads) {
+                while (head) {
+                    Block* next = head->next;
+                    ::operator delete(head);
+                    head = next;
+                }
+            }
+        }
+
+        Block* heads[NUM_SIZE_CLASSES] = {};
+    };
+
+    // Returns -1 for sizes that don't fit any size class.
+    static int get_size_class(size_t size) {
+        int size_class = 0;
+        while ((MIN_SIZE << size_class) < size) {
+            if (++size_class == NUM_SIZE_CLASSES) {
+                return -1;
+            }
+        }
+        return size_class;
+    }
+
+    static FreeLists& free_lists() {
+        thread_local FreeLists lists;
+        return lists;
+    }
+};
+
+// Purely an implementation detail. The type co_await of an Awaitable
+// evaluates to, for awaitables that are either awaiters themselves or
+// have a member operator co_await.
+template<typename Awaitable, typename = void>
+struct TimerAwaitResult {
+    typedef decltype(std::declval<Awaitable&>().await_resume()) type;
+};
+
+template<typename Awaitable>
+struct TimerAwaitResult<
+    Awaitable,
+    std::void_t<decltype(std::declval<Awaitable>().operator co_await())>> {
+    typedef decltype(std::declval<Awaitable>().operator co_await()
+                     .await_resume()) type;
+};
+
+// An awaitable that awaits another one, but gives up after some
+// number of ticks. Created by with_timeout().
+//
+// The result of co_await is a std::optional of the result of the
+// other awaitable, which is empty if the timeout was reached. If the
+// other awaitable's result is void, the result is a bool that's false
+// if the timeout was reached.
+//
+// The other awaitable is awaited in a separate coroutine, whose frame
+// comes from a TimerCoroutineFramePool. On a timeout, that coroutine
+// gets destroyed. So the other awaitable has to cancel whatever it's
+// waiting for when it's destroyed, just like TimerWheelSleep does.
+template<typename Wheel, typename Awaitable>
+class TimerWheelTimeout {
+public:
+    typedef typename Wheel::Tick Tick;
+    typedef typename TimerAwaitResult<Awaitable>::type Inner;
+    typedef typename std::conditional<std::is_void<Inner>::value,
+                                      bool,
+                                      std::optional<Inner>>::type Result;
+
+    TimerWheelTimeout(Wheel* wheel, Awaitable awaitable, Tick ticks)
+        : wheel_(wheel),
+          awaitable_(std::move(awaitable)),
+          ticks_(ticks),
+          timer_(this) {
+    }
+
+    ~TimerWheelTimeout() {
+        if (helper_) {
+            helper_.destroy();
+        }
+    }
+
+    bool await_ready() const noexcept {
+        return false;
+    }
+
+    std::coroutine_handle<> await_suspend(std::coroutine_handle<> parent) {
+        parent_ = parent;
+        helper_ = await_inner(this, std::move(*awaitable_)).handle;
+        awaitable_.reset();
+        wheel_->schedule(&timer_, ticks_);
+        return helper_;
+    }
+
+    Result await_resume() {
+        if (helper_) {
+            helper_.destroy();
+            helper_ = nullptr;
+        }
+        if (exception_) {
+            std::rethrow_exception(exception_);
+        }
+        return std::move(result_);
+    }
+
+private:
+    TimerWheelTimeout(const TimerWheelTimeout& other) = delete;
+    TimerWheelTimeout& operator=(const TimerWheelTimeout& other) = delete;
+
+    struct Helper {
+        struct promise_type {
+            promise_type(TimerWheelTimeout* self, Awaitable& awaitable)
+                : self(self) {
+            }
+
+            static void* operator new(size_t size) {
+                return TimerCoroutineFramePool::allocate(size);
+            }
+            static void operator delete(void* ptr, size_t size) {
+                TimerCoroutineFramePool::deallocate(ptr, size);
+            }
+
+            Helper get_return_object() {
+                return Helper {
+                    std::coroutine_handle<promise_type>::from_promise(*this)
+                };
+            }
+            std::suspend_always initial_suspend() noexcept { return {}; }
+            // Continue with the coroutine that's waiting for the
+            // result, leaving this one to be destroyed by
+            // await_resume().
+            auto final_suspend() noexcept {
+                struct Transfer {
+                    bool await_ready() noexcept { return false; }
+                    std::coroutine_handle<> await_suspend(
+                        std::coroutine_handle<promise_type> handle) noexcept {
+                        return handle.promise().self->parent_;
+                    }
+                    void await_resume() noexcept { }
+                };
+                return Transfer();
+            }
+            void return_void() { }
+            void unhandled_exception() {
+                self->timer_.cancel();
+                self->exception_ = std::current_exception();
+            }
+
+            TimerWheelTimeout* self;
+        };
+
+        std::coroutine_handle<promise_type> handle;
+    };
+
+    // The awaitable is passed by value, so that it lives in the
+    // helper's frame and gets destroyed along with it.
+    static Helper await_inner(TimerWheelTimeout* self, Awaitable awaitable) {
+        if constexpr (std::is_void<Inner>::value) {
+            co_await std::move(awaitable);
+            self->result_ = true;
+        } else {
+            self->result_.emplace(co_await std::move(awaitable));
+        }
+        self->timer_.cancel();
+    }
+
+    void on_timeout() {
+        helper_.destroy();
+        helper_ = nullptr;
+        parent_.resume();
+    }
+
+    Wheel* wheel_;
+    // Moved into the helper once awaited.
+    std::optional<Awaitable> awaitable_;
+    Tick ticks_;
+    MemberTimerEvent<TimerWheelTimeout, &TimerWheelTimeout::on_timeout> timer_;
+    std::coroutine_handle<> parent_;
+    std::coroutine_handle<typename Helper::promise_type> helper_;
+    Result result_ {};
+    std::exception_ptr exception_;
+};
+
+// Await the awaitable, but for at most ticks ticks (which must be
+// non-0). See TimerWheelTimeout.
+template<typename Wheel, typename Awaitable>
+TimerWheelTimeout<Wheel, typename std::decay<Awaitable>::type>
+with_timeout(Wheel* wheel, Awaitable&& awaitable,
+             typename Wheel::Tick ticks) {
+    return TimerWheelTimeout<Wheel, typename std::decay<Awaitable>::type>(
+        wheel, std::forward<Awaitable>(awaitable), ticks);
+}
+
+#endif //  RATAS_TIMER_WHEEL_CORO_H
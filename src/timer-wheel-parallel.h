@@ -0,0 +1,416 @@
+// -*- mode: c++; c-basic-offset: 4 indent-tabs-mode: nil -*- */
+//
+// Copyright 2016 Juho Snellman, released under a MIT license (see
+// LICENSE).
+//
+// SPDX-License-Identifier: MIT
+//
+// Running expired timer callbacks on other threads, for callbacks that
+// are too expensive to run on the thread advancing the wheel.
+//
+// The callbacks of DispatchedTimerEvents aren't run inside advance().
+// Instead the expired events are collected, one tick at a time, and
+// handed over to an executor. Events can be given an affinity key. The
+// callbacks of events with the same key are run one at a time, in the
+// order the events expired in. Events with different keys (or with no
+// key) can run in parallel.
+//
+//      TimerThreadPool pool(4);
+//      TimerWheel timers;
+//      TimerWheelDispatcher dispatcher(&timers, &pool);
+//      DispatchedTimerEvent<InlineCallback<>> teardown(
+//          &dispatcher, [this] () { ... }, session_id);
+//      timers.schedule(&teardown, 1000);
+//      ...
+//      dispatcher.advance(delta);
+//
+// The wheel is still single-threaded. So the callbacks must not touch
+// the wheel, e.g. to reschedule the event; use a TimerWheelMailbox for
+// that instead. A DispatchedTimerEvent must also not be destroyed
+// while running() is true.
+
+#ifndef RATAS_TIMER_WHEEL_PARALLEL_H
+#define RATAS_TIMER_WHEEL_PARALLEL_H
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "timer-wheel.h"
+
+class TimerDispatcherBase;
+
+// An event whose callback is run by the executor of a dispatcher
+// rather than by the wheel. Like TimerEventInterface, subclasses pass
+// in a plain function that runs the callback.
+class DispatchedTimerEventInterface : public TimerEventInterface {
+public:
+    // A function that runs the callback of the event it's passed.
+    typedef void (*RunFn)(DispatchedTimerEventInterface* event);
+
+    // The key of events with no ordering requirements.
+    static const uint64_t NO_KEY = ~uint64_t(0);
+
+    // Return the affinity key of the event.
+    uint64_t key() const { return key_; }
+    // Change the affinity key. Must not be called while the event is
+    // running().
+    void set_key(uint64_t key) { key_ = key; }
+
+    // Return true iff the event has expired, but its callback hasn't
+    // finished running yet.
+    bool running() const {
+        return dispatched_.load(std::memory_order_acquire) != 0;
+    }
+
+protected:
+    DispatchedTimerEventInterface(TimerDispatcherBase* dispatcher,
+                                  RunFn run, uint64_t key)
+        : TimerEventInterface(&DispatchedTimerEventInterface::collect),
+          dispatcher_(dispatcher),
+          run_(run),
+          key_(key) {
+    }
+
+private:
+    friend TimerDispatcherBase;
+    template<typename Executor, typename Wheel>
+    friend class TimerWheelDispatcherT;
+
+    // Called by the wheel when the event expires.
+    inline static void collect(TimerEventInterface* event);
+
+    void run() {
+        run_(this);
+        // The event might get destroyed right after this, so it must
+        // be the last access.
+        dispatched_.fetch_sub(1, std::memory_order_release);
+    }
+
+    TimerDispatcherBase* dispatcher_;
+    RunFn run_;
+    uint64_t key_;
+    // The number of times the event has been dispatched without the
+    // callback having finished. It can be more than 1 if the event
+    // was rescheduled and expired again before the callback ran.
+    std::atomic<unsigned> dispatched_ { 0 };
+};
+
+// A dispatched event that takes the callback (of type CBType) as a
+// constructor parameter.
+template<typename CBType>
+class DispatchedTimerEvent : public DispatchedTimerEventInterface {
+public:
+    DispatchedTimerEvent(TimerDispatcherBase* dispatcher, CBType callback,
+                         uint64_t key = NO_KEY)
+        : DispatchedTimerEventInterface(dispatcher,
+                                        &DispatchedTimerEvent::run_callback,
+                                        key),
+          callback_(std::move(callback)) {
+    }
+
+private:
+    static void run_callback(DispatchedTimerEventInterface* event) {
+        static_cast<DispatchedTimerEvent*>(event)->callback_();
+    }
+
+    CBType callback_;
+};
+
+// Purely an implementation detail. The part of TimerWheelDispatcherT
+// that doesn't depend on its template parameters, so that the events
+// don't need to either.
+class TimerDispatcherBase {
+protected:
+    typedef void (*FlushFn)(TimerDispatcherBase* dispatcher);
+
+    explicit TimerDispatcherBase(FlushFn flush) : flush_(flush) {
+    }
+
+    // The events that have expired but haven't been dispatched yet,
+    // all from the same tick.
+    std::vector<DispatchedTimerEventInterface*> collected_;
+
+private:
+    TimerDispatcherBase(const TimerDispatcherBase& other) = delete;
+    TimerDispatcherBase& operator=(const TimerDispatcherBase& other) = delete;
+    friend DispatchedTimerEventInterface;
+
+    void collect(DispatchedTimerEventInterface* event) {
+        // While the wheel is executing an event, the event's tick is
+        // the current tick. So a new tick has started once that
+        // changes.
+        if (!collected_.empty() && event->scheduled_at() != collected_tick_) {
+            flush_(this);
+        }
+        collected_tick_ = event->scheduled_at();
+        event->dispatched_.fetch_add(1, std::memory_order_relaxed);
+        collected_.push_back(event);
+    }
+
+    FlushFn flush_;
+    Tick collected_tick_ = 0;
+};
+
+void DispatchedTimerEventInterface::collect(TimerEventInterface* event) {
+    auto self = static_cast<DispatchedTimerEventInterface*>(event);
+    self->dispatcher_->collect(self);
+}
+
+// Advances a wheel, and hands the callbacks of the DispatchedTimerEvents
+// that expire to an executor. The Executor can be any type with a
+// method "execute(task)" that arranges for task() to be called on some
+// thread. The task is a copyable callable of two pointers. Events
+// that aren't DispatchedTimerEvents are executed by the wheel as
+// usual.
+//
+// The callbacks are spread over num_lanes lanes by their key. Each
+// lane is a queue, with at most one task at a time running the
+// callbacks from it. The events with no key are spread over the lanes
+// by their address.
+template<typename Executor, typename Wheel = TimerWheel>
+class TimerWheelDispatcherT : public TimerDispatcherBase {
+public:
+    typedef typename Wheel::Tick Tick;
+
+    TimerWheelDispatcherT(Wheel* wheel, Executor* executor,
+                          size_t num_lanes = 64)
+        : TimerDispatcherBase(&TimerWheelDispatcherT::flush_callback),
+          wheel_(wheel),
+          executor_(executor) {
+        assert(num_lanes > 0);
+        for (size_t i = 0; i < num_lanes; ++i) {
+            lanes_.emplace_back(new Lane());
+        }
+    }
+
+    // Waits for the callbacks that have already been dispatched. The
+    // DispatchedTimerEvents that are still scheduled on the wheel must
+    // not be allowed to expire after this.
+    ~TimerWheelDispatcherT() {
+        wait();
+    }
+
+    // Advance the wheel like Wheel::advance(), and dispatch the
+    // callbacks of the events that expired. Returns once they've been
+    // handed to the executor, without waiting for them to finish.
+    bool advance(Tick delta,
+                 size_t max_execute = std::numeric_limits<size_t>::max()) {
+        bool done = wheel_->advance(delta, max_execute);
+        flush();
+        return done;
+    }
+
+    // Wait until all the callbacks that have been dispatched so far
+    // have finished running.
+    void wait() {
+        std::unique_lock<std::mutex> lock(idle_lock_);
+        idle_.wait(lock, [this] () {
+            return outstanding_.load(std::memory_order_acquire) == 0;
+        });
+    }
+
+    // If true, the callbacks from a tick are only dispatched once all
+    // the callbacks from the previous ticks have finished, both within
+    // one advance() and across calls. That is, the events are run in
+    // tick order as with Wheel::advance(), but the events of a single
+    // tick still run in parallel.
+    void set_tick_barrier(bool tick_barrier) {
+        tick_barrier_ = tick_barrier;
+    }
+
+    // Return the number of dispatched callbacks that haven't finished
+    // yet.
+    size_t outstanding() const {
+        return outstanding_.load(std::memory_order_acquire);
+    }
+
+    Wheel* wheel() { return wheel_; }
+
+private:
+    struct Lane {
+        std::mutex lock;
+        // Callbacks waiting to run. Protected by the lock.
+        std::vector<DispatchedTimerEventInterface*> queue;
+        // True if there's a task running the callbacks in this lane,
+        // or one that's been handed to the executor. Protected by the
+        // lock.
+        bool active = false;
+        // The callbacks the task is running right now. Only touched by
+        // the task.
+        std::vector<DispatchedTimerEventInterface*> running;
+        // The lane's callbacks from the tick being dispatched. Only
+        // touched by the thread advancing the wheel.
+        std::vector<DispatchedTimerEventInterface*> staged;
+    };
+
+    // The task given to the executor, which runs the callbacks in a
+    // lane until it's empty.
+    class DrainTask {
+    public:
+        DrainTask(TimerWheelDispatcherT* dispatcher, Lane* lane)
+            : dispatcher_(dispatcher), lane_(lane) {
+        }
+
+        void operator()() const {
+            dispatcher_->drain(lane_);
+        }
+
+    private:
+        TimerWheelDispatcherT* dispatcher_;
+        Lane* lane_;
+    };
+
+    static void flush_callback(TimerDispatcherBase* dispatcher) {
+        static_cast<TimerWheelDispatcherT*>(dispatcher)->flush();
+    }
+
+    void flush() {
+        if (collected_.empty()) {
+            return;
+        }
+        if (tick_barrier_) {
+            wait();
+        }
+        for (auto event : collected_) {
+            Lane* lane = lane_for(event);
+            if (lane->staged.empty()) {
+                staged_lanes_.push_back(lane);
+            }
+            lane->staged.push_back(event);
+        }
+        outstanding_.fetch_add(collected_.size(), std::memory_order_relaxed);
+        collected_.clear();
+        for (auto lane : staged_lanes_) {
+            bool start;
+            {
+                std::lock_guard<std::mutex> lock(lane->lock);
+                lane->queue.insert(lane->queue.end(), lane->staged.begin(),
+                                   lane->staged.end());
+                start = !lane->active;
+                lane->active = true;
+            }
+            lane->staged.clear();
+            if (start) {
+                executor_->execute(DrainTask(this, lane));
+            }
+        }
+        staged_lanes_.clear();
+    }
+
+    Lane* lane_for(const DispatchedTimerEventInterface* event) const {
+        uint64_t key = event->key();
+        if (key == DispatchedTimerEventInterface::NO_KEY) {
+            key = uintptr_t(event) / alignof(DispatchedTimerEventInterface);
+        }
+        // Consecutive keys are common, and shouldn't end up on lanes
+        // with a common stride.
+        key *= 0x9e3779b97f4a7c15ull;
+        return lanes_[(key >> 32) % lanes_.size()].get();
+    }
+
+    void drain(Lane* lane) {
+        size_t finished = 0;
+        while (true) {
+            {
+                std::lock_guard<std::mutex> lock(lane->lock);
+                if (lane->queue.empty()) {
+                    lane->active = false;
+                    break;
+                }
+                std::swap(lane->queue, lane->running);
+            }
+            for (auto event : lane->running) {
+                event->run();
+            }
+            finished += lane->running.size();
+            lane->running.clear();
+        }
+        // Once the count reaches 0, wait() can return and the
+        // dispatcher can be destroyed. So the count is decremented
+        // under the lock that wait() checks it under, and nothing is
+        // touched after the lock is released.
+        std::lock_guard<std::mutex> lock(idle_lock_);
+        if (outstanding_.fetch_sub(finished, std::memory_order_acq_rel) ==
+            finished) {
+            idle_.notify_all();
+        }
+    }
+
+    Wheel* wheel_;
+    Executor* executor_;
+    std::vector<std::unique_ptr<Lane>> lanes_;
+    std::vector<Lane*> staged_lanes_;
+    bool tick_barrier_ = false;
+    std::atomic<size_t> outstanding_ { 0 };
+    std::mutex idle_lock_;
+    std::condition_variable idle_;
+};
+
+// A fixed size pool of threads running tasks in FIFO order, usable as
+// the executor of a TimerWheelDispatcherT. The tasks that are still
+// queued when the pool is destroyed are run before the threads exit.
+class TimerThreadPool {
+public:
+    explicit TimerThreadPool(size_t num_threads) {
+        for (size_t i = 0; i < num_threads; ++i) {
+            threads_.emplace_back([this] () { run(); });
+        }
+    }
+
+    ~TimerThreadPool() {
+        {
+            std::lock_guard<std::mutex> lock(lock_);
+            stopping_ = true;
+        }
+        wakeup_.notify_all();
+        for (auto& thread : threads_) {
+            thread.join();
+        }
+    }
+
+    template<typename F>
+    void execute(F&& task) {
+        {
+            std::lock_guard<std::mutex> lock(lock_);
+            tasks_.emplace_back(std::forward<F>(task));
+        }
+        wakeup_.notify_one();
+    }
+
+private:
+    TimerThreadPool(const TimerThreadPool& other) = delete;
+    TimerThreadPool& operator=(const TimerThreadPool& other) = delete;
+
+    void run() {
+        while (true) {
+            InlineCallback<> task;
+            {
+                std::unique_lock<std::mutex> lock(lock_);
+                wakeup_.wait(lock, [this] () {
+                    return stopping_ || !tasks_.empty();
+                });
+                if (tasks_.empty()) {
+                    return;
+                }
+                task = std::move(tasks_.front());
+                tasks_.pop_front();
+            }
+            task();
+        }
+    }
+
+    std::mutex lock_;
+    std::condition_variable wakeup_;
+    std::deque<InlineCallback<>> tasks_;
+    bool stopping_ = false;
+    std::vector<std::thread> threads_;
+};
+
+typedef TimerWheelDispatcherT<TimerThreadPool> TimerWheelDispatcher;
+
+#endif //  RATAS_TIMER_WHEEL_PARALLEL_H
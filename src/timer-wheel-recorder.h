@@ -0,0 +1,331 @@
+// -*- mode: c++; c-basic-offset: 4 indent-tabs-mode: nil -*- */
+//
+// Copyright 2016 Juho Snellman, released under a MIT license (see
+// LICENSE).
+//
+// SPDX-License-Identifier: MIT
+//
+// Recording the operations done on a TimerWheel into a compact binary
+// trace, so that real workloads can be replayed offline against
+// different wheel configurations.
+//
+// A TimerWheelRecorder wraps a wheel. Scheduling, canceling and
+// advancing through the recorder works just like on the wheel, but
+// the operation is also appended to the trace:
+//
+//      TimerWheel timers;
+//      int fd = open("timers.trace", O_WRONLY | O_CREAT | O_TRUNC, 0644);
+//      TimerWheelRecorder recorder(&timers, fd);
+//      recorder.schedule(&event, 100);
+//      recorder.advance(10);
+//
+// Any operations done on the wheel directly (including
+// TimerEventInterface::cancel()) are not recorded.
+//
+// A TimerTraceReader decodes the trace. See src/test/test_replay.cc
+// for a benchmark that replays a trace.
+//
+// The trace format is an 8 byte magic string, and the tick the
+// recording started on as a varint. That's followed by the operations,
+// each of which starts with a byte with the operation type in the low
+// 3 bits and the number of ticks since the previous operation in the
+// high 5 bits. If there have been 31 or more ticks, the high bits are
+// all set and the number of ticks follows as a varint. Then come the
+// arguments as varints:
+//
+// - SCHEDULE: event, delta
+// - SCHEDULE_IN_RANGE: event, start, end - start
+// - CANCEL: event
+// - ADVANCE: the number of ticks to the end of the advance, and
+//   max_execute + 1 (or 0 if there's no limit)
+//
+// Events are identified by their address, encoded as the zigzag
+// difference from the previous event's address in units of the
+// alignment of TimerEventInterface. Events that are near each other in
+// memory take just a byte or two.
+
+#ifndef RATAS_TIMER_WHEEL_RECORDER_H
+#define RATAS_TIMER_WHEEL_RECORDER_H
+
+#include <string.h>
+#include <unistd.h>
+
+#include "timer-wheel.h"
+
+// One operation decoded from a trace.
+struct TimerTraceOp {
+    enum Type {
+        SCHEDULE,
+        SCHEDULE_IN_RANGE,
+        CANCEL,
+        ADVANCE,
+    };
+
+    Type type;
+    // The tick of the wheel when the operation was done. Unlike the
+    // Tick of the wheel, this doesn't wrap around.
+    uint64_t tick;
+    // An opaque id for the event. The same event always gets the same
+    // id. Not set for ADVANCE.
+    uint64_t event;
+    // SCHEDULE: the delta. SCHEDULE_IN_RANGE: the start of the range.
+    // ADVANCE: the number of ticks from tick to the end of the
+    // advance. This includes ticks left over from a previous advance
+    // that hit max_execute.
+    uint64_t a;
+    // SCHEDULE_IN_RANGE: the end of the range. ADVANCE: max_execute.
+    uint64_t b;
+};
+
+static const char TIMER_TRACE_MAGIC[8] = {
+    'R', 'A', 'T', 'A', 'S', 'T', 'R', '1'
+};
+
+template<typename Wheel = TimerWheel>
+class TimerWheelRecorderT {
+public:
+    typedef typename Wheel::Tick Tick;
+
+    // Record the operations done through this object on the wheel
+    // into the file descriptor. The recorder buffers the trace, and
+    // writes it out in large chunks. The caller still owns the file
+    // descriptor, and must keep it open until the recorder has been
+    // destroyed.
+    TimerWheelRecorderT(Wheel* wheel, int fd)
+        : wheel_(wheel),
+          fd_(fd),
+          tick_(wheel->now()),
+          advance_end_(wheel->now()) {
+        memcpy(buffer_, TIMER_TRACE_MAGIC, sizeof(TIMER_TRACE_MAGIC));
+        pos_ = sizeof(TIMER_TRACE_MAGIC);
+        put_varint(uint64_t(tick_));
+    }
+
+    ~TimerWheelRecorderT() {
+        flush();
+    }
+
+    void schedule(TimerEventInterface* event, Tick delta) {
+        put_op(TimerTraceOp::SCHEDULE);
+        put_event(event);
+        put_varint(delta);
+        wheel_->schedule(event, delta);
+    }
+
+    void schedule_in_range(TimerEventInterface* event, Tick start, Tick end) {
+        put_op(TimerTraceOp::SCHEDULE_IN_RANGE);
+        put_event(event);
+        put_varint(start);
+        put_varint(end - start);
+        wheel_->schedule_in_range(event, start, end);
+    }
+
+    void cancel(TimerEventInterface* event) {
+        put_op(TimerTraceOp::CANCEL);
+        put_event(event);
+        event->cancel();
+    }
+
+    // The operations done by event callbacks during the advance are
+    // recorded with the tick the callback ran on.
+    bool advance(Tick delta,
+                 size_t max_execute = std::numeric_limits<size_t>::max()) {
+        // If the previous advance hit max_execute, this one will also
+        // process the rest of its ticks.
+        if (!pending_) {
+            advance_end_ = wheel_->now();
+        }
+        advance_end_ += delta;
+        put_op(TimerTraceOp::ADVANCE);
+        put_varint(Tick(advance_end_ - wheel_->now()));
+        put_varint(max_execute == std::numeric_limits<size_t>::max() ?
+                   0 : uint64_t(max_execute) + 1);
+        pending_ = !wheel_->advance(delta, max_execute);
+        return !pending_;
+    }
+
+    Tick now() const { return wheel_->now(); }
+
+    Tick ticks_to_next_event(Tick max = std::numeric_limits<Tick>::max()) {
+        return wheel_->ticks_to_next_event(max);
+    }
+
+    // Write out the buffered part of the trace. Returns false if this
+    // or any earlier write failed.
+    bool flush() {
+        size_t done = 0;
+        while (done < pos_ && ok_) {
+            ssize_t ret = write(fd_, buffer_ + done, pos_ - done);
+            if (ret <= 0) {
+                ok_ = false;
+            } else {
+                done += ret;
+            }
+        }
+        pos_ = 0;
+        return ok_;
+    }
+
+    // Return false if writing the trace has failed.
+    bool ok() const { return ok_; }
+
+    Wheel* wheel() { return wheel_; }
+
+private:
+    TimerWheelRecorderT(const TimerWheelRecorderT& other) = delete;
+    TimerWheelRecorderT& operator=(const TimerWheelRecorderT& other) = delete;
+
+    // The longest possible encoding of one operation: the op byte, and
+    // four 64-bit varints.
+    static const size_t MAX_OP_SIZE = 1 + 4 * 10;
+    static const size_t BUFFER_SIZE = 64 * 1024;
+
+    void put_op(TimerTraceOp::Type type) {
+        if (pos_ > BUFFER_SIZE - MAX_OP_SIZE) {
+            flush();
+        }
+        Tick now = wheel_->now();
+        uint64_t ticks = Tick(now - tick_);
+        tick_ = now;
+        if (ticks < 31) {
+            buffer_[pos_++] = type | (ticks << 3);
+        } else {
+            buffer_[pos_++] = type | (31 << 3);
+            put_varint(ticks);
+        }
+    }
+
+    void put_event(TimerEventInterface* event) {
+        uint64_t address = uintptr_t(event) / alignof(TimerEventInterface);
+        uint64_t diff = address - last_event_;
+        last_event_ = address;
+        // Zigzag encoding, so that small negative differences are
+        // small too.
+        put_varint((diff << 1) ^ -(diff >> 63));
+    }
+
+    void put_varint(uint64_t value) {
+        while (value >= 0x80) {
+            buffer_[pos_++] = uint8_t(value) | 0x80;
+            value >>= 7;
+        }
+        buffer_[pos_++] = uint8_t(value);
+    }
+
+    Wheel* wheel_;
+    int fd_;
+    // The tick of the previous operation.
+    Tick tick_;
+    // The tick the latest advance will end on.
+    Tick advance_end_;
+    // True if the latest advance hit max_execute.
+    bool pending_ = false;
+    bool ok_ = true;
+    uint64_t last_event_ = 0;
+    size_t pos_;
+    uint8_t buffer_[BUFFER_SIZE];
+};
+
+typedef TimerWheelRecorderT<> TimerWheelRecorder;
+
+// Decodes a trace written by a TimerWheelRecorder from memory, e.g. a
+// memory-mapped trace file.
+class TimerTraceReader {
+public:
+    TimerTraceReader(const void* data, size_t size)
+        : pos_(static_cast<const uint8_t*>(data)),
+          end_(pos_ + size) {
+        if (size < sizeof(TIMER_TRACE_MAGIC) ||
+            memcmp(pos_, TIMER_TRACE_MAGIC, sizeof(TIMER_TRACE_MAGIC))) {
+            error_ = true;
+            pos_ = end_;
+            return;
+        }
+        pos_ += sizeof(TIMER_TRACE_MAGIC);
+        tick_ = start_tick_ = get_varint();
+    }
+
+    // Decode the next operation. Returns false at the end of the trace,
+    // or if the trace is invalid.
+    bool next(TimerTraceOp* op) {
+        if (pos_ >= end_) {
+            return false;
+        }
+        uint8_t header = *pos_++;
+        uint64_t ticks = header >> 3;
+        if (ticks == 31) {
+            ticks = get_varint();
+        }
+        tick_ += ticks;
+        op->type = TimerTraceOp::Type(header & 7);
+        op->tick = tick_;
+        op->event = 0;
+        op->a = op->b = 0;
+        switch (op->type) {
+        case TimerTraceOp::SCHEDULE:
+            op->event = get_event();
+            op->a = get_varint();
+            break;
+        case TimerTraceOp::SCHEDULE_IN_RANGE:
+            op->event = get_event();
+            op->a = get_varint();
+            op->b = op->a + get_varint();
+            break;
+        case TimerTraceOp::CANCEL:
+            op->event = get_event();
+            break;
+        case TimerTraceOp::ADVANCE: {
+            op->a = get_varint();
+            uint64_t max_execute = get_varint();
+            op->b = max_execute ? max_execute - 1 :
+                std::numeric_limits<size_t>::max();
+            break;
+        }
+        default:
+            error_ = true;
+        }
+        if (error_) {
+            pos_ = end_;
+            return false;
+        }
+        return true;
+    }
+
+    // The tick the recording started on.
+    uint64_t start_tick() const { return start_tick_; }
+
+    // Return true if the trace was invalid or truncated.
+    bool error() const { return error_; }
+
+private:
+    uint64_t get_event() {
+        uint64_t zigzag = get_varint();
+        last_event_ += (zigzag >> 1) ^ -(zigzag & 1);
+        return last_event_;
+    }
+
+    uint64_t get_varint() {
+        uint64_t value = 0;
+        for (int shift = 0; shift < 64; shift += 7) {
+            if (pos_ >= end_) {
+                break;
+            }
+            uint8_t byte = *pos_++;
+            value |= uint64_t(byte & 0x7f) << shift;
+            if (!(byte & 0x80)) {
+                return value;
+            }
+        }
+        error_ = true;
+        return 0;
+    }
+
+    const uint8_t* pos_;
+    const uint8_t* end_;
+    uint64_t start_tick_ = 0;
+    uint64_t tick_ = 0;
+    uint64_t last_event_ = 0;
+    bool error_ = false;
+};
+
+#endif //  RATAS_TIMER_WHEEL_RECORDER_H
@@ -0,0 +1,376 @@
+// -*- mode: c++; c-basic-offset: 4 indent-tabs-mode: nil -*- */
+//
+// Copyright 2016 Juho Snellman, released under a MIT license (see
+// LICENSE).
+//
+// SPDX-License-Identifier: MIT
+//
+// A group of TimerWheels, one per thread, for when a single thread
+// can't keep up with all the timer processing.
+//
+// Each shard is a normal single-threaded TimerWheel, owned by the
+// thread that called bind_thread() for it. The owner schedules
+// events on its own shard directly. Other threads, including the
+// owners of other shards, go through the shard's mailbox. All the
+// shards follow a shared clock, which is moved forward with
+// set_now() and picked up by each shard on its next advance(). The
+// deltas passed to the scheduling functions are relative to the time
+// of the shard, which can lag behind the shared clock until the next
+// advance().
+//
+// Events scheduled on the same shard keep the normal TimerWheel
+// ordering guarantees. So events that need to be executed in order
+// relative to each other (e.g. all the timers for one connection)
+// should be scheduled with the same key through shard_for_key().
+//
+// Callbacks scheduled with schedule_stealable() don't need any
+// ordering guarantees. Once they're due, they're moved from the wheel
+// to a ready queue rather than executed directly, and an idle shard
+// can use steal() to execute them on behalf of a busy one.
+//
+//      ShardedTimerWheel timers(num_threads);
+//      // On each worker thread:
+//      timers.bind_thread(index);
+//      while (running) {
+//          timers.advance();
+//          if (timers.ready_count() == 0) {
+//              timers.steal(16);
+//          }
+//          ...
+//      }
+
+#ifndef RATAS_TIMER_WHEEL_SHARDED_H
+#define RATAS_TIMER_WHEEL_SHARDED_H
+
+#include <atomic>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include "timer-wheel.h"
+
+template<typename Wheel = TimerWheel>
+class ShardedTimerWheelT {
+public:
+    typedef typename Wheel::Tick Tick;
+
+    explicit ShardedTimerWheelT(size_t num_shards, Tick now = 0)
+        : id_(next_id()),
+          now_(now) {
+        assert(num_shards > 0);
+        for (size_t i = 0; i < num_shards; ++i) {
+            shards_.emplace_back(new Shard(now));
+        }
+    }
+
+    ~ShardedTimerWheelT() {
+        // Stealable callbacks that haven't been executed yet are
+        // freed without being executed.
+        for (auto& shard : shards_) {
+            while (shard->waiting) {
+                delete shard->waiting->unlink();
+            }
+            for (auto event : shard->ready) {
+                delete event;
+            }
+        }
+    }
+
+    size_t num_shards() const { return shards_.size(); }
+
+    // Make the calling thread the owner of the shard. Each shard must
+    // have exactly one owner, and a thread can own at most one shard
+    // per group.
+    void bind_thread(size_t shard) {
+        assert(shard < shards_.size());
+        for (Binding& binding : bindings()) {
+            if (binding.group == id_) {
+                binding.shard = shard;
+                return;
+            }
+        }
+        bindings().push_back(Binding { id_, shard });
+    }
+
+    // Return the index of the shard owned by the calling thread, or
+    // num_shards() if it doesn't own any.
+    size_t current_shard() const {
+        for (const Binding& binding : bindings()) {
+            if (binding.group == id_) {
+                return binding.shard;
+            }
+        }
+        return shards_.size();
+    }
+
+    // Return the shard that events for the key should be scheduled on.
+    size_t shard_for_key(uint64_t key) const {
+        return key % shards_.size();
+    }
+
+    // Schedule the event delta ticks from now on the calling thread's
+    // shard. The delta must be non-0.
+    void schedule(TimerEventInterface* event, Tick delta) {
+        size_t shard = current_shard();
+        assert(shard < shards_.size());
+        shards_[shard]->wheel.schedule(event, delta);
+    }
+
+    // Schedule the event delta ticks from now on the given shard. Can
+    // be called from any thread. If the shard is owned by some other
+    // thread, the request is passed on through the shard's mailbox,
+    // and (re)scheduling or canceling the event must also be done
+    // through this group until the request has been processed.
+    void schedule(size_t shard, TimerEventInterface* event, Tick delta) {
+        if (shard == current_shard()) {
+            shards_[shard]->wheel.schedule(event, delta);
+        } else {
+            shards_[shard]->mailbox.schedule(event, delta);
+        }
+    }
+
+    // Cancel an event scheduled on the given shard. Can be called from
+    // any thread.
+    void cancel(size_t shard, TimerEventInterface* event) {
+        if (shard == current_shard()) {
+            event->cancel();
+        } else {
+            shards_[shard]->mailbox.cancel(event);
+        }
+    }
+
+    // Schedule the callback delta ticks from now on the calling
+    // thread's shard. Once due, it might get executed by the owner of
+    // any shard. The callback can't be canceled.
+    template<typename CBType>
+    void schedule_stealable(CBType&& callback, Tick delta) {
+        size_t index = current_shard();
+        assert(index < shards_.size());
+        Shard* shard = shards_[index].get();
+        auto event = new StealableEvent(shard,
+                                        std::forward<CBType>(callback));
+        event->link();
+        shard->wheel.schedule(event, delta);
+    }
+
+    // Set the time of the shared clock. Can be called from any thread.
+    // The time must not move backwards.
+    void set_now(Tick now) {
+        now_.store(now, std::memory_order_release);
+    }
+
+    // Return the time of the shared clock.
+    Tick now() const {
+        return now_.load(std::memory_order_acquire);
+    }
+
+    // Advance the calling thread's shard to the time of the shared
+    // clock, and then execute the stealable callbacks that are due on
+    // it. At most max_execute callbacks are executed in total, with
+    // moving a due stealable callback to the ready queue counting as
+    // one. Like TimerWheel::advance(), returns false if max_execute
+    // was reached before all the work was done.
+    bool advance(size_t max_execute = std::numeric_limits<size_t>::max()) {
+        assert(max_execute > 0);
+        size_t index = current_shard();
+        assert(index < shards_.size());
+        Shard* shard = shards_[index].get();
+        Tick delta = Tick(now() - shard->wheel.now());
+        size_t remaining = max_execute;
+        if (delta || shard->pending) {
+            shard->pending = !shard->wheel.advance_with_limit(delta,
+                                                              &remaining);
+            if (shard->pending) {
+                return false;
+            }
+        }
+        run_ready(shard, remaining);
+        // Only this thread adds to the queue, so if it's now empty
+        // nothing was left undone.
+        return shard->ready_count.load() == 0;
+    }
+
+    // Return the number of ticks until the next event on the calling
+    // thread's shard, relative to the shared clock.
+    Tick ticks_to_next_event(Tick max = std::numeric_limits<Tick>::max()) {
+        size_t index = current_shard();
+        assert(index < shards_.size());
+        Shard* shard = shards_[index].get();
+        if (shard->pending || shard->ready_count.load()) {
+            return 0;
+        }
+        Tick lag = Tick(now() - shard->wheel.now());
+        Tick ticks = shard->wheel.ticks_to_next_event(max);
+        return ticks > lag ? ticks - lag : 0;
+    }
+
+    // Return the number of due stealable callbacks waiting to be
+    // executed on the calling thread's shard.
+    size_t ready_count() const {
+        size_t index = current_shard();
+        assert(index < shards_.size());
+        return shards_[index]->ready_count.load();
+    }
+
+    // Execute up to max_steal due stealable callbacks from the shard
+    // with the longest ready queue. Returns the number of callbacks
+    // executed.
+    size_t steal(size_t max_steal) {
+        size_t own = current_shard();
+        Shard* victim = NULL;
+        size_t most = 0;
+        for (size_t i = 0; i < shards_.size(); ++i) {
+            size_t count = shards_[i]->ready_count.load();
+            if (i != own && count > most) {
+                victim = shards_[i].get();
+                most = count;
+            }
+        }
+        if (!victim) {
+            return 0;
+        }
+        // Only take half the queue, so that the owner isn't left idle
+        // and stealing back.
+        return run_ready(victim, std::min(max_steal, (most + 1) / 2));
+    }
+
+    // Return the wheel of the given shard. It must only be used by the
+    // thread owning the shard.
+    Wheel& wheel(size_t shard) {
+        return shards_[shard]->wheel;
+    }
+
+private:
+    ShardedTimerWheelT(const ShardedTimerWheelT& other) = delete;
+    ShardedTimerWheelT& operator=(const ShardedTimerWheelT& other) = delete;
+
+    // The shard a thread owns in one group. Groups are identified by
+    // a unique id rather than their address, so that a group created
+    // where an earlier one was destroyed doesn't inherit its owners.
+    struct Binding {
+        uint64_t group;
+        size_t shard;
+    };
+
+    // The bindings of the calling thread, one per group it owns a
+    // shard of. Threads rarely own shards of more than one or two
+    // groups, so a linear search is fine.
+    static std::vector<Binding>& bindings() {
+        static thread_local std::vector<Binding> bindings;
+        return bindings;
+    }
+
+    static uint64_t next_id() {
+        static std::atomic<uint64_t> id { 0 };
+        return id.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    struct Shard;
+
+    // The event used for stealable callbacks. It's allocated when the
+    // callback is scheduled, and freed once it's been executed.
+    class StealableEvent : public TimerEventInterface {
+    public:
+        template<typename CBType>
+        StealableEvent(Shard* shard, CBType&& callback)
+            : TimerEventInterface(&StealableEvent::make_ready),
+              shard_(shard),
+              callback_(std::forward<CBType>(callback)) {
+        }
+
+        void run() { callback_(); }
+
+        // Add the event to the shard's list of events that aren't
+        // due yet.
+        void link() {
+            next_ = shard_->waiting;
+            if (next_) {
+                next_->prev_ = this;
+            }
+            shard_->waiting = this;
+        }
+
+        // Remove the event from the list of events that aren't due
+        // yet, and return it.
+        StealableEvent* unlink() {
+            if (prev_) {
+                prev_->next_ = next_;
+            } else {
+                shard_->waiting = next_;
+            }
+            if (next_) {
+                next_->prev_ = prev_;
+            }
+            prev_ = next_ = NULL;
+            return this;
+        }
+
+    private:
+        // Rather than executing the callback, move it to the ready
+        // queue where any thread can get at it.
+        static void make_ready(TimerEventInterface* event) {
+            auto self = static_cast<StealableEvent*>(event)->unlink();
+            Shard* shard = self->shard_;
+            std::lock_guard<std::mutex> lock(shard->ready_lock);
+            shard->ready.push_back(self);
+            shard->ready_count.store(shard->ready.size());
+        }
+
+        Shard* shard_;
+        InlineCallback<> callback_;
+        StealableEvent* prev_ = NULL;
+        StealableEvent* next_ = NULL;
+    };
+
+    struct Shard {
+        explicit Shard(Tick now) : wheel(now) {
+            wheel.set_mailbox(&mailbox);
+        }
+
+        Wheel wheel;
+        TimerWheelMailboxT<Tick> mailbox;
+        // True if the last wheel.advance() returned false.
+        bool pending = false;
+        // Stealable callbacks that aren't due yet. Only touched by
+        // the owner thread.
+        StealableEvent* waiting = NULL;
+        // Stealable callbacks that are due. Locked since other shards
+        // can take callbacks from here, but the lock is only taken
+        // once the callbacks are due, not for scheduling them.
+        std::mutex ready_lock;
+        std::deque<StealableEvent*> ready;
+        // The size of the ready queue, readable without the lock.
+        std::atomic<size_t> ready_count { 0 };
+    };
+
+    // Execute up to max_execute callbacks from the shard's ready queue.
+    // Returns the number of callbacks executed.
+    size_t run_ready(Shard* shard, size_t max_execute) {
+        size_t executed = 0;
+        while (executed < max_execute) {
+            StealableEvent* event;
+            {
+                std::lock_guard<std::mutex> lock(shard->ready_lock);
+                if (shard->ready.empty()) {
+                    break;
+                }
+                event = shard->ready.front();
+                shard->ready.pop_front();
+                shard->ready_count.store(shard->ready.size());
+            }
+            event->run();
+            delete event;
+            ++executed;
+        }
+        return executed;
+    }
+
+    const uint64_t id_;
+    std::atomic<Tick> now_;
+    std::vector<std::unique_ptr<Shard>> shards_;
+};
+
+typedef ShardedTimerWheelT<> ShardedTimerWheel;
+
+#endif //  RATAS_TIMER_WHEEL_SHARDED_H
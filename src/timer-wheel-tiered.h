@@ -0,0 +1,442 @@
+// -*- mode: c++; c-basic-offset: 4 indent-tabs-mode: nil -*- */
+//
+// Copyright 2016 Juho Snellman, released under a MIT license (see
+// LICENSE).
+//
+// SPDX-License-Identifier: MIT
+//
+// Tiered storage for timers that are far in the future, e.g. lease
+// expiries or retention deadlines that are hours or days away.
+//
+// On a normal wheel every scheduled timer is a TimerEventInterface
+// embedded in some object that has to stay in memory until the timer
+// expires. A TieredTimerWheel instead keeps the timers beyond a
+// horizon in a side store as just (deadline, id) pairs, bucketed by
+// deadline. As time moves on, whole buckets are loaded into the real
+// wheel through a loader function passed to advance(), which creates
+// the real event for the id and schedules it. So the memory use of the
+// wheel and the events follows the number of near-term timers, not
+// the total number of timers.
+//
+//      TimerSpillMemoryStore store;
+//      TieredTimerWheel tiered(&timers, &store, 60000);
+//      if (!tiered.schedule(lease_id, delta)) {
+//          // Too close, schedule a real event.
+//          timers.schedule(make_lease_event(lease_id), delta);
+//      }
+//      ...
+//      tiered.advance(ticks, [&] (uint64_t id, Tick delta) {
+//          timers.schedule(make_lease_event(id), delta);
+//      });
+//
+// Two stores are provided. TimerSpillMemoryStore keeps the pairs in
+// vectors on the heap, 16 bytes per timer. TimerSpillFileStore keeps
+// them in a memory-mapped file, so that the far-future timers are in
+// the page cache rather than in anonymous memory, and can be written
+// back and evicted by the kernel under memory pressure.
+
+#ifndef RATAS_TIMER_WHEEL_TIERED_H
+#define RATAS_TIMER_WHEEL_TIERED_H
+
+#include <map>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <vector>
+
+#include "timer-wheel.h"
+
+// A timer in a spill store.
+struct TimerSpillEntry {
+    uint64_t at;
+    uint64_t id;
+};
+
+// A spill store that keeps each bucket in a vector.
+class TimerSpillMemoryStore {
+public:
+    // Add the entry to the bucket. Returns false if the entry couldn't
+    // be stored, which this store never does.
+    bool add(uint64_t bucket, const TimerSpillEntry& entry) {
+        buckets_[bucket].push_back(entry);
+        ++size_;
+        return true;
+    }
+
+    // Remove the entry with the same deadline and id from the
+    // bucket. Returns false if there was no such entry.
+    bool remove(uint64_t bucket, const TimerSpillEntry& entry) {
+        auto it = buckets_.find(bucket);
+        if (it == buckets_.end()) {
+            return false;
+        }
+        std::vector<TimerSpillEntry>& entries = it->second;
+        for (auto& e : entries) {
+            if (e.at == entry.at && e.id == entry.id) {
+                e = entries.back();
+                entries.pop_back();
+                if (entries.empty()) {
+                    buckets_.erase(it);
+                }
+                --size_;
+                return true;
+            }
+        }
+        return false;
+    }
+
+    // Set *bucket to the smallest non-empty bucket. Returns false if
+    // the store is empty.
+    bool first_bucket(uint64_t* bucket) const {
+        if (buckets_.empty()) {
+            return false;
+        }
+        *bucket = buckets_.begin()->first;
+        return true;
+    }
+
+    // Remove all the entries of the bucket, calling fun on each one
+    // in no particular order.
+    template<typename F>
+    void take(uint64_t bucket, F fun) {
+        auto it = buckets_.find(bucket);
+        if (it == buckets_.end()) {
+            return;
+        }
+        std::vector<TimerSpillEntry> entries;
+        entries.swap(it->second);
+        buckets_.erase(it);
+        size_ -= entries.size();
+        for (const auto& entry : entries) {
+            fun(entry);
+        }
+    }
+
+    // Return the number of entries in the store.
+    size_t size() const { return size_; }
+
+private:
+    std::map<uint64_t, std::vector<TimerSpillEntry>> buckets_;
+    size_t size_ = 0;
+};
+
+// A spill store that keeps the entries in a file mapped into memory.
+// The file is split into chunks of one page, and each bucket is a list
+// of chunks. Only the list heads and the free list are kept on the
+// heap. Chunks freed by take() are reused, and dropped from the
+// process's memory with madvise().
+//
+// The file descriptor must be open for reading and writing, and
+// isn't closed by the store. The contents of the file are overwritten,
+// and aren't meant to be read back by a later process; a file that's
+// been unlinked after opening works fine.
+class TimerSpillFileStore {
+public:
+    explicit TimerSpillFileStore(int fd)
+        : fd_(fd),
+          chunk_size_(page_size()),
+          chunk_entries_((chunk_size_ - sizeof(Chunk)) /
+                         sizeof(TimerSpillEntry)) {
+    }
+
+    ~TimerSpillFileStore() {
+        if (chunks_) {
+            munmap(chunks_, capacity_ * chunk_size_);
+        }
+    }
+
+    // Add the entry to the bucket. Returns false if growing the file
+    // failed.
+    bool add(uint64_t bucket, const TimerSpillEntry& entry) {
+        Bucket& b = buckets_[bucket];
+        if (b.head == NONE || chunk(b.head).count == chunk_entries_) {
+            uint32_t index = allocate_chunk();
+            if (index == NONE) {
+                if (b.head == NONE) {
+                    buckets_.erase(bucket);
+                }
+                return false;
+            }
+            chunk(index).next = b.head;
+            chunk(index).count = 0;
+            b.head = index;
+        }
+        Chunk& head = chunk(b.head);
+        entries(head)[head.count++] = entry;
+        ++size_;
+        return true;
+    }
+
+    // Remove the entry with the same deadline and id from the
+    // bucket. Returns false if there was no such entry. The hole is
+    // filled with the last entry of the head chunk, so only the
+    // head chunk is ever partially full.
+    bool remove(uint64_t bucket, const TimerSpillEntry& entry) {
+        auto it = buckets_.find(bucket);
+        if (it == buckets_.end()) {
+            return false;
+        }
+        Bucket& b = it->second;
+        for (uint32_t index = b.head; index != NONE;
+             index = chunk(index).next) {
+            Chunk& c = chunk(index);
+            for (uint32_t i = 0; i < c.count; ++i) {
+                TimerSpillEntry& e = entries(c)[i];
+                if (e.at != entry.at || e.id != entry.id) {
+                    continue;
+                }
+                Chunk& head = chunk(b.head);
+                e = entries(head)[--head.count];
+                if (head.count == 0) {
+                    uint32_t next = head.next;
+                    free_chunk(b.head);
+                    b.head = next;
+                    if (next == NONE) {
+                        buckets_.erase(it);
+                    }
+                }
+                --size_;
+                return true;
+            }
+        }
+        return false;
+    }
+
+    // Set *bucket to the smallest non-empty bucket. Returns false if
+    // the store is empty.
+    bool first_bucket(uint64_t* bucket) const {
+        if (buckets_.empty()) {
+            return false;
+        }
+        *bucket = buckets_.begin()->first;
+        return true;
+    }
+
+    // Remove all the entries of the bucket, calling fun on each one
+    // in no particular order. fun must not modify the store.
+    template<typename F>
+    void take(uint64_t bucket, F fun) {
+        auto it = buckets_.find(bucket);
+        if (it == buckets_.end()) {
+            return;
+        }
+        uint32_t index = it->second.head;
+        buckets_.erase(it);
+        while (index != NONE) {
+            Chunk& c = chunk(index);
+            for (uint32_t i = 0; i < c.count; ++i) {
+                fun(entries(c)[i]);
+            }
+            size_ -= c.count;
+            uint32_t next = c.next;
+            free_chunk(index);
+            index = next;
+        }
+    }
+
+    // Return the number of entries in the store.
+    size_t size() const { return size_; }
+
+    // Return the size of the file in bytes.
+    size_t file_size() const { return capacity_ * chunk_size_; }
+
+    // Return true if growing the file has failed at some point.
+    bool error() const { return error_; }
+
+private:
+    TimerSpillFileStore(const TimerSpillFileStore& other) = delete;
+    TimerSpillFileStore& operator=(const TimerSpillFileStore& other) = delete;
+
+    static const uint32_t NONE = ~uint32_t(0);
+    // The header of a chunk, followed by the entries.
+    struct Chunk {
+        uint32_t next;
+        uint32_t count;
+        uint64_t unused;
+    };
+
+    // Chunks are a page each, so that a freed chunk can be dropped
+    // with madvise(), which only works on whole pages. Pages are
+    // 16kB or 64kB on some systems.
+    static size_t page_size() {
+        long size = sysconf(_SC_PAGESIZE);
+        return size > 0 ? size_t(size) : 4096;
+    }
+
+    Chunk& chunk(uint32_t index) {
+        return *reinterpret_cast<Chunk*>(chunks_ + index * chunk_size_);
+    }
+
+    static TimerSpillEntry* entries(Chunk& chunk) {
+        return reinterpret_cast<TimerSpillEntry*>(&chunk + 1);
+    }
+
+    struct Bucket {
+        uint32_t head = NONE;
+    };
+
+    uint32_t allocate_chunk() {
+        if (!free_.empty()) {
+            uint32_t index = free_.back();
+            free_.pop_back();
+            return index;
+        }
+        if (used_ == capacity_ && !grow()) {
+            return NONE;
+        }
+        return used_++;
+    }
+
+    void free_chunk(uint32_t index) {
+        // The page gets faulted back in from the file when it's
+        // reused, so there's no point in keeping it resident. The
+        // free list is on the heap, so the page isn't touched again
+        // until then.
+        madvise(&chunk(index), chunk_size_, MADV_DONTNEED);
+        free_.push_back(index);
+    }
+
+    // Double the size of the file, and remap it.
+    bool grow() {
+        size_t capacity = capacity_ ? capacity_ * 2 : 16;
+        if (capacity >= NONE ||
+            ftruncate(fd_, capacity * chunk_size_) < 0) {
+            error_ = true;
+            return false;
+        }
+        void* mem = mmap(NULL, capacity * chunk_size_,
+                         PROT_READ | PROT_WRITE, MAP_SHARED, fd_, 0);
+        if (mem == MAP_FAILED) {
+            error_ = true;
+            return false;
+        }
+        if (chunks_) {
+            munmap(chunks_, capacity_ * chunk_size_);
+        }
+        chunks_ = static_cast<char*>(mem);
+        capacity_ = capacity;
+        return true;
+    }
+
+    int fd_;
+    size_t chunk_size_;
+    uint32_t chunk_entries_;
+    char* chunks_ = NULL;
+    // The number of chunks in the file, and the number that have
+    // ever been allocated.
+    size_t capacity_ = 0;
+    size_t used_ = 0;
+    std::vector<uint32_t> free_;
+    std::map<uint64_t, Bucket> buckets_;
+    size_t size_ = 0;
+    bool error_ = false;
+};
+
+// A front for a wheel that keeps the timers beyond a horizon in a
+// spill store, and loads them into the wheel in batches as their
+// deadline approaches. The store can be any class with the same
+// methods as TimerSpillMemoryStore.
+//
+// The timers in the store are grouped into buckets of
+// 2^batch_bits ticks. A bucket is loaded once the start of the
+// bucket is within horizon ticks of the current time, so each
+// timer is loaded between horizon and horizon + 2^batch_bits ticks
+// before its deadline.
+template<typename Store = TimerSpillMemoryStore, typename Wheel = TimerWheel>
+class TieredTimerWheelT {
+public:
+    typedef typename Wheel::Tick Tick;
+
+    TieredTimerWheelT(Wheel* wheel, Store* store, Tick horizon,
+                      int batch_bits = 12)
+        : wheel_(wheel),
+          store_(store),
+          horizon_(horizon),
+          batch_bits_(batch_bits),
+          loaded_bucket_(bucket(wheel->now() + horizon) + 1) {
+    }
+
+    // Store a timer with the given id that expires delta ticks from
+    // now. Returns false if the deadline is too close, or the store
+    // couldn't take the timer. In that case nothing was stored, and
+    // the caller should schedule a real event on the wheel instead.
+    bool schedule(uint64_t id, Tick delta) {
+        Tick at = wheel_->now() + delta;
+        uint64_t b = bucket(at);
+        if (b < loaded_bucket_) {
+            return false;
+        }
+        return store_->add(b, TimerSpillEntry { at, id });
+    }
+
+    // Remove the stored timer with the given id and absolute deadline.
+    // Returns false if it isn't in the store, e.g. because it's
+    // already been loaded into the wheel.
+    bool cancel(uint64_t id, Tick at) {
+        uint64_t b = bucket(at);
+        if (b < loaded_bucket_) {
+            return false;
+        }
+        return store_->remove(b, TimerSpillEntry { at, id });
+    }
+
+    // Load all the timers whose bucket comes within the horizon during
+    // the next delta ticks, and then advance the wheel. For each
+    // loaded timer load(id, delta) is called, which should schedule
+    // an event delta ticks from now on the wheel. The delta is always
+    // more than 0. load must not call schedule() or cancel().
+    //
+    // The return value and max_execute are as for Wheel::advance().
+    template<typename Loader>
+    bool advance(Tick delta, Loader&& load,
+                 size_t max_execute = std::numeric_limits<size_t>::max()) {
+        Tick now = wheel_->now();
+        uint64_t limit = bucket(now + delta + horizon_) + 1;
+        uint64_t b;
+        while (store_->first_bucket(&b) && b < limit) {
+            store_->take(b, [&] (const TimerSpillEntry& entry) {
+                    load(entry.id, Tick(entry.at - now));
+                });
+        }
+        loaded_bucket_ = std::max(loaded_bucket_, limit);
+        return wheel_->advance(delta, max_execute);
+    }
+
+    // Return the number of ticks until either the next event on the
+    // wheel, or the next bucket needs to be loaded, but at most max.
+    // The latter can come before any of the stored timers expire, in
+    // which case the advance() just loads the bucket.
+    Tick ticks_to_next_event(Tick max = std::numeric_limits<Tick>::max()) {
+        Tick ticks = wheel_->ticks_to_next_event(max);
+        uint64_t b;
+        if (store_->first_bucket(&b)) {
+            Tick now = wheel_->now();
+            Tick load_at = (b << batch_bits_) - horizon_;
+            ticks = std::min(ticks, load_at > now ? load_at - now : 0);
+        }
+        return ticks;
+    }
+
+    // Return the number of timers in the store.
+    size_t stored() const { return store_->size(); }
+
+    Wheel* wheel() { return wheel_; }
+
+private:
+    static_assert(sizeof(Tick) == sizeof(uint64_t),
+                  "The buckets are numbered by absolute 64 bit ticks");
+
+    uint64_t bucket(Tick at) const {
+        return at >> batch_bits_;
+    }
+
+    Wheel* wheel_;
+    Store* store_;
+    Tick horizon_;
+    int batch_bits_;
+    // All the buckets before this have been loaded.
+    uint64_t loaded_bucket_;
+};
+
+typedef TieredTimerWheelT<> TieredTimerWheel;
+
+#endif //  RATAS_TIMER_WHEEL_TIERED_H
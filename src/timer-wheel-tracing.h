@@ -0,0 +1,293 @@
+// -*- mode: c++; c-basic-offset: 4 indent-tabs-mode: nil -*- */
+//
+// Copyright 2016 Juho Snellman, released under a MIT license (see
+// LICENSE).
+//
+// SPDX-License-Identifier: MIT
+//
+// Tracing policies for TimerWheelT, for finding out where the time
+// inside advance() goes. Pass one as the Tracer template parameter:
+//
+//      typedef TimerWheelT<8, 8, uint64_t, false, false,
+//                          TimerWheelLatencyTracer> TracedTimerWheel;
+//      TracedTimerWheel timers;
+//      ...
+//      printf("p99.9 advance: %lu ns\n",
+//             timers.tracer().advance_ns().percentile(99.9));
+//
+// - TimerWheelLatencyTracer records the latencies of advance() and of
+//   the event callbacks, and the sizes of the promotions on each
+//   level, into histograms.
+// - TimerWheelUsdtTracer fires USDT probes (provider "ratas") that can
+//   be attached to with e.g. bpftrace, perf or SystemTap. If
+//   <sys/sdt.h> isn't available, the probes compile to nothing.
+// - TimerWheelFtraceTracer writes a line to the ftrace marker file
+//   for each hook, so that the timer activity shows up next to the
+//   kernel's events in the trace. This costs a system call per hook.
+
+#ifndef RATAS_TIMER_WHEEL_TRACING_H
+#define RATAS_TIMER_WHEEL_TRACING_H
+
+#include <chrono>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#if defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define RATAS_HAVE_SDT 1
+#endif
+#endif
+
+#include "timer-wheel.h"
+
+// A histogram of 64 bit values in the style of HdrHistogram. Values
+// are counted in buckets whose width grows with the magnitude of the
+// value, so that the value of any percentile is known to within
+// 1/2^(SUB_BUCKET_BITS-1) (about 3%), with a fixed amount of memory
+// and a constant time record().
+class LatencyHistogram {
+public:
+    static const int SUB_BUCKET_BITS = 6;
+
+    LatencyHistogram() : counts_(NUM_BUCKETS) {
+    }
+
+    void record(uint64_t value) {
+        ++counts_[bucket(value)];
+        ++count_;
+        sum_ += value;
+        min_ = std::min(min_, value);
+        max_ = std::max(max_, value);
+    }
+
+    // Return the number of values recorded.
+    uint64_t count() const { return count_; }
+    // Return the smallest and largest value recorded, or 0 if nothing
+    // has been recorded.
+    uint64_t min() const { return count_ ? min_ : 0; }
+    uint64_t max() const { return max_; }
+    double mean() const { return count_ ? double(sum_) / count_ : 0; }
+
+    // Return the value that percentile percent of the recorded values
+    // are less than or equal to, rounded up to the end of the bucket.
+    // Returns 0 if nothing has been recorded.
+    uint64_t percentile(double percent) const {
+        if (!count_) {
+            return 0;
+        }
+        uint64_t rank = uint64_t(percent / 100 * count_ + 0.5);
+        rank = std::max<uint64_t>(1, std::min(rank, count_));
+        uint64_t seen = 0;
+        for (int i = 0; i < NUM_BUCKETS; ++i) {
+            seen += counts_[i];
+            if (seen >= rank) {
+                return std::min(bucket_end(i), max_);
+            }
+        }
+        return max_;
+    }
+
+    void reset() {
+        std::fill(counts_.begin(), counts_.end(), 0);
+        count_ = sum_ = max_ = 0;
+        min_ = std::numeric_limits<uint64_t>::max();
+    }
+
+private:
+    static const uint64_t SUB_BUCKETS = uint64_t(1) << SUB_BUCKET_BITS;
+    static const uint64_t HALF = SUB_BUCKETS / 2;
+    // The values below SUB_BUCKETS get a bucket each. After that each
+    // power of two is split into HALF buckets.
+    static const int NUM_BUCKETS = (64 - SUB_BUCKET_BITS + 2) * HALF;
+
+    // The number of low bits of the value that don't affect which
+    // bucket it goes in.
+    static int shift(uint64_t value) {
+        if (value < SUB_BUCKETS) {
+            return 0;
+        }
+        return timer_wheel_log2(value) + 1 - SUB_BUCKET_BITS;
+    }
+
+    static int bucket(uint64_t value) {
+        int s = shift(value);
+        return s * HALF + (value >> s);
+    }
+
+    // The largest value that goes in the bucket.
+    static uint64_t bucket_end(int index) {
+        if (uint64_t(index) < SUB_BUCKETS) {
+            return index;
+        }
+        int s = index / HALF - 1;
+        uint64_t m = index - s * HALF;
+        return ((m + 1) << s) - 1;
+    }
+
+    std::vector<uint64_t> counts_;
+    uint64_t count_ = 0;
+    uint64_t sum_ = 0;
+    uint64_t min_ = std::numeric_limits<uint64_t>::max();
+    uint64_t max_ = 0;
+};
+
+// Records the wall time of each advance() call and each event
+// callback in nanoseconds, and the number of events in each promoted
+// slot per level. Any clock type with a std::chrono interface can be
+// used.
+template<typename Clock = std::chrono::steady_clock>
+class TimerWheelLatencyTracerT {
+public:
+    void on_advance_start(uint64_t now, uint64_t delta) {
+        advance_start_ = Clock::now();
+    }
+    void on_advance_end(uint64_t now, bool done) {
+        advance_ns_.record(elapsed_ns(advance_start_));
+    }
+    void on_promote(int level, size_t count) {
+        if (level >= int(promotions_.size())) {
+            promotions_.resize(level + 1);
+        }
+        promotions_[level].record(count);
+    }
+    void on_execute_start(const TimerEventInterface* event) {
+        execute_start_ = Clock::now();
+    }
+    void on_execute_end(const TimerEventInterface* event) {
+        execute_ns_.record(elapsed_ns(execute_start_));
+    }
+
+    // The latencies of the advance() calls, including the callbacks.
+    const LatencyHistogram& advance_ns() const { return advance_ns_; }
+    // The latencies of the event callbacks.
+    const LatencyHistogram& execute_ns() const { return execute_ns_; }
+    // The number of events in each promoted slot on the level.
+    const LatencyHistogram& promotions(int level) const {
+        static const LatencyHistogram empty;
+        return level < int(promotions_.size()) ? promotions_[level] : empty;
+    }
+
+    void reset() {
+        advance_ns_.reset();
+        execute_ns_.reset();
+        promotions_.clear();
+    }
+
+private:
+    static uint64_t elapsed_ns(typename Clock::time_point start) {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(
+            Clock::now() - start).count();
+    }
+
+    typename Clock::time_point advance_start_;
+    typename Clock::time_point execute_start_;
+    LatencyHistogram advance_ns_;
+    LatencyHistogram execute_ns_;
+    std::vector<LatencyHistogram> promotions_;
+};
+
+typedef TimerWheelLatencyTracerT<> TimerWheelLatencyTracer;
+
+#ifdef RATAS_HAVE_SDT
+#define RATAS_PROBE1(name, a) DTRACE_PROBE1(ratas, name, a)
+#define RATAS_PROBE2(name, a, b) DTRACE_PROBE2(ratas, name, a, b)
+#else
+#define RATAS_PROBE1(name, a) do { } while (0)
+#define RATAS_PROBE2(name, a, b) do { } while (0)
+#endif
+
+// Fires the USDT probes ratas:advance_start(now, delta),
+// ratas:advance_end(now, done), ratas:promote(level, count),
+// ratas:execute_start(event) and ratas:execute_end(event). A probe
+// that nothing is attached to is a single nop.
+class TimerWheelUsdtTracer {
+public:
+    void on_advance_start(uint64_t now, uint64_t delta) {
+        RATAS_PROBE2(advance_start, now, delta);
+    }
+    void on_advance_end(uint64_t now, bool done) {
+        RATAS_PROBE2(advance_end, now, int(done));
+    }
+    void on_promote(int level, size_t count) {
+        RATAS_PROBE2(promote, level, count);
+    }
+    void on_execute_start(const TimerEventInterface* event) {
+        RATAS_PROBE1(execute_start, event);
+    }
+    void on_execute_end(const TimerEventInterface* event) {
+        RATAS_PROBE1(execute_end, event);
+    }
+};
+
+// Writes markers like "ratas: advance_start now=10 delta=5" into the
+// ftrace trace_marker file. If the file can't be opened (e.g. tracefs
+// isn't mounted, or there's no permission), nothing is written.
+class TimerWheelFtraceTracer {
+public:
+    TimerWheelFtraceTracer() {
+        fd_ = open("/sys/kernel/tracing/trace_marker", O_WRONLY | O_CLOEXEC);
+        if (fd_ < 0) {
+            fd_ = open("/sys/kernel/debug/tracing/trace_marker",
+                       O_WRONLY | O_CLOEXEC);
+        }
+    }
+    ~TimerWheelFtraceTracer() {
+        if (fd_ >= 0) {
+            close(fd_);
+        }
+    }
+
+    void on_advance_start(uint64_t now, uint64_t delta) {
+        mark("advance_start now=%llu delta=%llu",
+             (unsigned long long) now, (unsigned long long) delta);
+    }
+    void on_advance_end(uint64_t now, bool done) {
+        mark("advance_end now=%llu done=%d", (unsigned long long) now,
+             int(done));
+    }
+    void on_promote(int level, size_t count) {
+        mark("promote level=%d count=%zu", level, count);
+    }
+    void on_execute_start(const TimerEventInterface* event) {
+        mark("execute_start event=%p", event);
+    }
+    void on_execute_end(const TimerEventInterface* event) {
+        mark("execute_end event=%p", event);
+    }
+
+    // Return true if the marker file could be opened.
+    bool enabled() const { return fd_ >= 0; }
+
+private:
+    TimerWheelFtraceTracer(const TimerWheelFtraceTracer& other) = delete;
+    TimerWheelFtraceTracer& operator=(const TimerWheelFtraceTracer& other) = delete;
+
+    template<typename... Args>
+    void mark(const char* format, Args... args) {
+        if (fd_ < 0) {
+            return;
+        }
+        static const char prefix[] = "ratas: ";
+        char buf[128];
+        int len = sizeof(prefix) - 1;
+        memcpy(buf, prefix, len);
+        len += snprintf(buf + len, sizeof(buf) - len, format, args...);
+        // Truncated.
+        if (len >= int(sizeof(buf))) {
+            len = sizeof(buf) - 1;
+        }
+        if (write(fd_, buf, len) < 0) {
+            // Tracing was turned off or the file went away, stop
+            // trying.
+            close(fd_);
+            fd_ = -1;
+        }
+    }
+
+    int fd_;
+};
+
+#endif //  RATAS_TIMER_WHEEL_TRACING_H
@@ -87,29 +87,41 @@
 #ifndef RATAS_TIMER_WHEEL_H
 #define RATAS_TIMER_WHEEL_H
 
+#include <atomic>
 #include <cassert>
+#include <chrono>
+#include <cstddef>
 #include <cstdlib>
 #include <cstdint>
 #include <cstdio>
 #include <limits>
 #include <memory>
+#include <new>
+#include <type_traits>
+#include <utility>
+#include <vector>
 
 typedef uint64_t Tick;
 
 class TimerWheelSlot;
-class TimerWheel;
+template<int WidthBits, int NumLevels, typename TickType, bool CollectStats,
+         bool PublishDeadline, typename Tracer>
+class TimerWheelT;
 
 // An abstract class representing an event that can be scheduled to
 // happen at some later time.
+//
+// The event callbacks are not dispatched through virtual functions.
+// Instead each subclass passes to the constructor a plain function
+// that executes the event. The class has no virtual destructor either,
+// so events must not be deleted through a TimerEventInterface pointer.
 class TimerEventInterface {
 public:
-    TimerEventInterface() {
-    }
-
-    // TimerEvents are automatically canceled on destruction.
-    virtual ~TimerEventInterface() {
-        cancel();
-    }
+    // A function that executes the callback of the event it's passed.
+    typedef void (*ExecuteFn)(TimerEventInterface* event);
+    // A function that executes the callbacks of count events at once.
+    typedef void (*ExecuteBatchFn)(TimerEventInterface** events,
+                                   size_t count);
 
     // Unschedule this event. It's safe to cancel an event that is inactive.
     inline void cancel();
@@ -122,20 +134,35 @@ public:
     // Return the absolute tick this event is scheduled to be executed on.
     Tick scheduled_at() const { return scheduled_at_; }
 
+protected:
+    explicit TimerEventInterface(ExecuteFn execute)
+        : execute_(execute) {
+    }
+
+    // TimerEvents are automatically canceled on destruction.
+    ~TimerEventInterface() {
+        cancel();
+    }
+
 private:
     TimerEventInterface(const TimerEventInterface& other) = delete;
     TimerEventInterface& operator=(const TimerEventInterface& other) = delete;
     friend TimerWheelSlot;
-    friend TimerWheel;
+    template<int WidthBits, int NumLevels, typename TickType,
+             bool CollectStats, bool PublishDeadline, typename Tracer>
+    friend class TimerWheelT;
 
-    // Implement in subclasses. Executes the event callback.
-    virtual void execute() = 0;
+    // Executes the event callback.
+    void execute() {
+        execute_(this);
+    }
 
     void set_scheduled_at(Tick ts) { scheduled_at_ = ts; }
     // Move the event to another slot. (It's safe for either the current
     // or new slot to be NULL).
     inline void relink(TimerWheelSlot* slot);
 
+    ExecuteFn execute_;
     Tick scheduled_at_;
     // The slot this event is currently in (NULL if not currently scheduled).
     TimerWheelSlot* slot_ = NULL;
@@ -146,22 +173,123 @@ private:
     TimerEventInterface* prev_ = NULL;
 };
 
+// A move-only callable taking no arguments, for use as the callback
+// type of a TimerEvent. Unlike std::function, the callable object is
+// always stored inline in a buffer of Size bytes, so constructing an
+// InlineCallback never allocates memory. Constructing one from a
+// callable that is too large to fit is a compile error.
+//
+//      TimerEvent<InlineCallback<>> timer([this, conn] () { ... });
+template<size_t Size = 32>
+class InlineCallback {
+public:
+    InlineCallback() {
+    }
+
+    template<typename F,
+             typename = typename std::enable_if<
+                 !std::is_same<typename std::decay<F>::type,
+                               InlineCallback<Size>>::value>::type>
+    InlineCallback(F&& callable) {
+        typedef typename std::decay<F>::type Callable;
+        static_assert(sizeof(Callable) <= Size,
+                      "Callable too large for InlineCallback");
+        static_assert(alignof(Callable) <= alignof(Storage),
+                      "Callable alignment too large for InlineCallback");
+        new (&storage_) Callable(std::forward<F>(callable));
+        invoke_ = &InlineCallback<Size>::invoke<Callable>;
+        manage_ = &InlineCallback<Size>::manage<Callable>;
+    }
+
+    InlineCallback(InlineCallback<Size>&& other) {
+        move_from(&other);
+    }
+
+    InlineCallback<Size>& operator=(InlineCallback<Size>&& other) {
+        if (this != &other) {
+            reset();
+            move_from(&other);
+        }
+        return *this;
+    }
+
+    ~InlineCallback() {
+        reset();
+    }
+
+    // Call the callable. Must not be called on an empty InlineCallback.
+    void operator()() {
+        assert(invoke_);
+        invoke_(&storage_);
+    }
+
+    // Return true iff a callable has been stored.
+    explicit operator bool() const {
+        return invoke_ != NULL;
+    }
+
+    // Destroy the stored callable, leaving this object empty.
+    void reset() {
+        if (manage_) {
+            manage_(&storage_, NULL);
+        }
+        invoke_ = NULL;
+        manage_ = NULL;
+    }
+
+private:
+    InlineCallback(const InlineCallback<Size>& other) = delete;
+    InlineCallback<Size>& operator=(const InlineCallback<Size>& other) = delete;
+
+    typedef typename std::aligned_storage<Size, alignof(void*)>::type Storage;
+
+    template<typename Callable>
+    static void invoke(void* storage) {
+        (*static_cast<Callable*>(storage))();
+    }
+    // Move-construct the callable in "from" into "to", and destroy
+    // the original. If "to" is NULL, just destroy it.
+    template<typename Callable>
+    static void manage(void* from, void* to) {
+        Callable* callable = static_cast<Callable*>(from);
+        if (to) {
+            new (to) Callable(std::move(*callable));
+        }
+        callable->~Callable();
+    }
+
+    void move_from(InlineCallback<Size>* other) {
+        if (other->manage_) {
+            other->manage_(&other->storage_, &storage_);
+        }
+        invoke_ = other->invoke_;
+        manage_ = other->manage_;
+        other->invoke_ = NULL;
+        other->manage_ = NULL;
+    }
+
+    void (*invoke_)(void* storage) = NULL;
+    void (*manage_)(void* from, void* to) = NULL;
+    Storage storage_;
+};
+
 // An event that takes the callback (of type CBType) to execute as
 // a constructor parameter.
 template<typename CBType>
 class TimerEvent : public TimerEventInterface {
 public:
-    explicit TimerEvent<CBType>(const CBType& callback)
-      : callback_(callback) {
+    explicit TimerEvent(CBType callback)
+      : TimerEventInterface(&TimerEvent<CBType>::execute_callback),
+        callback_(std::move(callback)) {
     }
 
-    void execute() {
-        callback_();
+private:
+    static void execute_callback(TimerEventInterface* event) {
+        static_cast<TimerEvent<CBType>*>(event)->callback_();
     }
 
-private:
-    TimerEvent<CBType>(const TimerEvent<CBType>& other) = delete;
-    TimerEvent<CBType>& operator=(const TimerEvent<CBType>& other) = delete;
+    TimerEvent(const TimerEvent& other) = delete;
+    TimerEvent& operator=(const TimerEvent& other) = delete;
     CBType callback_;
 };
 
@@ -171,17 +299,191 @@ private:
 template<typename T, void(T::*MFun)() >
 class MemberTimerEvent : public TimerEventInterface {
 public:
-    MemberTimerEvent(T* obj) : obj_(obj) {
+    MemberTimerEvent(T* obj)
+        : TimerEventInterface(&MemberTimerEvent<T, MFun>::execute_member),
+          obj_(obj) {
     }
 
-    virtual void execute () {
-        (obj_->*MFun)();
+private:
+    static void execute_member(TimerEventInterface* event) {
+        T* obj = static_cast<MemberTimerEvent<T, MFun>*>(event)->obj_;
+        (obj->*MFun)();
     }
 
-private:
     T* obj_;
 };
 
+class TimerEventPool;
+
+// An event allocated from a TimerEventPool, used for the callbacks
+// scheduled with TimerWheel::schedule(callback, delta). Purely an
+// implementation detail.
+class PooledTimerEvent : public TimerEventInterface {
+public:
+    PooledTimerEvent()
+        : TimerEventInterface(&PooledTimerEvent::execute_pooled) {
+    }
+
+private:
+    friend TimerEventPool;
+    friend class TimerHandle;
+
+    static inline void execute_pooled(TimerEventInterface* event);
+
+    void invalidate_handles() {
+        generation_++;
+    }
+
+    InlineCallback<> callback_;
+    // Incremented whenever the event is returned to the pool, which
+    // invalidates any outstanding handles.
+    uint32_t generation_ = 0;
+    TimerEventPool* pool_ = NULL;
+    PooledTimerEvent* next_free_ = NULL;
+};
+
+// A handle to a callback scheduled with TimerWheel::schedule(callback,
+// delta). The handle stays safe to use after the callback has been
+// executed or canceled (as long as the TimerWheel exists); it just
+// becomes inactive.
+class TimerHandle {
+public:
+    TimerHandle() {
+    }
+
+    // Return true iff the callback is still scheduled for execution.
+    bool active() const {
+        return event_ && event_->generation_ == generation_;
+    }
+
+    // Unschedule the callback. It's safe to cancel an inactive handle.
+    inline void cancel();
+
+private:
+    friend TimerEventPool;
+
+    TimerHandle(PooledTimerEvent* event)
+        : event_(event), generation_(event->generation_) {
+    }
+
+    PooledTimerEvent* event_ = NULL;
+    uint32_t generation_ = 0;
+};
+
+// A free-list of PooledTimerEvents, allocated in slabs. Events are
+// never returned to the heap until the pool is destroyed. Purely an
+// implementation detail.
+class TimerEventPool {
+public:
+    TimerEventPool() {
+    }
+
+    ~TimerEventPool() {
+        // Destroying the events also cancels them. The slots they're
+        // linked into must still be alive at this point.
+        for (auto slab : slabs_) {
+            delete[] slab;
+        }
+    }
+
+    // Return an unused event with the callback set.
+    template<typename CBType>
+    PooledTimerEvent* allocate(CBType&& callback) {
+        if (!free_) {
+            grow();
+        }
+        auto event = free_;
+        free_ = event->next_free_;
+        event->next_free_ = NULL;
+        event->callback_ = InlineCallback<>(std::forward<CBType>(callback));
+        return event;
+    }
+
+    // Return a handle to an event allocated from this pool.
+    TimerHandle handle(PooledTimerEvent* event) {
+        return TimerHandle(event);
+    }
+
+    // Return the event to the pool, invalidating all of its handles.
+    void release(PooledTimerEvent* event) {
+        event->cancel();
+        event->invalidate_handles();
+        recycle(event);
+    }
+
+    // Return an already unscheduled event with no outstanding handles
+    // to the pool.
+    void recycle(PooledTimerEvent* event) {
+        event->callback_.reset();
+        event->next_free_ = free_;
+        free_ = event;
+    }
+
+private:
+    TimerEventPool(const TimerEventPool& other) = delete;
+    TimerEventPool& operator=(const TimerEventPool& other) = delete;
+
+    static const size_t SLAB_SIZE = 256;
+
+    void grow() {
+        auto slab = new PooledTimerEvent[SLAB_SIZE];
+        slabs_.push_back(slab);
+        for (size_t i = 0; i < SLAB_SIZE; ++i) {
+            slab[i].pool_ = this;
+            slab[i].next_free_ = free_;
+            free_ = &slab[i];
+        }
+    }
+
+    std::vector<PooledTimerEvent*> slabs_;
+    PooledTimerEvent* free_ = NULL;
+};
+
+void PooledTimerEvent::execute_pooled(TimerEventInterface* event) {
+    auto pooled = static_cast<PooledTimerEvent*>(event);
+    // Invalidate the handles before running the callback, so that a
+    // callback that cancels itself doesn't release the event twice.
+    pooled->invalidate_handles();
+    pooled->callback_();
+    pooled->pool_->recycle(pooled);
+}
+
+void TimerHandle::cancel() {
+    if (active()) {
+        event_->pool_->release(event_);
+    }
+}
+
+#if defined(__GNUC__)
+static inline int timer_wheel_ctz(uint64_t word) {
+    return __builtin_ctzll(word);
+}
+static inline int timer_wheel_log2(uint64_t word) {
+    return 63 - __builtin_clzll(word);
+}
+static inline void timer_wheel_prefetch(const void* address) {
+    __builtin_prefetch(address);
+}
+#else
+static inline void timer_wheel_prefetch(const void* address) {
+}
+static inline int timer_wheel_ctz(uint64_t word) {
+    int count = 0;
+    while (!(word & 1)) {
+        word >>= 1;
+        ++count;
+    }
+    return count;
+}
+static inline int timer_wheel_log2(uint64_t word) {
+    int bit = 0;
+    while (word >>= 1) {
+        ++bit;
+    }
+    return bit;
+}
+#endif
+
 // Purely an implementation detail.
 class TimerWheelSlot {
 public:
@@ -191,6 +493,18 @@ public:
 private:
     // Return the first event queued in this slot.
     const TimerEventInterface* events() const { return events_; }
+    // Add an event that's not linked to any slot to the head of the
+    // list.
+    void push_event(TimerEventInterface* event) {
+        auto old = events_;
+        event->next_ = old;
+        event->prev_ = NULL;
+        if (old) {
+            old->prev_ = event;
+        }
+        events_ = event;
+        event->slot_ = this;
+    }
     // Deque the first event from the slot, and return it.
     TimerEventInterface* pop_event() {
         auto event = events_;
@@ -206,23 +520,415 @@ private:
     TimerWheelSlot(const TimerWheelSlot& other) = delete;
     TimerWheelSlot& operator=(const TimerWheelSlot& other) = delete;
     friend TimerEventInterface;
-    friend TimerWheel;
+    template<int WidthBits, int NumLevels, typename TickType,
+             bool CollectStats, bool PublishDeadline, typename Tracer>
+    friend class TimerWheelT;
 
     // Doubly linked (inferior) list of events.
     TimerEventInterface* events_ = NULL;
 };
 
+// Counters describing the work done by a TimerWheelT. Only collected
+// if the CollectStats template parameter is true.
+struct TimerWheelStats {
+    // Calls to advance().
+    uint64_t advances = 0;
+    // Ticks that advance() skipped over, since no slot on any level
+    // needed to be processed.
+    uint64_t ticks_skipped = 0;
+    // Event callbacks executed.
+    uint64_t executions = 0;
+    // Events moved from an outer wheel to an inner one.
+    uint64_t promotions = 0;
+    // Events whose slot came up before their deadline, either due to
+    // schedule_lazy() or to not fitting in the range of the wheel, and
+    // had to be rescheduled.
+    uint64_t refiles = 0;
+    // Calls to schedule(), including the ones done on behalf of the
+    // other scheduling functions.
+    uint64_t schedules = 0;
+    // schedule() calls where the event was already in the right slot,
+    // so that no relinking was needed.
+    uint64_t schedules_same_slot = 0;
+    // schedule_in_range() calls where the event was already scheduled
+    // in the range, and was left alone.
+    uint64_t in_range_kept = 0;
+    // schedule_lazy() calls that only needed to update the deadline.
+    uint64_t lazy_updates = 0;
+    // schedule_with_slack() calls that moved an event to a tick that
+    // already had other events.
+    uint64_t coalesced = 0;
+    // Calls to batch handlers. The events executed by them are also
+    // included in executions.
+    uint64_t batches = 0;
+    // Periodic events rescheduled for their next period.
+    uint64_t rearms = 0;
+};
+
+// Purely an implementation detail. A TimerWheelT inherits from this,
+// so that the specialization with stats disabled takes up no space
+// and all the updates compile down to nothing.
+template<bool Enabled>
+class TimerWheelStatsCollector {
+protected:
+    void count(uint64_t TimerWheelStats::* counter, uint64_t n = 1) {
+        stats_.*counter += n;
+    }
+
+    TimerWheelStats stats_;
+};
+
+template<>
+class TimerWheelStatsCollector<false> {
+protected:
+    void count(uint64_t TimerWheelStats::* counter, uint64_t n = 1) {
+    }
+};
+
+// The default tracing policy of a TimerWheelT, with hooks that do
+// nothing. A custom policy is a class with the same methods, and gets
+// called at the corresponding points inside advance(). Since every
+// wheel has its own instance, the policy can keep state, e.g. the
+// start time of the current advance. See timer-wheel-tracing.h for
+// ready-made policies.
+struct TimerWheelNoTracing {
+    // Called at the start and end of each advance(), with the current
+    // tick of the wheel. done is the value advance() returns.
+    void on_advance_start(uint64_t now, uint64_t delta) {
+    }
+    void on_advance_end(uint64_t now, bool done) {
+    }
+    // Called each time a non-empty slot on an outer level is promoted,
+    // with the level of the slot and the number of events it had.
+    void on_promote(int level, size_t count) {
+    }
+    // Called around the execution of each event callback. For a batch
+    // handler, they're called once with the first event of the batch.
+    // The callback might have destroyed the event, so on_execute_end()
+    // must not access it.
+    void on_execute_start(const TimerEventInterface* event) {
+    }
+    void on_execute_end(const TimerEventInterface* event) {
+    }
+};
+
+// Purely an implementation detail. A TimerWheelT inherits from this,
+// so that a tracing policy with no state (like the default) takes up
+// no space, the same way as with the stats.
+template<typename Tracer, bool Empty = std::is_empty<Tracer>::value>
+class TimerWheelTracerStorage {
+protected:
+    Tracer& stored_tracer() { return tracer_; }
+    const Tracer& stored_tracer() const { return tracer_; }
+
+private:
+    Tracer tracer_;
+};
+
+template<typename Tracer>
+class TimerWheelTracerStorage<Tracer, true> : private Tracer {
+protected:
+    Tracer& stored_tracer() { return *this; }
+    const Tracer& stored_tracer() const { return *this; }
+};
+
+// Purely an implementation detail. advance() is parameterized on a
+// budget policy that decides when it's time to stop processing
+// events. Executed events are reported with executed(n), and each
+// promotion of an outer slot with promoted(n), where n is the number
+// of events moved. Rescheduling an event that's not due yet counts
+// as promoting one. Returning false from either makes advance() stop
+// and return false. batch_limit() is the largest number of events
+// that can be executed as one batch. The budget is passed by value
+// to each slot, so this one limits the number of events executed
+// per slot.
+class TimerWheelEventLimit {
+public:
+    explicit TimerWheelEventLimit(size_t max_execute)
+        : remaining_(max_execute) {
+    }
+
+    bool executed(size_t n = 1) {
+        remaining_ -= n;
+        return remaining_ != 0;
+    }
+    bool promoted(size_t n) { return true; }
+    size_t batch_limit() const { return remaining_; }
+
+private:
+    size_t remaining_;
+};
+
+// Purely an implementation detail. Like TimerWheelEventLimit, but the
+// count lives with the caller, so that the limit is on the number of
+// events executed by the whole advance() rather than by each slot.
+class TimerWheelSharedLimit {
+public:
+    explicit TimerWheelSharedLimit(size_t* remaining)
+        : remaining_(remaining) {
+    }
+
+    bool executed(size_t n = 1) {
+        *remaining_ -= n;
+        return *remaining_ != 0;
+    }
+    bool promoted(size_t n) { return true; }
+    size_t batch_limit() const { return *remaining_; }
+
+private:
+    size_t* remaining_;
+};
+
+// Purely an implementation detail. A budget that stops once the
+// deadline has passed. Reading the clock on every event would cost
+// about as much as executing a cheap callback, so it's only done
+// after every check_interval units of work. Both executing and
+// promoting an event count as a unit. The countdown lives with the
+// caller, so that it's shared between the copies of the budget made
+// for each slot.
+template<typename Clock, typename Duration>
+class TimerWheelDeadline {
+public:
+    TimerWheelDeadline(const std::chrono::time_point<Clock, Duration>& deadline,
+                       ptrdiff_t check_interval,
+                       ptrdiff_t* until_check)
+        : deadline_(deadline),
+          check_interval_(check_interval),
+          until_check_(until_check) {
+    }
+
+    bool executed(size_t n = 1) { return spend(n); }
+    // A resumed advance() redoes the promotion of the slot it stopped
+    // in, which moves no events. That must not use up the budget, or
+    // the call might not make any progress.
+    bool promoted(size_t n) { return n == 0 || spend(n); }
+    size_t batch_limit() const {
+        return std::max<ptrdiff_t>(*until_check_, 1);
+    }
+
+private:
+    bool spend(size_t n) {
+        *until_check_ -= ptrdiff_t(n);
+        if (*until_check_ > 0) {
+            return true;
+        }
+        *until_check_ = check_interval_;
+        return Clock::now() < deadline_;
+    }
+
+    std::chrono::time_point<Clock, Duration> deadline_;
+    ptrdiff_t check_interval_;
+    ptrdiff_t* until_check_;
+};
+
+// A queue through which other threads can schedule and cancel events
+// on a TimerWheel, which is otherwise strictly single-threaded. Once
+// attached to a wheel with set_mailbox(), the queued requests are
+// processed by the thread owning the wheel at the start of each call
+// to advance() and ticks_to_next_event(), in the order they were
+// made. The deltas are relative to the wheel's time when the request
+// gets processed, not when it was made.
+//
+// schedule() and cancel() can be called from any thread, and never
+// block (though they do allocate memory for the request). Everything
+// else must only be done by the thread owning the wheel. Events must
+// not be destroyed while a request for them is still queued.
+//
+// The owner thread will usually sleep between calls to advance(),
+// for as long as ticks_to_next_event() said. The wakeup callback
+// is called by schedule() if the new event might need to be executed
+// before that, e.g. to write to an eventfd that the owner thread is
+// polling. It gets called at most once per call to
+// ticks_to_next_event(), since after that the owner thread is
+// assumed to be awake until it calls ticks_to_next_event() again.
+template<typename TickType = uint64_t>
+class TimerWheelMailboxT {
+public:
+    typedef TickType Tick;
+    typedef InlineCallback<> Wakeup;
+
+    TimerWheelMailboxT() {
+    }
+
+    ~TimerWheelMailboxT() {
+        auto request = head_.load();
+        while (request) {
+            auto next = request->next;
+            delete request;
+            request = next;
+        }
+    }
+
+    // Set the callback to use for waking up the owner thread. Must
+    // be done before the mailbox is shared with other threads.
+    void set_wakeup(Wakeup wakeup) {
+        wakeup_ = std::move(wakeup);
+    }
+
+    // Request the event to be scheduled delta ticks from the time
+    // the request is processed. The delta must be non-0.
+    void schedule(TimerEventInterface* event, Tick delta) {
+        assert(delta > 0);
+        push(new Request(event, delta));
+        // The push must be visible before the horizon is read, or
+        // this could race with the owner thread going to sleep.
+        Tick horizon = horizon_.load();
+        while (delta < horizon) {
+            if (horizon_.compare_exchange_weak(horizon, 0)) {
+                if (wakeup_) {
+                    wakeup_();
+                }
+                break;
+            }
+        }
+    }
+
+    // Request the event to be canceled.
+    void cancel(TimerEventInterface* event) {
+        push(new Request(event, 0));
+    }
+
+    // Return true if there are no queued requests.
+    bool empty() const {
+        return head_.load() == NULL;
+    }
+
+    // Process all the queued requests on the wheel. Returns the number
+    // of requests processed.
+    template<typename Wheel>
+    size_t drain(Wheel* wheel) {
+        if (empty()) {
+            return 0;
+        }
+        // The requests are in a stack with the newest one first.
+        // Reverse it to process them in order.
+        Request* request = head_.exchange(NULL);
+        Request* ordered = NULL;
+        while (request) {
+            auto next = request->next;
+            request->next = ordered;
+            ordered = request;
+            request = next;
+        }
+        size_t count = 0;
+        while (ordered) {
+            auto next = ordered->next;
+            if (ordered->delta) {
+                wheel->schedule(ordered->event, ordered->delta);
+            } else {
+                ordered->event->cancel();
+            }
+            delete ordered;
+            ordered = next;
+            ++count;
+        }
+        return count;
+    }
+
+    // Called by the wheel with the number of ticks the owner thread
+    // is about to sleep for.
+    void set_horizon(Tick ticks) {
+        horizon_.store(ticks);
+    }
+
+private:
+    TimerWheelMailboxT(const TimerWheelMailboxT& other) = delete;
+    TimerWheelMailboxT& operator=(const TimerWheelMailboxT& other) = delete;
+
+    struct Request {
+        Request(TimerEventInterface* event, Tick delta)
+            : event(event), delta(delta) {
+        }
+
+        TimerEventInterface* event;
+        // 0 for a cancel request.
+        Tick delta;
+        Request* next = NULL;
+    };
+
+    // Since the consumer always takes the whole stack at once, a
+    // plain compare-and-swap push has no ABA problem.
+    void push(Request* request) {
+        Request* head = head_.load(std::memory_order_relaxed);
+        do {
+            request->next = head;
+        } while (!head_.compare_exchange_weak(head, request));
+    }
+
+    std::atomic<Request*> head_ { NULL };
+    // Schedule requests with a delta below this need to wake up the
+    // owner thread. Until the first ticks_to_next_event() call all
+    // of them do.
+    std::atomic<Tick> horizon_ { std::numeric_limits<Tick>::max() };
+    Wakeup wakeup_;
+};
+
+typedef TimerWheelMailboxT<> TimerWheelMailbox;
+
 // A TimerWheel is the entity that TimerEvents can be scheduled on
 // for execution (with schedule() or schedule_in_range()), and will
 // eventually be executed once the time advances far enough with the
 // advance() method.
-class TimerWheel {
+//
+// The geometry of the wheel is configurable. Each level has
+// 2^WidthBits slots, and there are NumLevels levels. TickType is the
+// unsigned integer type used for timestamps, and must have at least
+// WidthBits * NumLevels bits. The default parameters (available as
+// the TimerWheel typedef) give a wheel that can hold any 64 bit
+// delta. Smaller wheels take up less memory and are
+// faster to scan, but events scheduled further in the future than
+// the wheel can hold (2^(WidthBits * NumLevels) ticks) will be
+// rescheduled each time they reach the outermost level. Narrower
+// tick types wrap around; this works as long as no delta exceeds half
+// the range of TickType.
+//
+// If CollectStats is true, the wheel keeps counts of the work it
+// does, available through stats(). These are useful for tuning the
+// geometry and the scheduling strategy, but cost a little time, and
+// are completely compiled out by default.
+//
+// If PublishDeadline is true, the wheel keeps track of the earliest
+// deadline of the scheduled events, readable from any thread with
+// next_deadline(). This adds some work to every schedule() call, so
+// it's also disabled by default.
+//
+// Tracer is a policy class that gets called at interesting points
+// inside advance(), see TimerWheelNoTracing. The default does nothing,
+// and compiles to nothing.
+template<int WidthBits = 8,
+         int NumLevels = 64 / WidthBits,
+         typename TickType = uint64_t,
+         bool CollectStats = false,
+         bool PublishDeadline = false,
+         typename Tracer = TimerWheelNoTracing>
+class TimerWheelT : private TimerWheelStatsCollector<CollectStats>,
+                    private TimerWheelTracerStorage<Tracer> {
 public:
-    TimerWheel(Tick now = 0) {
+    typedef TickType Tick;
+
+    TimerWheelT(Tick now = 0) {
         for (int i = 0; i < NUM_LEVELS; ++i) {
             now_[i] = now >> (WIDTH_BITS * i);
+            for (int j = 0; j < OCCUPANCY_WORDS; ++j) {
+                occupied_[i][j] = 0;
+            }
         }
         ticks_pending_ = 0;
+        advance_end_ = now;
+        mailbox_ = NULL;
+        heap_occupied_ = 0;
+        heap_active_ = false;
+        outer_mode_ = OUTER_WHEEL;
+        set_next_deadline(false, 0);
+        next_event_.ticks = 0;
+    }
+
+    // Create the wheel with the events already scheduled, see
+    // schedule_bulk().
+    template<typename Iterator>
+    TimerWheelT(Tick now, Iterator begin, Iterator end)
+        : TimerWheelT(now) {
+        schedule_bulk(begin, end);
     }
 
     // Advance the TimerWheel by the specified number of ticks, and execute
@@ -241,15 +947,121 @@ public:
     // Delta should be non-0. The only exception is if the previous
     // call to advance() returned false.
     //
+    // Ticks on which no slot needs to be processed are skipped over
+    // in bulk, so the cost of a large delta depends on the number of
+    // events executed or promoted rather than on the delta.
+    //
     // advance() should not be called from an event callback.
-    inline bool advance(Tick delta,
-                        size_t max_execute=std::numeric_limits<size_t>::max(),
-                        int level = 0);
+    bool advance(Tick delta,
+                 size_t max_execute=std::numeric_limits<size_t>::max(),
+                 int level = 0) {
+        tracer().on_advance_start(now_[0], delta);
+        next_event_.ticks = 0;
+        bool done = advance_with_budget(delta,
+                                        TimerWheelEventLimit(max_execute),
+                                        level);
+        if (level == 0) {
+            refresh_next_deadline();
+        }
+        next_event_.ticks = 0;
+        tracer().on_advance_end(now_[0], done);
+        return done;
+    }
+
+    // Like advance(), but *remaining is the number of events that can
+    // still be executed, and is decremented for each one. The limit
+    // applies to the whole call rather than to each slot, and can be
+    // shared with other work done by the caller. Must be called with
+    // a non-0 *remaining. Returns false if it reaches 0, even if that
+    // happened on the last event.
+    bool advance_with_limit(Tick delta, size_t* remaining) {
+        assert(*remaining > 0);
+        tracer().on_advance_start(now_[0], delta);
+        next_event_.ticks = 0;
+        bool done = advance_with_budget(delta,
+                                        TimerWheelSharedLimit(remaining),
+                                        0);
+        refresh_next_deadline();
+        next_event_.ticks = 0;
+        tracer().on_advance_end(now_[0], done);
+        return done;
+    }
+
+    // Like advance(), but rather than limiting the number of events
+    // executed, stop once the clock has passed the deadline. The clock
+    // is only read after every check_interval events executed or
+    // promoted, so the deadline can be overshot by that many events.
+    // Likewise at least that many events are processed on each call,
+    // even if the deadline has already passed. If the deadline is
+    // reached, the function returns false and the rest of the events
+    // will be processed on a subsequent call, just like when
+    // max_execute is reached.
+    //
+    // Any type that works with std::chrono::time_point can be used as
+    // the clock, e.g. a wrapper around a cycle counter.
+    template<typename Clock, typename Duration>
+    bool advance(Tick delta,
+                 const std::chrono::time_point<Clock, Duration>& deadline,
+                 size_t check_interval = 16) {
+        assert(check_interval > 0);
+        ptrdiff_t until_check = check_interval;
+        tracer().on_advance_start(now_[0], delta);
+        next_event_.ticks = 0;
+        bool done = advance_with_budget(
+            delta,
+            TimerWheelDeadline<Clock, Duration>(deadline, check_interval,
+                                              &until_check),
+            0);
+        refresh_next_deadline();
+        next_event_.ticks = 0;
+        tracer().on_advance_end(now_[0], done);
+        return done;
+    }
 
     // Schedule the event to be executed delta ticks from the current time.
     // The delta must be non-0.
     inline void schedule(TimerEventInterface* event, Tick delta);
 
+    // Schedule the callback to be executed delta ticks from the
+    // current time. The delta must be non-0. The callback is stored
+    // in an event owned by the TimerWheel, which gets reused once the
+    // callback has been executed or canceled. The callback must fit
+    // in an InlineCallback<>.
+    //
+    // The returned handle can be used to cancel the callback.
+    template<typename CBType>
+    typename std::enable_if<
+        !std::is_convertible<CBType, TimerEventInterface*>::value,
+        TimerHandle>::type
+    schedule(CBType&& callback, Tick delta) {
+        auto event = pool_.allocate(std::forward<CBType>(callback));
+        schedule(event, delta);
+        return pool_.handle(event);
+    }
+
+    // Schedule many events at once. The range must contain
+    // (TimerEventInterface*, Tick) pairs, e.g. a
+    // std::vector<std::pair<TimerEventInterface*, Tick>>, and each
+    // event is scheduled delta ticks from the current time just like
+    // with schedule(). The pairs can be in any order.
+    //
+    // This is faster than calling schedule() in a loop when the events
+    // aren't in the cache, e.g. when restoring timers on startup,
+    // since the events are prefetched a few iterations before they're
+    // linked into their slots.
+    template<typename Iterator>
+    void schedule_bulk(Iterator begin, Iterator end);
+
+    // Like schedule(), but if the event is already scheduled and the
+    // new deadline is later than the current one, only the deadline is
+    // updated. The event stays in its current slot, and gets moved to
+    // the right one when that slot comes up. This makes the common case
+    // of repeatedly pushing back a timeout very cheap, at the cost of
+    // some extra work when the original deadline is reached. Until
+    // then ticks_to_next_event() might also return the original
+    // deadline rather than the real one.
+    inline void schedule_lazy(TimerEventInterface* event, Tick delta);
+
     // Schedule the event to happen at some time between start and end
     // ticks from the current time. The actual time will be determined
     // by the TimerWheel to minimize rescheduling and promotion overhead.
@@ -258,6 +1070,15 @@ public:
     inline void schedule_in_range(TimerEventInterface* event,
                                   Tick start, Tick end);
 
+    // Schedule the event to be executed between delta and delta + slack
+    // ticks from the current time, preferring ticks that other events
+    // are already scheduled on. Coalescing the events like this means
+    // fewer distinct ticks on which anything needs to be done, and so
+    // fewer wakeups. If no nearby tick already has events, this is the
+    // same as schedule_in_range(event, delta, delta + slack).
+    inline void schedule_with_slack(TimerEventInterface* event,
+                                    Tick delta, Tick slack);
+
     // Return the current tick value. Note that if the time increases
     // by multiple ticks during a single call to advance(), during the
     // execution of the event callback now() will return the tick that
@@ -271,24 +1092,388 @@ public:
     //
     // Will return 0 if the wheel still has unprocessed events from the
     // previous call to advance().
+    //
+    // The result is cached until the next advance(). Scheduling an
+    // event just lowers the cached value if needed, and the cached
+    // value is only recomputed if the event (or core wheel slot) it
+    // came from gets canceled or rescheduled. So calling this many
+    // times between advances is cheap.
     inline Tick ticks_to_next_event(Tick max = std::numeric_limits<Tick>::max(),
                                     int level = 0);
 
+    // Return the absolute tick of the earliest scheduled event, or the
+    // maximum Tick value if there are none. Unlike everything else,
+    // this can be called from any thread without synchronization, e.g.
+    // to compute a poll timeout. Only available if the PublishDeadline
+    // template parameter is true.
+    //
+    // The value is lowered by any schedule() call that goes below it,
+    // and recomputed by advance() once it's been reached. Canceling or
+    // rescheduling the earliest event to a later time doesn't update
+    // it, so it can be earlier than the real next deadline. That's
+    // safe for a poll timeout, since it can only cause an early wakeup.
+    Tick next_deadline() const {
+        static_assert(PublishDeadline,
+                      "next_deadline() requires PublishDeadline to be enabled");
+        return published_deadline_.load(std::memory_order_relaxed);
+    }
+
+    // Execute due events of the type using the given execute function
+    // in batches, by calling execute_batch once with all the
+    // consecutive events of that type in a slot, rather than executing
+    // them one by one. Passing NULL as execute_batch goes back to
+    // executing the events one by one.
+    //
+    // The batch handler can amortize work over the whole batch, e.g.
+    // by prefetching the events or by closing many connections with
+    // one system call. All the events in the batch have already been
+    // unscheduled when it's called, so canceling one of them from the
+    // handler won't keep it from being passed in. A batch is at most
+    // as large as the max_execute limit of advance() allows.
+    void set_batch_handler(TimerEventInterface::ExecuteFn execute,
+                           TimerEventInterface::ExecuteBatchFn execute_batch) {
+        for (auto it = batch_handlers_.begin(); it != batch_handlers_.end();
+             ++it) {
+            if (it->first == execute) {
+                batch_handlers_.erase(it);
+                break;
+            }
+        }
+        if (execute_batch) {
+            batch_handlers_.push_back(std::make_pair(execute, execute_batch));
+        }
+    }
+
+    // Attach a mailbox through which other threads can schedule and
+    // cancel events on this wheel, or detach it by passing NULL. The
+    // mailbox must stay alive until it's detached or the wheel is
+    // destroyed.
+    void set_mailbox(TimerWheelMailboxT<Tick>* mailbox) {
+        mailbox_ = mailbox;
+    }
+
+    // How the events beyond the first two levels of the wheel are
+    // stored.
+    enum OuterMode {
+        // On the outer levels of the wheel, as usual.
+        OUTER_WHEEL,
+        // In a radix heap. Each event is kept in the bucket for the
+        // highest bit in which its deadline differs from the current
+        // time, and the bucket is redistributed when the time reaches
+        // that bit. So there are no empty outer slots to go through,
+        // and an event only moves when it needs to.
+        OUTER_HEAP,
+        // Use the heap while there are only a few outer events, and
+        // the wheel levels otherwise. The choice is revisited each
+        // time level 1 wraps around.
+        OUTER_ADAPTIVE,
+    };
+
+    // Change how the outer events are stored. Switching between the
+    // heap and the wheel levels moves all the outer events over. If
+    // called while the previous advance() returned false, the switch
+    // is done during a later advance(). Does nothing if the wheel
+    // only has two levels. Must not be called from an event callback.
+    void set_outer_mode(OuterMode mode) {
+        outer_mode_ = mode;
+        if (!ticks_pending_) {
+            update_outer_levels();
+        }
+    }
+
+    // Return true iff the outer events are currently in the heap.
+    bool outer_heap_active() const { return heap_active_; }
+
+    // Return the tracing policy object of this wheel, e.g. to read
+    // the data it has collected.
+    Tracer& tracer() { return this->stored_tracer(); }
+    const Tracer& tracer() const { return this->stored_tracer(); }
+
+    // Return the statistics collected so far. Only available if
+    // the CollectStats template parameter is true.
+    const TimerWheelStats& stats() const {
+        static_assert(CollectStats,
+                      "stats() requires CollectStats to be enabled");
+        return this->stats_;
+    }
+
+    // Return the number of events currently scheduled on the given
+    // level of the wheel. This walks through all the events on the
+    // level, so it's meant for diagnostics only. While the outer heap
+    // is in use, all the events in it are counted as being on level 2.
+    inline size_t events_on_level(int level) const;
+
+    // Return the number of events that are due within the next
+    // window ticks, including any left unprocessed by an advance()
+    // that returned false. E.g. for load shedding, the number of
+    // idle timeouts that are about to trigger. The result is exact,
+    // also for events rescheduled with schedule_lazy().
+    //
+    // Only the non-empty slots that the window reaches are looked at,
+    // so the cost is proportional to the number of events in those
+    // slots rather than to the window.
+    inline size_t count_due_within(Tick window);
+
+    // Return the number of events in each slot of the level, indexed
+    // by the distance of the slot from the current one. Like
+    // events_on_level(), meant for diagnostics.
+    inline std::vector<size_t> slot_histogram(int level) const;
+
 private:
-    TimerWheel(const TimerWheel& other) = delete;
-    TimerWheel& operator=(const TimerWheel& other) = delete;
+    static_assert(std::is_unsigned<Tick>::value,
+                  "TickType must be an unsigned integer type");
+    static_assert(WidthBits > 0 && WidthBits < 16,
+                  "WidthBits out of range");
+    static_assert(NumLevels > 0 &&
+                  WidthBits * NumLevels <= std::numeric_limits<Tick>::digits,
+                  "NumLevels too large for TickType");
+
+    TimerWheelT(const TimerWheelT& other) = delete;
+    TimerWheelT& operator=(const TimerWheelT& other) = delete;
+    template<typename CBType, typename Wheel>
+    friend class PeriodicTimerEvent;
 
+    // The implementation of advance(), with the policy for when to
+    // stop given by the budget.
+    template<typename Budget>
+    inline bool advance_with_budget(Tick delta, Budget budget, int level);
     // This handles the actual work of executing event callbacks and
     // recursing to the outer wheels.
-    inline bool process_current_slot(Tick now, size_t max_execute, int level);
+    template<typename Budget>
+    inline bool process_current_slot(Tick now, Budget budget, int level);
+    // Move all events from a slot on an outer wheel to the wheels
+    // their deadline now falls in. Events that are due remain in
+    // the slot. Returns the number of events moved.
+    inline size_t promote_slot(TimerWheelSlot* slot);
+    // Schedule the event on the absolute tick at, which must be in
+    // the future. Shared by schedule() and schedule_bulk().
+    inline void schedule_at_tick(TimerEventInterface* event, Tick at);
+    // Compute the slot an event delta ticks in the future belongs in.
+    inline void find_slot(Tick delta, int* level, size_t* slot_index) const;
+    // Return the slot or heap bucket an event delta ticks in the future
+    // belongs in, and mark it as occupied. *level is set to the level
+    // of the slot, or to HEAP_LEVEL for the heap.
+    TimerWheelSlot* claim_slot(Tick delta, int* level) {
+        size_t slot_index;
+        find_slot(delta, level, &slot_index);
+        if (*level >= HEAP_LEVEL && heap_active_) {
+            *level = HEAP_LEVEL;
+            int bucket = timer_wheel_log2(uint64_t(Tick(now_[0] + delta) ^
+                                                   now_[0])) - HEAP_SHIFT;
+            heap_occupied_ |= uint64_t(1) << bucket;
+            return &heap_[bucket];
+        }
+        set_occupied(*level, slot_index);
+        return &slots_[*level][slot_index];
+    }
+    // Schedule a periodic event that is being executed for its next
+    // period. See PeriodicTimerEvent.
+    inline void reschedule_periodic(TimerEventInterface* event, Tick period,
+                                    bool skip_missed);
+
+    // Return true if the event should be executed at the current time,
+    // rather than promoted to an inner wheel.
+    bool is_due(const TimerEventInterface* event) const {
+        typedef typename std::make_signed<Tick>::type Diff;
+        return Diff(Tick(now_[0] - Tick(event->scheduled_at()))) >= 0;
+    }
+    // Return the number of ticks from now until the slot that is
+    // "steps" slots after the current one on the level gets processed.
+    Tick ticks_to_slot(int level, Tick steps) const {
+        int shift = WIDTH_BITS * level;
+        return Tick(Tick(steps << shift) -
+                    Tick(now_[0] & Tick((Tick(1) << shift) - 1)));
+    }
+    // How far (relative to now) the event in a slot covering 2^shift
+    // ticks starting "slot_ticks" ticks away could next need to be
+    // executed.
+    inline Tick ticks_to_event(const TimerEventInterface* event,
+                               int shift, Tick slot_ticks) const;
+
+    // Mark the slot as (possibly) containing events.
+    void set_occupied(int level, size_t slot_index) {
+        occupied_[level][slot_index / 64] |= uint64_t(1) << (slot_index % 64);
+    }
+    bool is_occupied(int level, size_t slot_index) const {
+        return (occupied_[level][slot_index / 64] >> (slot_index % 64)) & 1;
+    }
+    // Mark the slot as empty.
+    void clear_occupied(int level, size_t slot_index) {
+        occupied_[level][slot_index / 64] &= ~(uint64_t(1) << (slot_index % 64));
+    }
+    // Return the distance from slot "start" to the first non-empty
+    // slot on the level (wrapping around the wheel, and including
+    // "start" itself), or NUM_SLOTS if the whole level is empty.
+    inline int next_occupied_slot(int level, size_t start);
+    // Return the number of ticks until the first tick on which some
+    // level of the wheel would move into a non-empty slot.
+    inline Tick ticks_to_next_occupied_slot();
+    // The implementation of ticks_to_next_event(), minus the handling
+    // of the mailbox.
+    inline Tick find_next_event(Tick max, int level);
+    // Like find_next_event(max, 0), but using next_event_ when it's
+    // still valid.
+    inline Tick cached_next_event(Tick max);
+    // Return the event in the slot "slot_ticks" away covering 2^shift
+    // ticks that could need to be executed the soonest, if that's
+    // sooner than *min, and lower *min to its time. Otherwise returns
+    // NULL.
+    TimerEventInterface* closest_event(TimerWheelSlot* slot, int shift,
+                                       Tick slot_ticks, Tick* min) const {
+        TimerEventInterface* closest = NULL;
+        Tick best = *min;
+        for (auto event = slot->events_; event != NULL;
+             event = event->next_) {
+            Tick ticks = ticks_to_event(event, shift, slot_ticks);
+            // Which event is the closest one is unpredictable, so
+            // this is written to compile to conditional moves rather
+            // than branches.
+            closest = ticks < best ? event : closest;
+            best = std::min(best, ticks);
+        }
+        *min = best;
+        return closest;
+    }
+    // Remember that the closest event found so far by find_next_event()
+    // is in the slot. The event is NULL if the slot is in the core
+    // wheel, since then it doesn't matter which event it is.
+    void set_next_event_source(TimerWheelSlot* slot,
+                               TimerEventInterface* event) {
+        next_event_.slot = slot;
+        next_event_.event = event;
+        next_event_.event_at = event ? Tick(event->scheduled_at()) : 0;
+    }
+    // Lower the cached result of ticks_to_next_event() to delta, for
+    // an event that was just scheduled into the slot delta ticks from
+    // now. Only called if that's earlier than the cached result.
+    void lower_next_event(TimerEventInterface* event, Tick delta, int level,
+                          TimerWheelSlot* slot) {
+        // Events parked in the outermost wheel are reported at the
+        // time of their slot instead, and an event rescheduled within
+        // its slot stays where it was rather than moving to the head.
+        // Just start over in those cases.
+        if ((LIMITED_RANGE && level == MAX_LEVEL) ||
+            (level > 0 && slot->events_ != event)) {
+            next_event_.ticks = 0;
+            return;
+        }
+        next_event_.found = true;
+        next_event_.ticks = delta;
+        set_next_event_source(slot, level > 0 ? event : NULL);
+    }
+    // Return the batch handler for the event's type, or NULL.
+    TimerEventInterface::ExecuteBatchFn find_batch_handler(
+        const TimerEventInterface* event) const {
+        for (const auto& handler : batch_handlers_) {
+            if (handler.first == event->execute_) {
+                return handler.second;
+            }
+        }
+        return NULL;
+    }
+    // Fill batch_ with the event, and the due events of the same type
+    // directly after it in the slot, up to limit events. Returns the
+    // number of events in the batch.
+    size_t collect_batch(TimerWheelSlot* slot, TimerEventInterface* event,
+                         size_t limit) {
+        batch_.clear();
+        batch_.push_back(event);
+        while (batch_.size() < limit) {
+            auto next = slot->events();
+            if (!next || next->execute_ != event->execute_ ||
+                !is_due(next)) {
+                break;
+            }
+            batch_.push_back(slot->pop_event());
+        }
+        return batch_.size();
+    }
+    // Lower the next deadline to the given absolute tick, if it's
+    // earlier than the current value.
+    void lower_next_deadline(Tick at) {
+        typedef typename std::make_signed<Tick>::type Diff;
+        if (!has_next_deadline_ || Diff(Tick(at - next_deadline_)) < 0) {
+            set_next_deadline(true, at);
+        }
+    }
+    void set_next_deadline(bool has_deadline, Tick at) {
+        has_next_deadline_ = has_deadline;
+        next_deadline_ = at;
+        published_deadline_.store(has_deadline ?
+                                  at : std::numeric_limits<Tick>::max(),
+                                  std::memory_order_relaxed);
+    }
+    // Recompute the next deadline if the current one has been reached.
+    inline void refresh_next_deadline();
+    // Move the time forward by delta ticks without processing any
+    // slots. Only valid if all the slots that would be passed are
+    // empty.
+    inline void skip_ticks(Tick delta);
+
+    // Level 1 is wrapping around. Either advance level 2, or promote
+    // the heap bucket that's due.
+    template<typename Budget>
+    inline bool process_outer_levels(Budget budget);
+    // Switch between the heap and the wheel levels if outer_mode_ says
+    // so.
+    inline void update_outer_levels();
+    // Move all the outer events from the wheel levels to the heap, or
+    // the other way around.
+    inline void move_to_heap();
+    inline void move_to_wheel();
+    // Return the number of events in the heap and on the outer levels
+    // of the wheel, counting at most up to limit.
+    inline size_t outer_events(size_t limit) const;
+    // Return the first non-empty heap bucket, or -1 if the heap is
+    // empty.
+    int first_heap_bucket() {
+        while (heap_occupied_) {
+            int bucket = timer_wheel_ctz(heap_occupied_);
+            if (heap_[bucket].events()) {
+                return bucket;
+            }
+            heap_occupied_ &= heap_occupied_ - 1;
+        }
+        return -1;
+    }
+    // Return the number of ticks until the time reaches the bit of
+    // the bucket, and it needs to be redistributed. All the events in
+    // the bucket are due at that time at the earliest, and the later
+    // buckets are reached no sooner than the earlier ones.
+    Tick ticks_to_heap_bucket(int bucket) const {
+        int shift = bucket + HEAP_SHIFT;
+        return Tick(Tick(((now_[0] >> shift) + 1) << shift) - now_[0]);
+    }
+    // Redistribute the heap bucket for the bit the time just reached.
+    // Returns the number of events moved.
+    inline size_t promote_heap();
 
-    static const int WIDTH_BITS = 8;
-    static const int NUM_LEVELS = (64 + WIDTH_BITS - 1) / WIDTH_BITS;
-    static const int MAX_LEVEL = NUM_LEVELS - 1;
-    static const int NUM_SLOTS = 1 << WIDTH_BITS;
+    static constexpr int WIDTH_BITS = WidthBits;
+    static constexpr int NUM_LEVELS = NumLevels;
+    static constexpr int MAX_LEVEL = NUM_LEVELS - 1;
+    static constexpr int NUM_SLOTS = 1 << WIDTH_BITS;
     // A bitmask for looking at just the bits in the timestamp relevant to
     // this wheel.
-    static const int MASK = (NUM_SLOTS - 1);
+    static constexpr int MASK = (NUM_SLOTS - 1);
+    static constexpr int OCCUPANCY_WORDS = (NUM_SLOTS + 63) / 64;
+    // True if a delta can be too large to fit even in the outermost
+    // wheel.
+    static constexpr bool LIMITED_RANGE =
+        WIDTH_BITS * NUM_LEVELS < std::numeric_limits<Tick>::digits;
+    // The levels from this one out can be replaced by the heap.
+    static constexpr int HEAP_LEVEL = 2;
+    static constexpr bool HEAP_SUPPORTED = NUM_LEVELS > HEAP_LEVEL;
+    // Heap bucket i is for the events whose deadline differs from the
+    // current time in bit i + HEAP_SHIFT (but no higher); the events
+    // whose deadline only differs in lower bits are on levels 0 and 1.
+    static constexpr int HEAP_SHIFT = WIDTH_BITS * HEAP_LEVEL;
+    static constexpr int HEAP_BUCKETS = HEAP_SUPPORTED ?
+        std::numeric_limits<Tick>::digits - HEAP_SHIFT : 1;
+    // With OUTER_ADAPTIVE, the heap is used up to this many outer
+    // events, and is switched back to once there are fewer than
+    // HEAP_MIN_EVENTS again.
+    static constexpr size_t HEAP_MAX_EVENTS = 1024;
+    static constexpr size_t HEAP_MIN_EVENTS = 256;
 
     // The current timestamp for this wheel. This will be right-shifted
     // such that each slot is separated by exactly one tick even on
@@ -297,11 +1482,147 @@ private:
     // We've done a partial tick advance. This is how many ticks remain
     // unprocessed.
     Tick ticks_pending_;
+    // The tick the current (or last) call to advance() will move the
+    // time to.
+    Tick advance_end_;
+    // The last result of ticks_to_next_event(), and what it depends
+    // on.
+    struct {
+        // The time the result was computed at.
+        Tick now;
+        // If true, the closest event is "ticks" away. Otherwise
+        // there are no events closer than "ticks". A "ticks" of 0
+        // means there's no valid result, so that schedule() only
+        // needs one comparison to see if the result needs lowering.
+        bool found;
+        Tick ticks;
+        // Where the closest event was found. If the event is in the
+        // core wheel, the result holds as long as the slot isn't
+        // empty. Otherwise it holds as long as the event is still in
+        // the slot with the same deadline. The event is kept at the
+        // head of the slot, so that it can be checked for without
+        // touching the event if it's already been destroyed.
+        TimerWheelSlot* slot;
+        TimerEventInterface* event;
+        Tick event_at;
+    } next_event_;
     TimerWheelSlot slots_[NUM_LEVELS][NUM_SLOTS];
+    // One bit per slot, set when an event gets scheduled into the
+    // slot. Events can be canceled without the TimerWheel knowing of
+    // it, so a set bit only means that the slot might not be empty;
+    // the bit is cleared once the slot is seen to be empty. A clear
+    // bit always means the slot is empty.
+    uint64_t occupied_[NUM_LEVELS][OCCUPANCY_WORDS];
+    // The outer heap, and one bit per bucket with the same meaning as
+    // occupied_. Only used while heap_active_ is true, in which case
+    // the levels from HEAP_LEVEL out are empty and their now_ values
+    // aren't kept up to date.
+    TimerWheelSlot heap_[HEAP_BUCKETS];
+    uint64_t heap_occupied_;
+    bool heap_active_;
+    OuterMode outer_mode_;
+    // Requests from other threads, or NULL.
+    TimerWheelMailboxT<Tick>* mailbox_;
+    // The earliest deadline of any scheduled event, or earlier. Only
+    // valid if has_next_deadline_ is true.
+    Tick next_deadline_;
+    bool has_next_deadline_;
+    // A copy of next_deadline_ for other threads.
+    std::atomic<Tick> published_deadline_;
+    // The batch handlers for each execute function, and the buffer
+    // used for passing the batches to them.
+    std::vector<std::pair<TimerEventInterface::ExecuteFn,
+                          TimerEventInterface::ExecuteBatchFn>> batch_handlers_;
+    std::vector<TimerEventInterface*> batch_;
+    // Storage for the events created by schedule(callback, delta).
+    // This must be destroyed before the slots.
+    TimerEventPool pool_;
+};
+
+typedef TimerWheelT<> TimerWheel;
+
+// An event that executes the callback (of type CBType) periodically
+// on a wheel of type Wheel, once start() has been called.
+//
+// The wheel puts the event back on the wheel by itself just before
+// executing the callback, without going through schedule(). The
+// deadlines are computed from the previous deadline, not from the
+// time the callback happened to be executed, so the period doesn't
+// drift. During the execution of the callback, scheduled_at() will
+// already return the next deadline.
+//
+// The callback can stop the timer with cancel(), or move it with
+// schedule(). Either of those also applies to all the following
+// periods.
+template<typename CBType, typename Wheel = TimerWheel>
+class PeriodicTimerEvent : public TimerEventInterface {
+public:
+    typedef typename Wheel::Tick WheelTick;
+
+    // What to do when the wheel is advanced over multiple periods in
+    // one call to advance(), e.g. after the process was stalled.
+    enum Policy {
+        // Execute the callback once for each period, like separate
+        // events would be.
+        CATCH_UP,
+        // Execute the callback only once, and continue from the first
+        // period after the time advance() is moving to.
+        SKIP_MISSED,
+    };
+
+    explicit PeriodicTimerEvent(CBType callback, Policy policy = CATCH_UP)
+        : TimerEventInterface(&PeriodicTimerEvent::execute_callback),
+          policy_(policy),
+          callback_(std::move(callback)) {
+    }
+
+    // Execute the callback delta ticks from now, and then every
+    // period ticks after that. Both must be non-0.
+    void start(Wheel* wheel, WheelTick delta, WheelTick period) {
+        assert(period > 0);
+        wheel_ = wheel;
+        period_ = period;
+        wheel->schedule(this, delta);
+    }
+
+    WheelTick period() const { return period_; }
+
+private:
+    PeriodicTimerEvent(const PeriodicTimerEvent& other) = delete;
+    PeriodicTimerEvent& operator=(const PeriodicTimerEvent& other) = delete;
+
+    static void execute_callback(TimerEventInterface* event) {
+        auto self = static_cast<PeriodicTimerEvent*>(event);
+        self->wheel_->reschedule_periodic(self, self->period_,
+                                          self->policy_ == SKIP_MISSED);
+        self->callback_();
+    }
+
+    Wheel* wheel_ = NULL;
+    WheelTick period_ = 0;
+    Policy policy_;
+    CBType callback_;
 };
 
 // Implementation
 
+template<int WidthBits, int NumLevels, typename TickType, bool CollectStats,
+         bool PublishDeadline, typename Tracer>
+TickType TimerWheelT<WidthBits, NumLevels, TickType, CollectStats,
+                     PublishDeadline, Tracer>::ticks_to_event(
+    const TimerEventInterface* event, int shift, Tick slot_ticks) const {
+    Tick ticks = Tick(event->scheduled_at() - now_[0]);
+    // An event that was rescheduled with schedule_lazy(), or parked
+    // in the outermost wheel because it didn't fit in the range, will
+    // not execute when the slot comes up, but it will at least need
+    // to be rescheduled. Report that time instead of the real one, so
+    // that events in slots behind it won't be missed.
+    if (Tick(ticks - slot_ticks) >= (Tick(1) << shift)) {
+        return slot_ticks;
+    }
+    return ticks;
+}
+
 void TimerEventInterface::relink(TimerWheelSlot* new_slot) {
     if (new_slot == slot_) {
         return;
@@ -348,7 +1669,22 @@ void TimerEventInterface::cancel() {
     relink(NULL);
 }
 
-bool TimerWheel::advance(Tick delta, size_t max_events, int level) {
+template<int WidthBits, int NumLevels, typename TickType, bool CollectStats,
+         bool PublishDeadline, typename Tracer>
+template<typename Budget>
+bool TimerWheelT<WidthBits, NumLevels, TickType, CollectStats,
+                 PublishDeadline, Tracer>::advance_with_budget(
+    Tick delta, Budget budget, int level) {
+    if (level == 0) {
+        this->count(&TimerWheelStats::advances);
+        if (mailbox_) {
+            mailbox_->drain(this);
+        }
+        // When resuming a partially processed tick, ticks_pending_
+        // includes that tick.
+        advance_end_ = now_[0] + delta +
+            (ticks_pending_ ? ticks_pending_ - 1 : 0);
+    }
     if (ticks_pending_) {
         if (level == 0) {
             // Continue collecting a backlog of ticks to process if
@@ -359,7 +1695,7 @@ bool TimerWheel::advance(Tick delta, size_t max_events, int level) {
         // current slot, rather incrementing like advance() normally
         // does.
         Tick now = now_[level];
-        if (!process_current_slot(now, max_events, level)) {
+        if (!process_current_slot(now, budget, level)) {
             // Outer layers are still not done, propagate that information
             // back up.
             return false;
@@ -380,9 +1716,23 @@ bool TimerWheel::advance(Tick delta, size_t max_events, int level) {
         assert(delta > 0);
     }
 
-    while (delta--) {
+    while (delta) {
+        if (level == 0 && !is_occupied(0, (now_[0] + 1) & MASK)) {
+            // Jump directly over any ticks where no slot on any level
+            // would need processing.
+            Tick idle = ticks_to_next_occupied_slot() - 1;
+            if (idle >= delta) {
+                this->count(&TimerWheelStats::ticks_skipped, delta);
+                skip_ticks(delta);
+                return true;
+            }
+            this->count(&TimerWheelStats::ticks_skipped, idle);
+            skip_ticks(idle);
+            delta -= idle;
+        }
+        --delta;
         Tick now = ++now_[level];
-        if (!process_current_slot(now, max_events, level)) {
+        if (!process_current_slot(now, budget, level)) {
             ticks_pending_ = (delta + 1);
             return false;
         }
@@ -390,147 +1740,828 @@ bool TimerWheel::advance(Tick delta, size_t max_events, int level) {
     return true;
 }
 
-bool TimerWheel::process_current_slot(Tick now, size_t max_events, int level) {
+template<int WidthBits, int NumLevels, typename TickType, bool CollectStats,
+         bool PublishDeadline, typename Tracer>
+TickType TimerWheelT<WidthBits, NumLevels, TickType, CollectStats,
+                     PublishDeadline, Tracer>::ticks_to_next_occupied_slot() {
+    Tick best = std::numeric_limits<Tick>::max();
+    for (int level = 0; level < NUM_LEVELS; ++level) {
+        // This level can't move to a new slot before the level below
+        // it wraps around, so once that's further away than the best
+        // result found so far, none of the remaining levels matter.
+        if (level > 0 && ticks_to_slot(level, 1) >= best) {
+            break;
+        }
+        int found = next_occupied_slot(level, (now_[level] + 1) & MASK);
+        if (found == NUM_SLOTS) {
+            continue;
+        }
+        Tick ticks = ticks_to_slot(level, found + 1);
+        // A zero means the distance overflowed to exactly the range
+        // of Tick, which is as good as infinitely far away.
+        if (ticks && ticks < best) {
+            best = ticks;
+        }
+    }
+    if (heap_active_) {
+        int bucket = first_heap_bucket();
+        if (bucket >= 0) {
+            best = std::min(best, ticks_to_heap_bucket(bucket));
+        }
+    }
+    return best;
+}
+
+template<int WidthBits, int NumLevels, typename TickType, bool CollectStats,
+         bool PublishDeadline, typename Tracer>
+void TimerWheelT<WidthBits, NumLevels, TickType, CollectStats,
+                 PublishDeadline, Tracer>::refresh_next_deadline() {
+    typedef typename std::make_signed<Tick>::type Diff;
+    // If the deadline is still in the future, the earliest event can't
+    // have executed, and any new events were already accounted for by
+    // schedule(). With ticks pending the deadline must stay in the
+    // past, which it already is.
+    if (!PublishDeadline || !has_next_deadline_ || ticks_pending_ ||
+        Diff(Tick(next_deadline_ - now_[0])) > 0) {
+        return;
+    }
+    Tick max = std::numeric_limits<Tick>::max();
+    Tick ticks = find_next_event(max, 0);
+    set_next_deadline(ticks != max, now_[0] + ticks);
+}
+
+template<int WidthBits, int NumLevels, typename TickType, bool CollectStats,
+         bool PublishDeadline, typename Tracer>
+void TimerWheelT<WidthBits, NumLevels, TickType, CollectStats,
+                 PublishDeadline, Tracer>::skip_ticks(Tick delta) {
+    now_[0] += delta;
+    for (int i = 1; i < NUM_LEVELS; ++i) {
+        now_[i] = now_[0] >> (WIDTH_BITS * i);
+    }
+}
+
+template<int WidthBits, int NumLevels, typename TickType, bool CollectStats,
+         bool PublishDeadline, typename Tracer>
+template<typename Budget>
+bool TimerWheelT<WidthBits, NumLevels, TickType, CollectStats,
+                 PublishDeadline, Tracer>::process_current_slot(
+    Tick now, Budget budget, int level) {
     size_t slot_index = now & MASK;
     auto slot = &slots_[level][slot_index];
     if (slot_index == 0 && level < MAX_LEVEL) {
-        if (!advance(1, max_events, level + 1)) {
+        if (level + 1 == HEAP_LEVEL &&
+            (heap_active_ || outer_mode_ != OUTER_WHEEL)) {
+            if (!process_outer_levels(budget)) {
+                return false;
+            }
+        } else if (!advance_with_budget(1, budget, level + 1)) {
+            return false;
+        }
+    }
+    if (level > 0) {
+        assert((now_[0] & MASK) == 0);
+        // Stopping here is safe. The resumed call will promote the
+        // slot again, which just leaves the due events in place.
+        size_t promoted = promote_slot(slot);
+        if (promoted) {
+            tracer().on_promote(level, promoted);
+        }
+        if (!budget.promoted(promoted)) {
             return false;
         }
     }
     while (slot->events()) {
         auto event = slot->pop_event();
-        if (level > 0) {
-            assert((now_[0] & MASK) == 0);
-            if (now_[0] >= event->scheduled_at()) {
-                event->execute();
-                if (!--max_events) {
+        if (is_due(event)) {
+            TimerEventInterface::ExecuteBatchFn execute_batch =
+                batch_handlers_.empty() ? NULL : find_batch_handler(event);
+            if (execute_batch) {
+                size_t count = collect_batch(slot, event,
+                                             budget.batch_limit());
+                this->count(&TimerWheelStats::executions, count);
+                this->count(&TimerWheelStats::batches);
+                tracer().on_execute_start(batch_[0]);
+                execute_batch(&batch_[0], count);
+                tracer().on_execute_end(batch_[0]);
+                if (!budget.executed(count)) {
                     return false;
                 }
-            } else {
-                // There's a case to be made that promotion should
-                // also count as work done. And that would simplify
-                // this code since the max_events manipulation could
-                // move to the top of the loop. But it's an order of
-                // magnitude more expensive to execute a typical
-                // callback, and promotions will naturally clump while
-                // events triggering won't.
-                schedule(event,
-                         event->scheduled_at() - now_[0]);
+                continue;
             }
-        } else {
+            this->count(&TimerWheelStats::executions);
+            tracer().on_execute_start(event);
             event->execute();
-            if (!--max_events) {
+            tracer().on_execute_end(event);
+            if (!budget.executed()) {
+                return false;
+            }
+        } else {
+            // An event whose deadline was moved later by
+            // schedule_lazy(). (Promotions from the outer wheels
+            // were already handled by promote_slot()).
+            //
+            // Whether promotions count as work done is up to the
+            // budget. It's an order of magnitude more expensive to
+            // execute a typical callback, and promotions will
+            // naturally clump while events triggering won't, so
+            // the event limit ignores them. A time budget has to
+            // count them, since it's the time taken that matters.
+            this->count(&TimerWheelStats::refiles);
+            schedule(event,
+                     Tick(event->scheduled_at() - now_[0]));
+            if (!budget.promoted(1)) {
                 return false;
             }
         }
     }
+    clear_occupied(level, slot_index);
     return true;
 }
 
-void TimerWheel::schedule(TimerEventInterface* event, Tick delta) {
+template<int WidthBits, int NumLevels, typename TickType, bool CollectStats,
+         bool PublishDeadline, typename Tracer>
+void TimerWheelT<WidthBits, NumLevels, TickType, CollectStats,
+                 PublishDeadline, Tracer>::schedule(
+    TimerEventInterface* event, Tick delta) {
     assert(delta > 0);
-    event->set_scheduled_at(now_[0] + delta);
+    schedule_at_tick(event, now_[0] + delta);
+}
+
+template<int WidthBits, int NumLevels, typename TickType, bool CollectStats,
+         bool PublishDeadline, typename Tracer>
+void TimerWheelT<WidthBits, NumLevels, TickType, CollectStats,
+                 PublishDeadline, Tracer>::schedule_at_tick(
+    TimerEventInterface* event, Tick at) {
+    Tick delta = Tick(at - now_[0]);
+    event->set_scheduled_at(at);
+    if (PublishDeadline) {
+        lower_next_deadline(at);
+    }
+
+    int level;
+    auto slot = claim_slot(delta, &level);
+    this->count(&TimerWheelStats::schedules);
+    if (!event->active()) {
+        // The common case when restoring timers. Skip the unlinking
+        // part of relink().
+        slot->push_event(event);
+    } else if (event->slot_ == slot) {
+        this->count(&TimerWheelStats::schedules_same_slot);
+    } else {
+        event->relink(slot);
+    }
+    if (delta < next_event_.ticks) {
+        lower_next_event(event, delta, level, slot);
+    }
+}
+
+template<int WidthBits, int NumLevels, typename TickType, bool CollectStats,
+         bool PublishDeadline, typename Tracer>
+template<typename Iterator>
+void TimerWheelT<WidthBits, NumLevels, TickType, CollectStats,
+                 PublishDeadline, Tracer>::schedule_bulk(
+    Iterator begin, Iterator end) {
+    // How many events ahead to prefetch. Enough to cover the memory
+    // latency, but not so many that they get evicted before use.
+    static const int PREFETCH_DISTANCE = 8;
+    Iterator ahead = begin;
+    for (int i = 0; i < PREFETCH_DISTANCE && ahead != end; ++i, ++ahead) {
+        timer_wheel_prefetch(ahead->first);
+    }
+    for (Iterator it = begin; it != end; ++it) {
+        if (ahead != end) {
+            timer_wheel_prefetch(ahead->first);
+            ++ahead;
+        }
+        assert(it->second > 0);
+        schedule_at_tick(it->first, now_[0] + it->second);
+    }
+}
 
+template<int WidthBits, int NumLevels, typename TickType, bool CollectStats,
+         bool PublishDeadline, typename Tracer>
+void TimerWheelT<WidthBits, NumLevels, TickType, CollectStats,
+                 PublishDeadline, Tracer>::find_slot(
+    Tick delta, int* level_out, size_t* slot_index_out) const {
     int level = 0;
     while (delta >= NUM_SLOTS) {
+        if (LIMITED_RANGE && level == MAX_LEVEL) {
+            // Too far in the future for even the outermost wheel.
+            // Park the event in the furthest slot; when that comes
+            // up, it'll get rescheduled with the remaining delta.
+            delta = MASK;
+            break;
+        }
         delta = (delta + (now_[level] & MASK)) >> WIDTH_BITS;
         ++level;
     }
+    *level_out = level;
+    *slot_index_out = (now_[level] + delta) & MASK;
+}
 
-    size_t slot_index = (now_[level] + delta) & MASK;
-    auto slot = &slots_[level][slot_index];
-    event->relink(slot);
+template<int WidthBits, int NumLevels, typename TickType, bool CollectStats,
+         bool PublishDeadline, typename Tracer>
+void TimerWheelT<WidthBits, NumLevels, TickType, CollectStats,
+                 PublishDeadline, Tracer>::reschedule_periodic(
+    TimerEventInterface* event, Tick period, bool skip_missed) {
+    assert(period > 0);
+    // The event was just taken out of its slot for execution, so it
+    // can be pushed straight into the new one without unlinking.
+    assert(!event->active());
+    // Count from the deadline of the event rather than from now, so
+    // that the period doesn't drift even if the event was executed
+    // late.
+    Tick at = Tick(event->scheduled_at());
+    Tick next = at + period;
+    if (skip_missed) {
+        // Don't execute the event again for every period that this
+        // call to advance() is going to pass through. Keep the phase
+        // though, and only skip whole periods.
+        Tick behind = Tick(advance_end_ - at);
+        if (behind >= period) {
+            next = at + (behind / period + 1) * period;
+        }
+    }
+    event->set_scheduled_at(next);
+    if (PublishDeadline) {
+        lower_next_deadline(next);
+    }
+
+    int level;
+    auto slot = claim_slot(Tick(next - now_[0]), &level);
+    this->count(&TimerWheelStats::rearms);
+    slot->push_event(event);
+}
+
+template<int WidthBits, int NumLevels, typename TickType, bool CollectStats,
+         bool PublishDeadline, typename Tracer>
+size_t TimerWheelT<WidthBits, NumLevels, TickType, CollectStats,
+                   PublishDeadline, Tracer>::promote_slot(
+    TimerWheelSlot* slot) {
+    size_t promoted = 0;
+    // Take the whole list out of the slot at once. Since every event
+    // is going to be moved, there's no point in unlinking them one by
+    // one.
+    auto event = slot->events_;
+    slot->events_ = NULL;
+    while (event) {
+        auto next = event->next_;
+        if (next) {
+            timer_wheel_prefetch(next);
+        }
+        if (is_due(event)) {
+            // Will get executed once the promotion is done.
+            slot->push_event(event);
+        } else {
+            // Usually promotions from the same slot will clump into a
+            // small number of slots on the next wheel, so this will
+            // mostly be prepending to a chain we've just touched.
+            int level;
+            claim_slot(Tick(event->scheduled_at() - now_[0]),
+                       &level)->push_event(event);
+            this->count(&TimerWheelStats::promotions);
+            ++promoted;
+        }
+        event = next;
+    }
+    return promoted;
 }
 
-void TimerWheel::schedule_in_range(TimerEventInterface* event,
-                                   Tick start, Tick end) {
+template<int WidthBits, int NumLevels, typename TickType, bool CollectStats,
+         bool PublishDeadline, typename Tracer>
+void TimerWheelT<WidthBits, NumLevels, TickType, CollectStats,
+                 PublishDeadline, Tracer>::schedule_lazy(
+    TimerEventInterface* event, Tick delta) {
+    assert(delta > 0);
+    if (event->active() &&
+        delta >= Tick(event->scheduled_at() - now_[0])) {
+        this->count(&TimerWheelStats::lazy_updates);
+        event->set_scheduled_at(now_[0] + delta);
+        return;
+    }
+    schedule(event, delta);
+}
+
+template<int WidthBits, int NumLevels, typename TickType, bool CollectStats,
+         bool PublishDeadline, typename Tracer>
+void TimerWheelT<WidthBits, NumLevels, TickType, CollectStats,
+                 PublishDeadline, Tracer>::schedule_in_range(
+    TimerEventInterface* event, Tick start, Tick end) {
     assert(end > start);
     if (event->active()) {
-        auto current = event->scheduled_at() - now_[0];
+        Tick current = Tick(event->scheduled_at() - now_[0]);
         // Event is already scheduled to happen in this range. Instead
         // of always using the old slot, we could check compute the
         // new slot and switch iff it's aligned better than the old one.
         // But it seems hard to believe that could be worthwhile.
         if (current >= start && current <= end) {
+            this->count(&TimerWheelStats::in_range_kept);
             return;
         }
     }
 
     // Zero as many bits (in WIDTH_BITS chunks) as possible
     // from "end" while still keeping the output in the
-    // right range.
-    Tick mask = ~0;
+    // right range. That's everything below the highest chunk in
+    // which "start" and "end" differ. The mask is kept rather than
+    // shifted back down, since that would also lose the top bits.
+    Tick mask = ~Tick(0);
+    Tick keep = mask;
     while ((start & mask) != (end & mask)) {
-        mask = (mask << WIDTH_BITS);
+        keep = mask;
+        mask = Tick(mask << WIDTH_BITS);
     }
 
-    Tick delta = end & (mask >> WIDTH_BITS);
+    Tick delta = end & keep;
 
     schedule(event, delta);
 }
 
-Tick TimerWheel::ticks_to_next_event(Tick max, int level) {
+template<int WidthBits, int NumLevels, typename TickType, bool CollectStats,
+         bool PublishDeadline, typename Tracer>
+void TimerWheelT<WidthBits, NumLevels, TickType, CollectStats,
+                 PublishDeadline, Tracer>::schedule_with_slack(
+    TimerEventInterface* event, Tick delta, Tick slack) {
+    assert(delta > 0);
+    Tick end = delta + std::min<Tick>(slack,
+                                      std::numeric_limits<Tick>::max() - delta);
+    if (end == delta) {
+        schedule(event, delta);
+        return;
+    }
+    if (event->active()) {
+        // Like in schedule_in_range(), an event that's already in the
+        // range is left alone. This keeps repeatedly pushing back a
+        // timeout cheap.
+        Tick current = Tick(event->scheduled_at() - now_[0]);
+        if (current >= delta && current <= end) {
+            this->count(&TimerWheelStats::in_range_kept);
+            return;
+        }
+    }
+    if (delta < NUM_SLOTS) {
+        // Look for a slot on the core wheel that's already in use.
+        // (The occupancy bit can be stale, in which case we just
+        // don't coalesce with anything).
+        Tick last = std::min<Tick>(end, MASK);
+        int found = next_occupied_slot(0, (now_[0] + delta) & MASK);
+        if (found < NUM_SLOTS && found <= last - delta) {
+            this->count(&TimerWheelStats::coalesced);
+            schedule(event, delta + found);
+            return;
+        }
+    }
+    schedule_in_range(event, delta, end);
+}
+
+template<int WidthBits, int NumLevels, typename TickType, bool CollectStats,
+         bool PublishDeadline, typename Tracer>
+size_t TimerWheelT<WidthBits, NumLevels, TickType, CollectStats,
+                   PublishDeadline, Tracer>::events_on_level(
+    int level) const {
+    size_t count = 0;
+    for (int i = 0; i < OCCUPANCY_WORDS; ++i) {
+        uint64_t bits = occupied_[level][i];
+        while (bits) {
+            int slot_index = i * 64 + timer_wheel_ctz(bits);
+            bits &= bits - 1;
+            for (auto event = slots_[level][slot_index].events();
+                 event != NULL; event = event->next_) {
+                ++count;
+            }
+        }
+    }
+    if (level == HEAP_LEVEL && heap_active_) {
+        count += outer_events(std::numeric_limits<size_t>::max());
+    }
+    return count;
+}
+
+template<int WidthBits, int NumLevels, typename TickType, bool CollectStats,
+         bool PublishDeadline, typename Tracer>
+size_t TimerWheelT<WidthBits, NumLevels, TickType, CollectStats,
+                   PublishDeadline, Tracer>::count_due_within(
+    Tick window) {
+    typedef typename std::make_signed<Tick>::type Diff;
+    size_t count = 0;
+    for (int level = 0; level < NUM_LEVELS; ++level) {
+        size_t current = now_[level] & MASK;
+        // The current slot only has events in it after an advance()
+        // that returned false, and those events are all due (or are
+        // about to be promoted, in which case their deadline says).
+        int steps = 0;
+        while (steps < NUM_SLOTS) {
+            int found = next_occupied_slot(level, (current + steps) & MASK);
+            if (found == NUM_SLOTS || steps + found >= NUM_SLOTS) {
+                break;
+            }
+            steps += found;
+            // The slots cover consecutive ranges of time, and no
+            // event can be in a slot that starts after its deadline.
+            // So once a slot starts past the window, so do all the
+            // events in the rest of the level.
+            if (steps > 0 && ticks_to_slot(level, steps) > window) {
+                break;
+            }
+            const auto& slot = slots_[level][(current + steps) & MASK];
+            for (auto event = slot.events(); event != NULL;
+                 event = event->next_) {
+                Tick ticks = Tick(event->scheduled_at() - now_[0]);
+                if (Diff(ticks) <= 0 || ticks <= window) {
+                    ++count;
+                }
+            }
+            ++steps;
+        }
+    }
+    // Like the slots, each heap bucket only has events due after it
+    // gets reached, and the buckets are reached in order.
+    for (uint64_t bits = heap_occupied_; bits; bits &= bits - 1) {
+        int bucket = timer_wheel_ctz(bits);
+        if (ticks_to_heap_bucket(bucket) > window) {
+            break;
+        }
+        for (auto event = heap_[bucket].events(); event != NULL;
+             event = event->next_) {
+            if (Tick(event->scheduled_at() - now_[0]) <= window) {
+                ++count;
+            }
+        }
+    }
+    return count;
+}
+
+template<int WidthBits, int NumLevels, typename TickType, bool CollectStats,
+         bool PublishDeadline, typename Tracer>
+std::vector<size_t> TimerWheelT<WidthBits, NumLevels, TickType, CollectStats,
+                                PublishDeadline, Tracer>::slot_histogram(
+    int level) const {
+    std::vector<size_t> counts(NUM_SLOTS);
+    size_t current = now_[level] & MASK;
+    for (int i = 0; i < OCCUPANCY_WORDS; ++i) {
+        uint64_t bits = occupied_[level][i];
+        while (bits) {
+            int slot_index = i * 64 + timer_wheel_ctz(bits);
+            bits &= bits - 1;
+            size_t& count = counts[(slot_index - current) & MASK];
+            for (auto event = slots_[level][slot_index].events();
+                 event != NULL; event = event->next_) {
+                ++count;
+            }
+        }
+    }
+    return counts;
+}
+
+template<int WidthBits, int NumLevels, typename TickType, bool CollectStats,
+         bool PublishDeadline, typename Tracer>
+int TimerWheelT<WidthBits, NumLevels, TickType, CollectStats,
+                PublishDeadline, Tracer>::next_occupied_slot(
+    int level, size_t start) {
+    const uint64_t* words = occupied_[level];
+    for (;;) {
+        size_t word = start / 64;
+        uint64_t bits = words[word] & (~uint64_t(0) << (start % 64));
+        int found = -1;
+        // The first word gets looked at twice; once for the bits at or
+        // after start, and after wrapping around for the bits before it.
+        for (int i = 0; i <= OCCUPANCY_WORDS; ++i) {
+            if (bits) {
+                found = word * 64 + timer_wheel_ctz(bits);
+                break;
+            }
+            word = (word + 1) % OCCUPANCY_WORDS;
+            bits = words[word];
+        }
+        if (found < 0) {
+            return NUM_SLOTS;
+        }
+        if (slots_[level][found].events()) {
+            return (found - start) & MASK;
+        }
+        // All events in the slot have been canceled since it was
+        // marked. Fix up the bitmap and keep looking.
+        clear_occupied(level, found);
+    }
+}
+
+template<int WidthBits, int NumLevels, typename TickType, bool CollectStats,
+         bool PublishDeadline, typename Tracer>
+TickType TimerWheelT<WidthBits, NumLevels, TickType, CollectStats,
+                     PublishDeadline, Tracer>::ticks_to_next_event(
+    Tick max, int level) {
+    if (level != 0) {
+        // The search would clobber the cache's record of where the
+        // closest event is.
+        next_event_.ticks = 0;
+        return find_next_event(max, level);
+    }
+    if (!mailbox_) {
+        return cached_next_event(max);
+    }
+    while (true) {
+        mailbox_->drain(this);
+        Tick ticks = cached_next_event(max);
+        // A request that was queued after the drain but before the
+        // new horizon got published might not have woken us up. So
+        // check for those and start over if needed.
+        mailbox_->set_horizon(ticks);
+        if (mailbox_->empty()) {
+            return ticks;
+        }
+    }
+}
+
+template<int WidthBits, int NumLevels, typename TickType, bool CollectStats,
+         bool PublishDeadline, typename Tracer>
+TickType TimerWheelT<WidthBits, NumLevels, TickType, CollectStats,
+                     PublishDeadline, Tracer>::cached_next_event(Tick max) {
     if (ticks_pending_) {
         return 0;
     }
-    // The actual current time (not the bitshifted time)
-    Tick now = now_[0];
+    auto& cache = next_event_;
+    if (cache.ticks != 0 && cache.now == now_[0]) {
+        if (!cache.found) {
+            // Nothing can have been scheduled before "ticks" without
+            // the result getting lowered.
+            if (max <= cache.ticks) {
+                return max;
+            }
+        } else if (cache.event ?
+                   (cache.slot->events_ == cache.event &&
+                    Tick(cache.event->scheduled_at()) == cache.event_at) :
+                   cache.slot->events_ != NULL) {
+            return std::min(cache.ticks, max);
+        }
+    }
+    Tick ticks = find_next_event(max, 0);
+    cache.now = now_[0];
+    cache.found = ticks < max;
+    cache.ticks = ticks;
+    if (cache.found && cache.event && cache.slot->events_ != cache.event) {
+        // Move the event to the head of the slot. The order of the
+        // events within a slot doesn't matter.
+        cache.event->relink(NULL);
+        cache.slot->push_event(cache.event);
+    }
+    return ticks;
+}
 
+template<int WidthBits, int NumLevels, typename TickType, bool CollectStats,
+         bool PublishDeadline, typename Tracer>
+TickType TimerWheelT<WidthBits, NumLevels, TickType, CollectStats,
+                     PublishDeadline, Tracer>::find_next_event(
+    Tick max, int level) {
+    if (ticks_pending_) {
+        return 0;
+    }
     // Smallest tick (relative to now) we've found.
     Tick min = max;
-    for (int i = 0; i < NUM_SLOTS; ++i) {
-        // Note: Unlike the uses of "now", slot index calculations really
-        // need to use now_.
-        auto slot_index = (now_[level] + 1 + i) & MASK;
-        // We've reached slot 0. In normal scheduling this would
-        // mean advancing the next wheel and promoting or executing
-        // those events.  So we need to look in that slot too
-        // before proceeding with the rest of this wheel. But we
-        // can't just accept those results outright, we need to
-        // check the best result there against the next slot on
-        // this wheel.
-        if (slot_index == 0 && level < MAX_LEVEL) {
-            // Exception: If we're in the core wheel, and slot 0 is
-            // not empty, there's no point in looking in the outer wheel.
-            // It's guaranteed that the events actually in slot 0 will be
-            // executed no later than anything in the outer wheel.
-            if (level > 0 || !slots_[level][slot_index].events()) {
-                auto up_slot_index = (now_[level + 1] + 1) & MASK;
-                const auto& slot = slots_[level + 1][up_slot_index];
-                for (auto event = slot.events(); event != NULL;
-                     event = event->next_) {
-                    min = std::min(min, event->scheduled_at() - now);
-                }
+    // The outermost level in use.
+    int top = heap_active_ ? HEAP_LEVEL - 1 : MAX_LEVEL;
+    if (level == 0 && heap_active_) {
+        // An event in the heap can come before events in the wheel
+        // (even ones on level 0, if the time is about to reach a heap
+        // bucket), so start with the heap.
+        int bucket = first_heap_bucket();
+        if (bucket >= 0) {
+            auto slot = &heap_[bucket];
+            if (auto event = closest_event(slot, bucket + HEAP_SHIFT,
+                                           ticks_to_heap_bucket(bucket),
+                                           &min)) {
+                set_next_event_source(slot, event);
             }
         }
-        bool found = false;
-        const auto& slot = slots_[level][slot_index];
-        for (auto event = slot.events(); event != NULL;
-             event = event->next_) {
-            min = std::min(min, event->scheduled_at() - now);
-            // In the core wheel all the events in a slot are guaranteed to
-            // run at the same time, so it's enough to just look at the first
-            // one.
-            if (level == 0) {
-                return min;
-            } else {
-                found = true;
-            }
+    }
+    size_t start = (now_[level] + 1) & MASK;
+    // Distance from start to the first slot with events, and to slot 0.
+    int found = next_occupied_slot(level, start);
+    int wrap = (NUM_SLOTS - start) & MASK;
+
+    // If we reach slot 0 before finding any events, normal scheduling
+    // would mean advancing the next wheel and promoting or executing
+    // those events.  So we need to look in that slot too before
+    // proceeding with the rest of this wheel. But we can't just
+    // accept those results outright, we need to check the best result
+    // there against the next slot on this wheel.
+    //
+    // Exception: If we're in the core wheel, and slot 0 is not
+    // empty, there's no point in looking in the outer wheel. It's
+    // guaranteed that the events actually in slot 0 will be executed
+    // no later than anything in the outer wheel.
+    if (level < top && wrap <= found &&
+        (level > 0 || wrap != found)) {
+        auto up_slot_index = (now_[level + 1] + 1) & MASK;
+        auto slot = &slots_[level + 1][up_slot_index];
+        Tick slot_ticks = ticks_to_slot(level + 1, 1);
+        if (auto event = closest_event(slot, WIDTH_BITS * (level + 1),
+                                       slot_ticks, &min)) {
+            set_next_event_source(slot, event);
         }
-        if (found) {
+    }
+
+    if (found < NUM_SLOTS) {
+        auto slot = &slots_[level][(start + found) & MASK];
+        Tick slot_ticks = ticks_to_slot(level, found + 1);
+        // In the core wheel all the events in a slot are run (or
+        // rescheduled, if schedule_lazy() was used) at the same time,
+        // so there's no need to look at the events at all.
+        if (level == 0) {
+            if (slot_ticks < min) {
+                min = slot_ticks;
+                set_next_event_source(slot, NULL);
+            }
             return min;
         }
+        if (auto event = closest_event(slot, WIDTH_BITS * level,
+                                       slot_ticks, &min)) {
+            set_next_event_source(slot, event);
+        }
+        return min;
     }
 
     // Nothing found on this wheel, try the next one (unless the wheel can't
-    // possibly contain an event scheduled earlier than "max").
-    if (level < MAX_LEVEL &&
-        (max >> (WIDTH_BITS * level + 1)) > 0) {
-        return ticks_to_next_event(max, level + 1);
+    // possibly contain an event scheduled earlier than what's been
+    // found so far). The next wheel only improves on that, which keeps
+    // the cache's record of where the result came from right.
+    if (level < top &&
+        (min >> (WIDTH_BITS * level + 1)) > 0) {
+        return find_next_event(min, level + 1);
+    }
+
+    return min;
+}
+
+template<int WidthBits, int NumLevels, typename TickType, bool CollectStats,
+         bool PublishDeadline, typename Tracer>
+template<typename Budget>
+bool TimerWheelT<WidthBits, NumLevels, TickType, CollectStats,
+                 PublishDeadline, Tracer>::process_outer_levels(
+    Budget budget) {
+    bool was_active = heap_active_;
+    // Not when resuming a partially processed tick, since there might
+    // be due events left in an outer slot.
+    if (!ticks_pending_) {
+        update_outer_levels();
+    }
+    if (!heap_active_) {
+        // If the events were just moved from the heap, they're already
+        // placed relative to the current time, so the outer levels
+        // mustn't be advanced again.
+        if (was_active) {
+            return true;
+        }
+        return advance_with_budget(1, budget, HEAP_LEVEL);
+    }
+    size_t promoted = promote_heap();
+    if (promoted) {
+        tracer().on_promote(HEAP_LEVEL, promoted);
+    }
+    return budget.promoted(promoted);
+}
+
+template<int WidthBits, int NumLevels, typename TickType, bool CollectStats,
+         bool PublishDeadline, typename Tracer>
+size_t TimerWheelT<WidthBits, NumLevels, TickType, CollectStats,
+                   PublishDeadline, Tracer>::promote_heap() {
+    // When the time wraps around to 0, it's the last bucket's turn.
+    int bit = now_[0] ? timer_wheel_ctz(now_[0]) :
+        std::numeric_limits<Tick>::digits - 1;
+    int bucket = bit - HEAP_SHIFT;
+    if (!((heap_occupied_ >> bucket) & 1)) {
+        return 0;
     }
+    heap_occupied_ &= ~(uint64_t(1) << bucket);
+    size_t promoted = 0;
+    auto event = heap_[bucket].events_;
+    heap_[bucket].events_ = NULL;
+    while (event) {
+        auto next = event->next_;
+        // The bit is now the same in the deadline and the current
+        // time, so every event moves to an earlier bucket or into the
+        // wheel. Events that are due go to the current slot of the
+        // core wheel, which gets processed next.
+        int level;
+        claim_slot(Tick(event->scheduled_at() - now_[0]),
+                   &level)->push_event(event);
+        this->count(&TimerWheelStats::promotions);
+        ++promoted;
+        event = next;
+    }
+    return promoted;
+}
+
+template<int WidthBits, int NumLevels, typename TickType, bool CollectStats,
+         bool PublishDeadline, typename Tracer>
+void TimerWheelT<WidthBits, NumLevels, TickType, CollectStats,
+                 PublishDeadline, Tracer>::update_outer_levels() {
+    if (!HEAP_SUPPORTED) {
+        return;
+    }
+    bool heap = heap_active_;
+    switch (outer_mode_) {
+    case OUTER_WHEEL:
+        heap = false;
+        break;
+    case OUTER_HEAP:
+        heap = true;
+        break;
+    case OUTER_ADAPTIVE:
+        // Some hysteresis, so that a count hovering around the limit
+        // doesn't move the events back and forth all the time.
+        if (heap_active_) {
+            heap = outer_events(HEAP_MAX_EVENTS) < HEAP_MAX_EVENTS;
+        } else {
+            heap = outer_events(HEAP_MIN_EVENTS) < HEAP_MIN_EVENTS;
+        }
+        break;
+    }
+    if (heap == heap_active_) {
+        return;
+    }
+    if (heap) {
+        move_to_heap();
+    } else {
+        move_to_wheel();
+    }
+    next_event_.ticks = 0;
+}
+
+template<int WidthBits, int NumLevels, typename TickType, bool CollectStats,
+         bool PublishDeadline, typename Tracer>
+void TimerWheelT<WidthBits, NumLevels, TickType, CollectStats,
+                 PublishDeadline, Tracer>::move_to_heap() {
+    heap_active_ = true;
+    for (int level = HEAP_LEVEL; level < NUM_LEVELS; ++level) {
+        for (int i = 0; i < OCCUPANCY_WORDS; ++i) {
+            uint64_t bits = occupied_[level][i];
+            occupied_[level][i] = 0;
+            while (bits) {
+                int slot_index = i * 64 + timer_wheel_ctz(bits);
+                bits &= bits - 1;
+                auto slot = &slots_[level][slot_index];
+                auto event = slot->events_;
+                slot->events_ = NULL;
+                while (event) {
+                    auto next = event->next_;
+                    int new_level;
+                    claim_slot(Tick(event->scheduled_at() - now_[0]),
+                               &new_level)->push_event(event);
+                    event = next;
+                }
+            }
+        }
+    }
+}
 
-    return max;
+template<int WidthBits, int NumLevels, typename TickType, bool CollectStats,
+         bool PublishDeadline, typename Tracer>
+void TimerWheelT<WidthBits, NumLevels, TickType, CollectStats,
+                 PublishDeadline, Tracer>::move_to_wheel() {
+    heap_active_ = false;
+    for (int i = HEAP_LEVEL; i < NUM_LEVELS; ++i) {
+        now_[i] = now_[0] >> (WIDTH_BITS * i);
+    }
+    while (heap_occupied_) {
+        int bucket = timer_wheel_ctz(heap_occupied_);
+        heap_occupied_ &= heap_occupied_ - 1;
+        auto event = heap_[bucket].events_;
+        heap_[bucket].events_ = NULL;
+        while (event) {
+            auto next = event->next_;
+            int level;
+            claim_slot(Tick(event->scheduled_at() - now_[0]),
+                       &level)->push_event(event);
+            event = next;
+        }
+    }
+}
+
+template<int WidthBits, int NumLevels, typename TickType, bool CollectStats,
+         bool PublishDeadline, typename Tracer>
+size_t TimerWheelT<WidthBits, NumLevels, TickType, CollectStats,
+                   PublishDeadline, Tracer>::outer_events(
+    size_t limit) const {
+    size_t count = 0;
+    for (uint64_t bits = heap_occupied_; bits; bits &= bits - 1) {
+        for (auto event = heap_[timer_wheel_ctz(bits)].events();
+             event != NULL && count < limit; event = event->next_) {
+            ++count;
+        }
+    }
+    for (int level = HEAP_LEVEL; level < NUM_LEVELS; ++level) {
+        for (int i = 0; i < OCCUPANCY_WORDS; ++i) {
+            for (uint64_t bits = occupied_[level][i]; bits;
+                 bits &= bits - 1) {
+                int slot_index = i * 64 + timer_wheel_ctz(bits);
+                for (auto event = slots_[level][slot_index].events();
+                     event != NULL && count < limit; event = event->next_) {
+                    ++count;
+                }
+            }
+        }
+    }
+    return count;
 }
 
 #endif //  RATAS_TIMER_WHEEL_H